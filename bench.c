@@ -0,0 +1,1429 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Benchmark suite for hashlib.
+ *
+ * Every configuration (number of keys, key length, lookup distribution,
+ * number of threads) is measured for the operations insert, build,
+ * ingest, hit lookup, miss lookup, remove, store and retrieve, and for
+ * freezing and lookups in a frozen table, lookups with a Bloom filter in
+ * front of a table or frozen table, lookups in a table generated by
+ * HASHLIB_DECLARE and in a hashlib_u64 table.  Results are written to
+ * stdout as CSV, one line per operation, so that runs of different
+ * releases can be compared with standard tools.  hashlib_build and hashlib_ingest are
+ * measured with the same numbers of threads as the lookups.  Progress is
+ * written to stderr.
+ *
+ * Latencies are measured per operation and collected in a log-linear
+ * histogram; every sample includes the cost of one clock read.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <err.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hashlib.h"
+#include "hashlib_typed.h"
+#include "proc_status.h"
+
+#define BENCH_FILE "bench.hashlib"
+
+/* tables sharing the pool of bench_pool */
+#define BENCH_POOL_TABLES 4
+
+/* bits per key of the filters of the filter_* and frozen_filter_* runs */
+#define BENCH_FILTER_BITS 10
+
+#define MAX_LIST 32
+
+/* log-linear histogram: 16 linear sub-buckets per power of two */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_SIZE     (64 * HIST_SUB)
+
+enum distribution {
+    UNIFORM,
+    ZIPF
+};
+
+struct histogram {
+    uint64_t count[HIST_SIZE];
+    uint64_t samples;
+    uint64_t max;
+};
+
+struct keyset {
+    char *pool;
+    size_t n;
+    size_t len;
+};
+
+struct zipf {
+    size_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+struct config {
+    size_t sizes[MAX_LIST];
+    size_t nsizes;
+    size_t lens[MAX_LIST];
+    size_t nlens;
+    enum distribution dists[MAX_LIST];
+    size_t ndists;
+    unsigned int threads[MAX_LIST];
+    size_t nthreads;
+    double theta;
+    uint64_t seed;
+};
+
+struct result {
+    const char *op;
+    size_t keys;
+    size_t keylen;
+    const char *dist;
+    unsigned int threads;
+    uint64_t ops;
+    uint64_t ns;
+    struct histogram *hist;
+};
+
+typedef void *(*getter)(void *table, char *key);
+
+struct lookup_arg {
+    void *table;
+    getter get;
+    struct keyset *keys;
+    struct zipf *zipf;
+    enum distribution dist;
+    uint64_t ops;
+    uint64_t seed;
+    uint64_t found;
+    pthread_barrier_t *barrier;
+    struct histogram hist;
+};
+
+HASHLIB_DECLARE(typed, char *, uint64_t, hashlib_typed_string_hash,
+                hashlib_typed_string_equal)
+
+static uint64_t values_dummy;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x  = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x  = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+static void *bench_calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    p = calloc(nmemb, size);
+
+    if (!p)
+        err(EXIT_FAILURE, "calloc");
+
+    return p;
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+    unsigned int msb;
+
+    if (v < HIST_SUB)
+        return v;
+
+    msb = 63 - __builtin_clzll(v);
+
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB
+           + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(unsigned int index)
+{
+    unsigned int shift;
+
+    if (index < HIST_SUB)
+        return index;
+
+    shift = index / HIST_SUB - 1;
+
+    return (uint64_t) (HIST_SUB + index % HIST_SUB) << shift;
+}
+
+static inline void hist_add(struct histogram *h, uint64_t v)
+{
+    h->count[hist_index(v)]++;
+    h->samples++;
+
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(struct histogram *dst, struct histogram *src)
+{
+    unsigned int i;
+
+    for (i = 0; i < HIST_SIZE; i++)
+        dst->count[i] += src->count[i];
+
+    dst->samples += src->samples;
+
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static uint64_t hist_percentile(struct histogram *h, double p)
+{
+    uint64_t rank, sum;
+    unsigned int i;
+
+    if (!h->samples)
+        return 0;
+
+    rank = (uint64_t) ceil(p * h->samples);
+
+    if (rank == 0)
+        rank = 1;
+
+    sum = 0;
+
+    for (i = 0; i < HIST_SIZE; i++) {
+        sum += h->count[i];
+
+        if (sum >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+
+    return h->max;
+}
+
+static const char *dist_name(enum distribution d)
+{
+    return d == ZIPF ? "zipf" : "uniform";
+}
+
+/*
+ * Key i of a set consists of pseudo random characters followed by i in
+ * base 62, so keys are unique and keys of the miss set (which continues
+ * with index n) never hit.
+ */
+static void keyset_init(struct keyset *k, size_t n, size_t len, size_t first,
+                        uint64_t seed)
+{
+    static const char alnum[] =
+        "0123456789"
+        "abcdefghijklmnopqrstuvwxyz"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    size_t i, j, digits, max;
+    uint64_t state, x;
+    char *key;
+
+    digits = 1;
+
+    for (max = first + n; max >= 62; max /= 62)
+        digits++;
+
+    if (len < digits)
+        errx(EXIT_FAILURE, "key length %zu too short for %zu keys",
+             len, first + n);
+
+    k->n    = n;
+    k->len  = len;
+    k->pool = bench_calloc(n, len + 1);
+
+    for (i = 0; i < n; i++) {
+        key   = k->pool + i * (len + 1);
+        state = splitmix64(seed ^ (first + i)) | 1;
+
+        for (j = 0; j < len - digits; j++)
+            key[j] = alnum[xorshift64(&state) % 62];
+
+        for (j = len, x = first + i; j > len - digits; j--, x /= 62)
+            key[j - 1] = alnum[x % 62];
+
+        key[len] = '\0';
+    }
+}
+
+static inline char *keyset_get(struct keyset *k, size_t i)
+{
+    return k->pool + i * (k->len + 1);
+}
+
+static void keyset_free(struct keyset *k)
+{
+    free(k->pool);
+    k->pool = NULL;
+}
+
+/* Zipfian generator by Gray et al., "Quickly generating billion-record
+ * synthetic databases", as used by YCSB */
+static void zipf_init(struct zipf *z, size_t n, double theta)
+{
+    double zeta2;
+    size_t i;
+
+    z->n     = n;
+    z->theta = theta;
+    z->zetan = 0;
+
+    for (i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow((double) i, theta);
+
+    zeta2    = 1.0 + 1.0 / pow(2.0, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta   = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static inline size_t zipf_next(struct zipf *z, uint64_t *state)
+{
+    double u, uz;
+    size_t rank;
+
+    u  = (xorshift64(state) >> 11) * (1.0 / 9007199254740992.0);
+    uz = u * z->zetan;
+
+    if (uz < 1.0)
+        rank = 0;
+    else if (uz < 1.0 + pow(0.5, z->theta))
+        rank = 1;
+    else
+        rank = (size_t) (z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+
+    if (rank >= z->n)
+        rank = z->n - 1;
+
+    /* scatter popular ranks over the key set */
+    return splitmix64(rank) % z->n;
+}
+
+static void print_header(void)
+{
+    puts("op,keys,keylen,dist,threads,ops,ns_per_op,mops,"
+         "p50_ns,p90_ns,p99_ns,p999_ns,max_ns,peak_rss");
+}
+
+static void print_result(struct result *r)
+{
+    double ns_per_op, mops;
+
+    ns_per_op = r->ops ? (double) r->ns * r->threads / r->ops : 0;
+    mops      = r->ns ? (double) r->ops * 1000.0 / r->ns : 0;
+
+    printf("%s,%zu,%zu,%s,%u,%llu,%.1f,%.3f,",
+           r->op, r->keys, r->keylen, r->dist, r->threads,
+           (unsigned long long) r->ops, ns_per_op, mops);
+
+    if (r->hist)
+        printf("%llu,%llu,%llu,%llu,%llu,",
+               (unsigned long long) hist_percentile(r->hist, 0.5),
+               (unsigned long long) hist_percentile(r->hist, 0.9),
+               (unsigned long long) hist_percentile(r->hist, 0.99),
+               (unsigned long long) hist_percentile(r->hist, 0.999),
+               (unsigned long long) r->hist->max);
+    else
+        fputs(",,,,,", stdout);
+
+    printf("%lu\n", read_VmHWM());
+    fflush(stdout);
+}
+
+static void bench_insert(struct result *r, struct hashlib_hash *hash,
+                         struct keyset *keys)
+{
+    static struct histogram hist;
+    uint64_t start, t, prev;
+    size_t i;
+
+    memset(&hist, 0, sizeof(hist));
+
+    start = prev = now_ns();
+
+    for (i = 0; i < keys->n; i++) {
+        hashlib_put(hash, keyset_get(keys, i), &values_dummy);
+        t = now_ns();
+        hist_add(&hist, t - prev);
+        prev = t;
+    }
+
+    r->op   = "insert";
+    r->ops  = keys->n;
+    r->ns   = prev - start;
+    r->hist = &hist;
+}
+
+static void bench_remove(struct result *r, struct hashlib_hash *hash,
+                         struct keyset *keys)
+{
+    static struct histogram hist;
+    uint64_t start, t, prev;
+    size_t i;
+
+    memset(&hist, 0, sizeof(hist));
+
+    start = prev = now_ns();
+
+    for (i = 0; i < keys->n; i++) {
+        hashlib_remove(hash, keyset_get(keys, i));
+        t = now_ns();
+        hist_add(&hist, t - prev);
+        prev = t;
+    }
+
+    r->op   = "remove";
+    r->ops  = keys->n;
+    r->ns   = prev - start;
+    r->hist = &hist;
+}
+
+static void *lookup_thread(void *p)
+{
+    struct lookup_arg *a;
+    uint64_t i, t, prev, state;
+    size_t index;
+
+    a     = p;
+    state = a->seed | 1;
+
+    pthread_barrier_wait(a->barrier);
+
+    prev = now_ns();
+
+    for (i = 0; i < a->ops; i++) {
+        if (a->dist == ZIPF)
+            index = zipf_next(a->zipf, &state);
+        else
+            index = xorshift64(&state) % a->keys->n;
+
+        if (a->get(a->table, keyset_get(a->keys, index)))
+            a->found++;
+
+        t = now_ns();
+        hist_add(&a->hist, t - prev);
+        prev = t;
+    }
+
+    pthread_barrier_wait(a->barrier);
+
+    return NULL;
+}
+
+static void *get_hash(void *table, char *key)
+{
+    return hashlib_get(table, key);
+}
+
+static void *get_frozen(void *table, char *key)
+{
+    return hashlib_frozen_get(table, key);
+}
+
+static void *get_typed(void *table, char *key)
+{
+    return typed_get(table, key);
+}
+
+static void bench_lookup(struct result *r, void *table, getter get,
+                         struct keyset *keys, struct zipf *zipf,
+                         enum distribution dist, unsigned int threads,
+                         uint64_t seed)
+{
+    static struct histogram hist;
+    struct lookup_arg *args;
+    pthread_t *tids;
+    pthread_barrier_t barrier;
+    uint64_t start;
+    unsigned int i;
+    int ret;
+
+    memset(&hist, 0, sizeof(hist));
+
+    args = bench_calloc(threads, sizeof(*args));
+    tids = bench_calloc(threads, sizeof(*tids));
+
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+
+    for (i = 0; i < threads; i++) {
+        args[i].table   = table;
+        args[i].get     = get;
+        args[i].keys    = keys;
+        args[i].zipf    = zipf;
+        args[i].dist    = dist;
+        args[i].ops     = keys->n / threads + (i < keys->n % threads);
+        args[i].seed    = splitmix64(seed + i);
+        args[i].barrier = &barrier;
+
+        ret = pthread_create(&tids[i], NULL, lookup_thread, &args[i]);
+
+        if (ret)
+            errx(EXIT_FAILURE, "pthread_create: %s", strerror(ret));
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+    pthread_barrier_wait(&barrier);
+    r->ns = now_ns() - start;
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        hist_merge(&hist, &args[i].hist);
+    }
+
+    pthread_barrier_destroy(&barrier);
+
+    r->ops     = keys->n;
+    r->threads = threads;
+    r->dist    = dist_name(dist);
+    r->hist    = &hist;
+
+    free(args);
+    free(tids);
+}
+
+/* lookups in a table whose slot array is backed by huge pages and
+ * interleaved over the NUMA nodes, to compare with lookup_hit */
+static void bench_huge(struct result *r, struct config *c,
+                       struct keyset *hits, struct keyset *misses,
+                       struct zipf *zipf)
+{
+    struct hashlib_hash *hash;
+    size_t d, i, t;
+
+    hash = hashlib_hash_new_alloc(hits->n, HASHLIB_ALLOC_HUGETLB
+                                  | HASHLIB_ALLOC_INTERLEAVE, -1);
+
+    for (i = 0; i < hits->n; i++)
+        hashlib_put(hash, keyset_get(hits, i), &values_dummy);
+
+    for (d = 0; d < c->ndists; d++) {
+        for (t = 0; t < c->nthreads; t++) {
+            r->op = "huge_hit";
+            bench_lookup(r, hash, get_hash, hits, zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(r);
+
+            r->op = "huge_miss";
+            bench_lookup(r, hash, get_hash, misses, zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(r);
+        }
+    }
+
+    hashlib_hash_delete(hash);
+}
+
+/* lookups in a table with about 64 keys per slot, for each simd level
+ * the cpu supports */
+static void bench_simd(struct result *r, struct keyset *hits,
+                       struct keyset *misses, uint64_t seed)
+{
+    static const char *ops[][2] = {
+        {"simd_scalar_hit", "simd_scalar_miss"},
+        {"simd_sse2_hit", "simd_sse2_miss"},
+        {"simd_avx2_hit", "simd_avx2_miss"}
+    };
+    struct hashlib_hash *hash;
+    size_t i;
+    int level, max;
+
+    hash = hashlib_hash_new(hits->n / 64 + 1);
+
+    for (i = 0; i < hits->n; i++)
+        hashlib_put(hash, keyset_get(hits, i), &values_dummy);
+
+    max = hashlib_set_simd_level(HASHLIB_SIMD_AVX2);
+
+    for (level = HASHLIB_SIMD_SCALAR; level <= max; level++) {
+        hashlib_set_simd_level(level);
+
+        r->op = ops[level][0];
+        bench_lookup(r, hash, get_hash, hits, NULL, UNIFORM, 1, seed);
+        print_result(r);
+
+        r->op = ops[level][1];
+        bench_lookup(r, hash, get_hash, misses, NULL, UNIFORM, 1, seed);
+        print_result(r);
+    }
+
+    hashlib_set_simd_level(max);
+    hashlib_hash_delete(hash);
+}
+
+static void bench_build(struct result *r, struct keyset *keys,
+                        unsigned int threads)
+{
+    struct hashlib_hash *hash;
+    char **k;
+    void **v;
+    uint64_t start;
+    size_t i;
+
+    k = bench_calloc(keys->n, sizeof(*k));
+    v = bench_calloc(keys->n, sizeof(*v));
+
+    for (i = 0; i < keys->n; i++) {
+        k[i] = keyset_get(keys, i);
+        v[i] = &values_dummy;
+    }
+
+    hash = hashlib_hash_new(keys->n);
+
+    start = now_ns();
+    hashlib_build(hash, k, v, keys->n, threads, HASHLIB_BUILD_UNIQUE);
+    r->ns = now_ns() - start;
+
+    r->op      = "build";
+    r->ops     = keys->n;
+    r->threads = threads;
+    r->hist    = NULL;
+
+    hashlib_hash_delete(hash);
+
+    free(k);
+    free(v);
+}
+
+/* keys submitted at a time by bench_ingest, like records read from a stream */
+#define BENCH_INGEST_BATCH 10000
+
+static void bench_ingest(struct result *r, struct keyset *keys,
+                         unsigned int threads)
+{
+    struct hashlib_ingest *ingest;
+    struct hashlib_hash *hash;
+    char **k;
+    void **v;
+    uint64_t start;
+    size_t i;
+
+    k = bench_calloc(keys->n, sizeof(*k));
+    v = bench_calloc(keys->n, sizeof(*v));
+
+    for (i = 0; i < keys->n; i++) {
+        k[i] = keyset_get(keys, i);
+        v[i] = &values_dummy;
+    }
+
+    hash   = hashlib_hash_new(keys->n);
+    ingest = hashlib_ingest_new(hash, threads);
+
+    start = now_ns();
+
+    for (i = 0; i < keys->n; i += BENCH_INGEST_BATCH)
+        hashlib_ingest_submit(ingest, k + i, v + i,
+                              keys->n - i < BENCH_INGEST_BATCH
+                              ? keys->n - i : BENCH_INGEST_BATCH);
+
+    hashlib_ingest_flush(ingest);
+    r->ns = now_ns() - start;
+
+    r->op      = "ingest";
+    r->ops     = keys->n;
+    r->threads = threads;
+    r->hist    = NULL;
+
+    hashlib_ingest_delete(ingest);
+    hashlib_hash_delete(hash);
+
+    free(k);
+    free(v);
+}
+
+static struct hashlib_frozen *bench_freeze(struct result *r,
+                                           struct keyset *keys)
+{
+    struct hashlib_hash *hash;
+    struct hashlib_frozen *frozen;
+    uint64_t start;
+    size_t i;
+
+    hash = hashlib_hash_new(keys->n);
+
+    for (i = 0; i < keys->n; i++)
+        hashlib_put(hash, keyset_get(keys, i), &values_dummy);
+
+    start  = now_ns();
+    frozen = hashlib_freeze(hash);
+    r->ns  = now_ns() - start;
+
+    r->op   = "freeze";
+    r->ops  = keys->n;
+    r->hist = NULL;
+
+    return frozen;
+}
+
+static struct typed *bench_typed_insert(struct result *r, struct keyset *keys)
+{
+    static struct histogram hist;
+    struct typed *t;
+    uint64_t start, now, prev;
+    size_t i;
+
+    memset(&hist, 0, sizeof(hist));
+
+    t = typed_new(keys->n);
+
+    if (!t)
+        err(EXIT_FAILURE, "typed_new");
+
+    start = prev = now_ns();
+
+    for (i = 0; i < keys->n; i++) {
+        typed_put(t, keyset_get(keys, i), i);
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op   = "typed_insert";
+    r->ops  = keys->n;
+    r->ns   = prev - start;
+    r->hist = &hist;
+
+    return t;
+}
+
+/* hashlib_u64 with the same number of keys, keys are scrambled indices */
+static void bench_u64(struct result *r, size_t n, uint64_t seed)
+{
+    static struct histogram hist;
+    struct hashlib_u64 *hash;
+    uint64_t start, now, prev, state;
+    size_t i;
+
+    hash = hashlib_u64_new(n);
+
+    memset(&hist, 0, sizeof(hist));
+    start = prev = now_ns();
+
+    for (i = 0; i < n; i++) {
+        hashlib_u64_put(hash, splitmix64(seed + i), &values_dummy);
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op   = "u64_insert";
+    r->ops  = n;
+    r->ns   = prev - start;
+    r->hist = &hist;
+    print_result(r);
+
+    memset(&hist, 0, sizeof(hist));
+    state = seed | 1;
+    start = prev = now_ns();
+
+    for (i = 0; i < n; i++) {
+        hashlib_u64_get(hash, splitmix64(seed + xorshift64(&state) % n));
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op = "u64_hit";
+    r->ns = prev - start;
+    print_result(r);
+
+    memset(&hist, 0, sizeof(hist));
+    start = prev = now_ns();
+
+    for (i = 0; i < n; i++) {
+        hashlib_u64_get(hash, splitmix64(seed + n + xorshift64(&state) % n));
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op = "u64_miss";
+    r->ns = prev - start;
+    print_result(r);
+
+    hashlib_u64_delete(hash);
+}
+
+/* several tables over one key universe, with the keys interned in a pool
+ * and looked up by handle */
+static void bench_pool(struct result *r, struct keyset *hits, uint64_t seed)
+{
+    static struct histogram hist;
+    struct hashlib_pool *pool;
+    struct hashlib_hash *hash[BENCH_POOL_TABLES];
+    const char **handles;
+    uint64_t start, now, prev, state;
+    size_t i;
+    unsigned int j;
+
+    pool    = hashlib_pool_new(hits->n);
+    handles = calloc(hits->n, sizeof(*handles));
+
+    if (!handles)
+        err(EXIT_FAILURE, "calloc");
+
+    for (j = 0; j < BENCH_POOL_TABLES; j++) {
+        hash[j] = hashlib_hash_new(hits->n);
+        hashlib_set_pool(hash[j], pool);
+    }
+
+    memset(&hist, 0, sizeof(hist));
+    start = prev = now_ns();
+
+    for (i = 0; i < hits->n; i++) {
+        handles[i] = hashlib_intern(pool, keyset_get(hits, i));
+
+        for (j = 0; j < BENCH_POOL_TABLES; j++)
+            hashlib_put_interned(hash[j], handles[i], &values_dummy);
+
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op   = "pool_insert";
+    r->ops  = hits->n;
+    r->ns   = prev - start;
+    r->hist = &hist;
+    print_result(r);
+
+    memset(&hist, 0, sizeof(hist));
+    state = seed | 1;
+    start = prev = now_ns();
+
+    for (i = 0; i < hits->n; i++) {
+        hashlib_get_interned(hash[0],
+                             handles[xorshift64(&state) % hits->n]);
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op = "interned_hit";
+    r->ns = prev - start;
+    print_result(r);
+
+    for (j = 0; j < BENCH_POOL_TABLES; j++)
+        hashlib_hash_delete(hash[j]);
+
+    hashlib_pool_delete(pool);
+    free(handles);
+}
+
+static int bench_count_key(const char *key, void *value, void *arg)
+{
+    (void) key;
+    (void) value;
+
+    ++*(size_t *) arg;
+
+    return 0;
+}
+
+/* inserts into an ordered table, then queries prefixes of two characters */
+static void bench_ordered(struct result *r, struct keyset *hits,
+                          uint64_t seed)
+{
+    static struct histogram hist;
+    struct hashlib_hash *hash;
+    uint64_t start, now, prev, state;
+    size_t i, found;
+    char prefix[3];
+
+    hash = hashlib_hash_new(hits->n);
+    hashlib_set_ordered(hash, 1);
+
+    memset(&hist, 0, sizeof(hist));
+    start = prev = now_ns();
+
+    for (i = 0; i < hits->n; i++) {
+        hashlib_put(hash, keyset_get(hits, i), &values_dummy);
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op   = "ordered_insert";
+    r->ops  = hits->n;
+    r->ns   = prev - start;
+    r->hist = &hist;
+    print_result(r);
+
+    memset(&hist, 0, sizeof(hist));
+    state = seed | 1;
+    found = 0;
+    start = prev = now_ns();
+
+    for (i = 0; i < hits->n / 64 + 1; i++) {
+        memcpy(prefix, keyset_get(hits, xorshift64(&state) % hits->n), 2);
+        prefix[hits->len < 2 ? hits->len : 2] = '\0';
+
+        hashlib_prefix(hash, prefix, bench_count_key, &found);
+        now = now_ns();
+        hist_add(&hist, now - prev);
+        prev = now;
+    }
+
+    r->op  = "prefix";
+    r->ops = i;
+    r->ns  = prev - start;
+    print_result(r);
+
+    hashlib_hash_delete(hash);
+}
+
+/*
+ * counters incremented at random keys: by hashlib_remove and hashlib_put,
+ * by hashlib_replace, and in place through hashlib_get_ref
+ */
+static void bench_update(struct result *r, struct keyset *hits, uint64_t seed)
+{
+    static const char *ops[] = { "update_remove_put", "update_replace",
+                                 "update_ref" };
+    static struct histogram hist;
+    struct hashlib_hash *hash;
+    uint64_t start, now, prev, state;
+    uintptr_t count;
+    size_t i;
+    unsigned int op;
+    void **ref;
+    char *key;
+
+    hash = hashlib_hash_new(hits->n);
+
+    for (i = 0; i < hits->n; i++)
+        hashlib_put(hash, keyset_get(hits, i), (void *) (uintptr_t) 1);
+
+    for (op = 0; op < sizeof(ops) / sizeof(*ops); op++) {
+        memset(&hist, 0, sizeof(hist));
+        state = seed | 1;
+        start = prev = now_ns();
+
+        for (i = 0; i < hits->n; i++) {
+            key = keyset_get(hits, xorshift64(&state) % hits->n);
+
+            if (op == 2) {
+                ref  = hashlib_get_ref(hash, key);
+                *ref = (void *) ((uintptr_t) *ref + 1);
+            } else {
+                count = (uintptr_t) hashlib_get(hash, key);
+
+                if (op == 0) {
+                    hashlib_remove(hash, key);
+                    hashlib_put(hash, key, (void *) (count + 1));
+                } else {
+                    hashlib_replace(hash, key, (void *) (count + 1));
+                }
+            }
+
+            now = now_ns();
+            hist_add(&hist, now - prev);
+            prev = now;
+        }
+
+        r->op   = ops[op];
+        r->ops  = hits->n;
+        r->ns   = prev - start;
+        r->hist = &hist;
+        print_result(r);
+    }
+
+    hashlib_hash_delete(hash);
+}
+
+static void bench_diff_nop(const char *key, void *a, void *b, void *arg)
+{
+    (void) key;
+    (void) a;
+    (void) b;
+    (void) arg;
+}
+
+/* merges a table of the second half of the keys into one of the first
+ * half, then diffs the result against a clone with every 100th key removed */
+static void bench_merge(struct result *r, struct keyset *keys,
+                        unsigned int threads)
+{
+    struct hashlib_hash *dst, *src, *clone;
+    uint64_t start;
+    size_t i;
+
+    dst = hashlib_hash_new(keys->n);
+    src = hashlib_hash_new(keys->n);
+
+    for (i = 0; i < keys->n; i++)
+        hashlib_put(i < keys->n / 2 ? dst : src, keyset_get(keys, i),
+                    &values_dummy);
+
+    start = now_ns();
+    hashlib_merge(dst, src, NULL, threads);
+    r->ns = now_ns() - start;
+
+    r->op      = "merge";
+    r->ops     = keys->n - keys->n / 2;
+    r->threads = threads;
+    r->hist    = NULL;
+    print_result(r);
+
+    clone = hashlib_clone(dst);
+
+    for (i = 0; i < keys->n; i += 100)
+        hashlib_remove(clone, keyset_get(keys, i));
+
+    start = now_ns();
+    hashlib_diff(dst, clone, NULL, bench_diff_nop, NULL, threads);
+    r->ns = now_ns() - start;
+
+    r->op  = "diff";
+    r->ops = keys->n;
+    print_result(r);
+
+    hashlib_hash_delete(clone);
+    hashlib_hash_delete(src);
+    hashlib_hash_delete(dst);
+}
+
+static void bench_store(struct result *r, struct hashlib_hash *hash)
+{
+    uint64_t start;
+
+    start = now_ns();
+    hashlib_store(hash, BENCH_FILE);
+    r->ns = now_ns() - start;
+
+    r->op   = "store";
+    r->ops  = hashlib_count(hash);
+    r->hist = NULL;
+}
+
+static void bench_retrieve(struct result *r)
+{
+    struct hashlib_hash *hash;
+    uint64_t start;
+
+    start = now_ns();
+    hash  = hashlib_retrieve(BENCH_FILE, NULL, free);
+    r->ns = now_ns() - start;
+
+    r->op   = "retrieve";
+    r->ops  = hashlib_count(hash);
+    r->hist = NULL;
+
+    hashlib_hash_delete(hash);
+    unlink(BENCH_FILE);
+}
+
+/* the same file with the I/O overlapping the table walk */
+static void bench_store_async(struct result *r, struct hashlib_hash *hash)
+{
+    uint64_t start;
+    int ret;
+
+    start = now_ns();
+    ret   = hashlib_store_async(hash, BENCH_FILE, 0);
+    r->ns = now_ns() - start;
+
+    if (ret)
+        errx(EXIT_FAILURE, "hashlib_store_async: %s", strerror(-ret));
+
+    r->op   = "store_async";
+    r->ops  = hashlib_count(hash);
+    r->hist = NULL;
+}
+
+static void bench_retrieve_async(struct result *r)
+{
+    struct hashlib_hash *hash;
+    uint64_t start;
+    int ret;
+
+    start = now_ns();
+    ret   = hashlib_retrieve_async(&hash, BENCH_FILE, NULL, free, 0);
+    r->ns = now_ns() - start;
+
+    if (ret)
+        errx(EXIT_FAILURE, "hashlib_retrieve_async: %s", strerror(-ret));
+
+    r->op   = "retrieve_async";
+    r->ops  = hashlib_count(hash);
+    r->hist = NULL;
+
+    hashlib_hash_delete(hash);
+    unlink(BENCH_FILE);
+}
+
+static void run(struct config *c, size_t n, size_t len)
+{
+    struct hashlib_hash *hash;
+    struct hashlib_frozen *frozen;
+    struct typed *typed;
+    struct keyset hits, misses;
+    struct result r;
+    struct zipf zipf;
+    size_t d, t;
+    int have_zipf;
+
+    fprintf(stderr, "keys %zu, key length %zu\n", n, len);
+
+    reset_VmHWM();
+
+    keyset_init(&hits, n, len, 0, c->seed);
+    keyset_init(&misses, n, len, n, c->seed);
+
+    have_zipf = 0;
+
+    for (d = 0; d < c->ndists; d++)
+        have_zipf |= c->dists[d] == ZIPF;
+
+    if (have_zipf)
+        zipf_init(&zipf, n, c->theta);
+
+    memset(&r, 0, sizeof(r));
+    r.keys    = n;
+    r.keylen  = len;
+    r.dist    = "-";
+    r.threads = 1;
+
+    hash = hashlib_hash_new(n);
+
+    bench_insert(&r, hash, &hits);
+    print_result(&r);
+
+    for (t = 0; t < c->nthreads; t++) {
+        bench_build(&r, &hits, c->threads[t]);
+        print_result(&r);
+    }
+
+    for (t = 0; t < c->nthreads; t++) {
+        bench_ingest(&r, &hits, c->threads[t]);
+        print_result(&r);
+    }
+
+    for (t = 0; t < c->nthreads; t++)
+        bench_merge(&r, &hits, c->threads[t]);
+
+    for (d = 0; d < c->ndists; d++) {
+        for (t = 0; t < c->nthreads; t++) {
+            r.op = "lookup_hit";
+            bench_lookup(&r, hash, get_hash, &hits, &zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(&r);
+
+            r.op = "lookup_miss";
+            bench_lookup(&r, hash, get_hash, &misses, &zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(&r);
+        }
+    }
+
+    hashlib_set_filter(hash, BENCH_FILTER_BITS);
+
+    for (d = 0; d < c->ndists; d++) {
+        for (t = 0; t < c->nthreads; t++) {
+            r.op = "filter_hit";
+            bench_lookup(&r, hash, get_hash, &hits, &zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(&r);
+
+            r.op = "filter_miss";
+            bench_lookup(&r, hash, get_hash, &misses, &zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(&r);
+        }
+    }
+
+    hashlib_set_filter(hash, 0);
+
+    bench_huge(&r, c, &hits, &misses, &zipf);
+
+    bench_simd(&r, &hits, &misses, c->seed);
+
+    r.dist    = "-";
+    r.threads = 1;
+
+    frozen = bench_freeze(&r, &hits);
+    print_result(&r);
+
+    for (d = 0; d < c->ndists; d++) {
+        for (t = 0; t < c->nthreads; t++) {
+            r.op = "frozen_hit";
+            bench_lookup(&r, frozen, get_frozen, &hits, &zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(&r);
+
+            r.op = "frozen_miss";
+            bench_lookup(&r, frozen, get_frozen, &misses, &zipf,
+                         c->dists[d], c->threads[t], c->seed + d);
+            print_result(&r);
+        }
+    }
+
+    hashlib_frozen_set_filter(frozen, BENCH_FILTER_BITS);
+
+    for (d = 0; d < c->ndists; d++) {
+        for (t = 0; t < c->nthreads; t++) {
+            r.op = "frozen_filter_hit";
+            bench_lookup(&r, frozen, get_frozen, &hits, &zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(&r);
+
+            r.op = "frozen_filter_miss";
+            bench_lookup(&r, frozen, get_frozen, &misses, &zipf,
+                         c->dists[d], c->threads[t], c->seed + d);
+            print_result(&r);
+        }
+    }
+
+    hashlib_frozen_delete(frozen);
+
+    r.dist    = "-";
+    r.threads = 1;
+
+    typed = bench_typed_insert(&r, &hits);
+    print_result(&r);
+
+    for (d = 0; d < c->ndists; d++) {
+        for (t = 0; t < c->nthreads; t++) {
+            r.op = "typed_hit";
+            bench_lookup(&r, typed, get_typed, &hits, &zipf, c->dists[d],
+                         c->threads[t], c->seed + d);
+            print_result(&r);
+
+            r.op = "typed_miss";
+            bench_lookup(&r, typed, get_typed, &misses, &zipf,
+                         c->dists[d], c->threads[t], c->seed + d);
+            print_result(&r);
+        }
+    }
+
+    typed_delete(typed);
+
+    r.dist    = "uniform";
+    r.threads = 1;
+    r.keylen  = sizeof(uint64_t);
+
+    bench_u64(&r, n, c->seed);
+
+    r.keylen  = len;
+
+    bench_pool(&r, &hits, c->seed);
+
+    bench_ordered(&r, &hits, c->seed);
+
+    bench_update(&r, &hits, c->seed);
+
+    r.dist    = "-";
+    r.threads = 1;
+
+    bench_store(&r, hash);
+    print_result(&r);
+
+    bench_retrieve(&r);
+    print_result(&r);
+
+    bench_store_async(&r, hash);
+    print_result(&r);
+
+    bench_retrieve_async(&r);
+    print_result(&r);
+
+    bench_remove(&r, hash, &hits);
+    print_result(&r);
+
+    hashlib_hash_delete(hash);
+
+    keyset_free(&hits);
+    keyset_free(&misses);
+}
+
+static size_t parse_list(const char *arg, size_t *out)
+{
+    char *copy, *tok, *save, *end;
+    size_t n;
+    double v;
+
+    copy = strdup(arg);
+
+    if (!copy)
+        err(EXIT_FAILURE, "strdup");
+
+    n = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (n >= MAX_LIST)
+            errx(EXIT_FAILURE, "too many values in '%s'", arg);
+
+        v = strtod(tok, &end);
+
+        /* allow suffixes K and M */
+        if (*end == 'K' || *end == 'k')
+            v *= 1e3, end++;
+        else if (*end == 'M' || *end == 'm')
+            v *= 1e6, end++;
+
+        if (*end || v < 1)
+            errx(EXIT_FAILURE, "invalid value '%s'", tok);
+
+        out[n++] = (size_t) v;
+    }
+
+    free(copy);
+
+    return n;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-n sizes] [-l keylens] [-d dists] [-t threads]"
+            " [-z theta] [-s seed]\n"
+            "  -n  comma separated numbers of keys, e.g. 1K,1M,100M\n"
+            "  -l  comma separated key lengths\n"
+            "  -d  lookup distributions: uniform, zipf\n"
+            "  -t  comma separated numbers of lookup threads\n"
+            "  -z  skew of the zipfian distribution (default 0.99)\n"
+            "  -s  seed for key generation\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct config c;
+    size_t list[MAX_LIST];
+    size_t i, j;
+    char *dists, *tok, *save;
+    long cpus;
+    int opt;
+
+    memset(&c, 0, sizeof(c));
+
+    c.sizes[c.nsizes++] = 1000;
+    c.sizes[c.nsizes++] = 100000;
+    c.sizes[c.nsizes++] = 1000000;
+    c.lens[c.nlens++]   = 8;
+    c.lens[c.nlens++]   = 32;
+    c.dists[c.ndists++] = UNIFORM;
+    c.dists[c.ndists++] = ZIPF;
+    c.threads[c.nthreads++] = 1;
+    c.theta = 0.99;
+    c.seed  = 0x4A5411B0;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus > 1)
+        c.threads[c.nthreads++] = cpus;
+
+    while ((opt = getopt(argc, argv, "n:l:d:t:z:s:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            c.nsizes = parse_list(optarg, c.sizes);
+            break;
+        case 'l':
+            c.nlens = parse_list(optarg, c.lens);
+            break;
+        case 'd':
+            dists = strdup(optarg);
+
+            if (!dists)
+                err(EXIT_FAILURE, "strdup");
+
+            c.ndists = 0;
+
+            for (tok = strtok_r(dists, ",", &save); tok;
+                 tok = strtok_r(NULL, ",", &save)) {
+                if (c.ndists >= MAX_LIST)
+                    errx(EXIT_FAILURE, "too many distributions");
+
+                if (!strcmp(tok, "uniform"))
+                    c.dists[c.ndists++] = UNIFORM;
+                else if (!strcmp(tok, "zipf"))
+                    c.dists[c.ndists++] = ZIPF;
+                else
+                    errx(EXIT_FAILURE, "unknown distribution '%s'", tok);
+            }
+
+            free(dists);
+            break;
+        case 't':
+            c.nthreads = parse_list(optarg, list);
+
+            for (i = 0; i < c.nthreads; i++)
+                c.threads[i] = list[i];
+
+            break;
+        case 'z':
+            c.theta = strtod(optarg, NULL);
+
+            if (c.theta <= 0 || c.theta >= 1)
+                errx(EXIT_FAILURE, "theta must be in (0, 1)");
+
+            break;
+        case 's':
+            c.seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc)
+        usage(argv[0]);
+
+    print_header();
+
+    for (i = 0; i < c.nsizes; i++)
+        for (j = 0; j < c.nlens; j++)
+            run(&c, c.sizes[i], c.lens[j]);
+
+    return 0;
+}
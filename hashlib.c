@@ -20,306 +20,1096 @@
 #define _GNU_SOURCE
 
 #include <err.h>
+#include <errno.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <search.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "hashlib.h"
+#include "hashlib_private.h"
 
-/* identifier 0x4A5411B0 */
-#define HASHLIB_FILE_HEADER (0xB011544A)
+/* slots per partition of hashlib_build, fits into the cpu caches */
+#define HASHLIB_BUILD_PART_SLOTS (1 << 14)
 
-#define errf(exit, format, ...)  err((exit), "%s: " format, __func__, ## __VA_ARGS__)
-#define errfx(exit, format, ...) errx((exit), "%s: " format, __func__, ## __VA_ARGS__)
-#define dief(arg, ...)           errf(EXIT_FAILURE, arg, ## __VA_ARGS__)
-#define diefx(arg, ...)          errfx(EXIT_FAILURE, arg, ## __VA_ARGS__)
+struct hashlib_build_item {
+    struct hashlib_entry *entry;
+    unsigned int hash;
+};
 
-#define QUERY (-1)
-#define RESET (-2)
+struct hashlib_build_state {
+    struct hashlib_hash *hash;
+    char **keys;
+    void **values;
+    size_t n;
+    int flags;
+    unsigned int threads;
+    size_t parts;
+    struct hashlib_build_item *items;
+    struct hashlib_build_item *order;
+    size_t *offset;
+    size_t *part_start;
+    size_t next_part;
+    pthread_barrier_t barrier;
+};
 
-struct hashlib_entry {
-    char *key;
-    void *value;
-    HASHLIB_FP_FREE(free_function);
-    HASHLIB_FP_SIZE(size_function);
-    HASHLIB_FP_PACK(pack_function);
+struct hashlib_build_thread {
+    struct hashlib_build_state *state;
+    unsigned int id;
+    size_t count;
+    size_t key_bytes;
+    size_t value_bytes;
+    size_t bucket_bytes;
 };
 
-static inline void *hashlib_calloc(size_t nmemb, size_t size)
+HASHLIB_FCT_SIZE(hashlib_default_size_function, e)
+{
+    return sizeof(e);
+}
+
+/* a failed write is detected by the caller from the file offset */
+HASHLIB_FCT_PACK(hashlib_default_pack_function, e, bytes, fd)
+{
+    hashlib_try_write(fd, e, bytes);
+}
+
+HASHLIB_FCT_UNPACK(hashlib_default_unpack_function, data, bytes)
 {
-    void *p;
+    void *e;
 
-    p = calloc(nmemb, size);
+    /* NULL makes hashlib_try_retrieve fail with ENOMEM */
+    e = malloc(bytes);
 
-    if (!p)
-        dief("calloc");
+    if (e)
+        memcpy(e, data, bytes);
 
-    return p;
+    return e;
 }
 
-static inline int hashlib_open(const char *filename, int flags, mode_t modes)
+extern unsigned int hashlib_index(char *key)
 {
-    int fd;
+    size_t len;
 
-    fd = open(filename, flags, modes);
+    assert(key);
 
-    if (fd == -1)
-        dief("open");
+    return hashlib_index_len(key, &len);
+}
+
+/* len is the length of key, returns NULL with errno set on failure */
+extern struct hashlib_entry *hashlib_entry_new(const char *key, size_t len,
+                                               unsigned int hash,
+                                               void *value,
+                                               HASHLIB_FP_FREE(free_function),
+                                               HASHLIB_FP_SIZE(size_function),
+                                               HASHLIB_FP_PACK(pack_function))
+{
+    struct hashlib_entry *e;
+
+    if (len >= UINT_MAX) {
+        errno = EOVERFLOW;
+        return NULL;
+    }
+
+    e = malloc(sizeof(*e) + len + 1);
+
+    if (!e)
+        return NULL;
+
+    e->key             = (char *) (e + 1);
+    e->value           = value;
+    e->hash            = hash;
+    e->keylen          = len;
+    e->refs            = 1;
+    e->free_function   = free_function;
+    e->size_function   = size_function;
+    e->pack_function   = pack_function;
+
+    memcpy(e->key, key, len + 1);
+
+    return e;
+}
+
+/* an entry whose key is the handle of an interned key, it is not copied */
+extern struct hashlib_entry *hashlib_entry_new_interned(
+        const char *handle, void *value, HASHLIB_FP_FREE(free_function),
+        HASHLIB_FP_SIZE(size_function), HASHLIB_FP_PACK(pack_function))
+{
+    const struct hashlib_key *k;
+    struct hashlib_entry *e;
+
+    e = malloc(sizeof(*e));
+
+    if (!e)
+        return NULL;
+
+    k = hashlib_handle_key(handle);
+
+    e->key             = (char *) handle;
+    e->value           = value;
+    e->hash            = k->hash;
+    e->keylen          = k->len;
+    e->refs            = 1;
+    e->free_function   = free_function;
+    e->size_function   = size_function;
+    e->pack_function   = pack_function;
+
+    return e;
+}
+
+static void hashlib_entry_delete(struct hashlib_entry *e)
+{
+    if (e->free_function)
+        e->free_function(e->value);
+
+    free(e);
+}
+
+/* drops a reference to e, the last one deletes it */
+extern void hashlib_entry_unref(struct hashlib_entry *e)
+{
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        hashlib_entry_delete(e);
+}
+
+/* drops a reference to b, the last one releases its entries */
+extern void hashlib_bucket_unref(struct hashlib_bucket *b)
+{
+    unsigned int i;
+
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    for (i = 0; i < b->count; i++)
+        hashlib_entry_unref(b->entry[i]);
+
+    free(b);
+}
+
+/*
+ * copies the bucket *slot if it is shared with a clone, so that it can be
+ * changed; the entries stay shared.  Returns 0 or -ENOMEM.
+ */
+extern int hashlib_bucket_own(void **slot)
+{
+    struct hashlib_bucket *b, *copy;
+    unsigned int i;
+
+    b = *slot;
+
+    if (!b || __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1)
+        return 0;
+
+    copy = malloc(hashlib_bucket_bytes(b->size));
+
+    if (!copy)
+        return -ENOMEM;
+
+    memcpy(copy, b, hashlib_bucket_bytes(b->size));
+    copy->refs = 1;
+
+    for (i = 0; i < copy->count; i++)
+        __atomic_add_fetch(&copy->entry[i]->refs, 1, __ATOMIC_RELAXED);
+
+    hashlib_bucket_unref(b);
+    *slot = copy;
+
+    return 0;
+}
+
+/* resizes b to hold size entries, b may be NULL; returns NULL and leaves b
+ * unchanged if out of memory */
+static struct hashlib_bucket *hashlib_bucket_resize(struct hashlib_bucket *b,
+                                                    unsigned int size)
+{
+    struct hashlib_bucket *n;
+    unsigned int count;
+    unsigned int old;
+
+    count = b ? b->count : 0;
+    old   = b ? b->size : 0;
+
+    assert(size >= count);
+    assert(!b || b->refs == 1);
+
+    if (b && size < old)
+        memmove(b->entry + size, hashlib_bucket_tags(b), count);
+
+    n = realloc(b, hashlib_bucket_bytes(size));
+
+    if (!n) {
+        if (b && size < old)
+            memmove(hashlib_bucket_tags(b), b->entry + size, count);
+
+        return NULL;
+    }
+
+    if (!b)
+        n->refs = 1;
+
+    b = n;
+
+    /* the tags follow the entry pointers */
+    if (size > old)
+        memmove(b->entry + size, b->entry + old, count);
+
+    b->count = count;
+    b->size  = size;
+
+    return b;
+}
+
+/* the smallest power of two not less than size */
+static size_t hashlib_tblsize(size_t size)
+{
+    size_t tblsize;
+
+    for (tblsize = 1; tblsize < size; tblsize <<= 1)
+        ;
+
+    return tblsize;
+}
+
+extern struct hashlib_hash *hashlib_hash_new(size_t size)
+{
+    return hashlib_hash_new_alloc(size, 0, -1);
+}
+
+/* flags are HASHLIB_ALLOC_*, node is only used with HASHLIB_ALLOC_BIND */
+extern struct hashlib_hash *hashlib_hash_new_alloc(size_t size, int flags,
+                                                   int node)
+{
+    struct hashlib_hash *hash;
+    int ret;
+
+    ret = hashlib_try_hash_new_alloc(&hash, size, flags, node);
+
+    if (ret == -EINVAL && size > HASHLIB_MAX_TBLSIZE)
+        diefx("table size too big");
+
+    if (ret == -EINVAL && !size)
+        diefx("table size must be greater than zero");
+
+    if (ret) {
+        errno = -ret;
+        dief("hashlib_hash_new");
+    }
+
+    return hash;
+}
+
+extern int hashlib_try_hash_new(struct hashlib_hash **hash, size_t size)
+{
+    return hashlib_try_hash_new_alloc(hash, size, 0, -1);
+}
+
+/* returns 0, -EINVAL for a bad size or node, or -ENOMEM */
+extern int hashlib_try_hash_new_alloc(struct hashlib_hash **hashp, size_t size,
+                                      int flags, int node)
+{
+    struct hashlib_hash *hash;
+    int ret;
+
+    assert(hashp);
+
+    *hashp = NULL;
+
+    if (!size || size > HASHLIB_MAX_TBLSIZE)
+        return -EINVAL;
+
+    hash = calloc(1, sizeof(*hash));
+
+    if (!hash)
+        return -ENOMEM;
+
+    size      = hashlib_tblsize(size);
+    hash->tbl = hashlib_mem_alloc(size * sizeof(*(hash->tbl)), flags, node,
+                                  &hash->tblbytes);
+
+    if (!hash->tbl) {
+        ret = errno == EINVAL ? -EINVAL : -ENOMEM;
+        free(hash);
+
+        return ret;
+    }
+
+    hash->alloc_flags     = flags;
+    hash->alloc_node      = node;
+    hash->tblsize         = size;
+    hash->size_function   = hashlib_default_size_function;
+    hash->pack_function   = hashlib_default_pack_function;
+
+    *hashp = hash;
+
+    return 0;
+}
+
+/* keeps the memory usage of hash up to date when e is inserted or removed */
+static void hashlib_account(struct hashlib_hash *hash, struct hashlib_entry *e,
+                            int inserted)
+{
+    size_t key_bytes;
+    size_t value_bytes;
+
+    key_bytes   = hashlib_entry_key_bytes(e);
+    value_bytes = 0;
+
+    if (hash->account_values)
+        value_bytes = e->size_function(e->value);
+
+    if (inserted) {
+        hash->key_bytes   += key_bytes;
+        hash->value_bytes += value_bytes;
+    } else {
+        hash->key_bytes   -= key_bytes;
+        hash->value_bytes -= value_bytes;
+    }
+}
+
+/* appends e to the bucket *slot, *bucket_bytes keeps track of its size;
+ * returns -ENOMEM if the bucket cannot grow */
+extern int hashlib_bucket_append(void **slot, struct hashlib_entry *e,
+                                 size_t *bucket_bytes)
+{
+    struct hashlib_bucket *b;
+    unsigned int size;
+
+    if (hashlib_bucket_own(slot))
+        return -ENOMEM;
+
+    b = *slot;
+
+    if (!b || b->count == b->size) {
+        size = b ? b->size : 0;
+        size = size ? 2 * size : 1;
+        b    = hashlib_bucket_resize(*slot, size);
+
+        if (!b)
+            return -ENOMEM;
+
+        if (*slot)
+            *bucket_bytes -= hashlib_bucket_bytes(size / 2);
+
+        *bucket_bytes += hashlib_bucket_bytes(size);
+        *slot          = b;
+    }
+
+    hashlib_bucket_push(b, e);
+
+    return 0;
+}
+
+/*
+ * adds the new entry e to the slot index of hash, returns 1 or -ENOMEM.  On
+ * failure e is freed but not its value, which stays with the caller.
+ */
+static int hashlib_insert(struct hashlib_hash *hash, unsigned int index,
+                          struct hashlib_entry *e)
+{
+    if (hash->order && hashlib_order_insert(hash->order, e)) {
+        free(e);
+        return -ENOMEM;
+    }
+
+    if (hashlib_bucket_append(&hash->tbl[index], e, &hash->bucket_bytes)) {
+        if (hash->order)
+            hashlib_order_remove(hash->order, e);
+
+        free(e);
+        return -ENOMEM;
+    }
+
+    hash->count++;
+    hashlib_account(hash, e, 1);
+
+    if (hash->filter)
+        hashlib_filter_put(hash, e);
+
+    return 1;
+}
+
+/* interns key in the pool of hash, then puts it */
+static int hashlib_try_put_pooled(struct hashlib_hash *hash, const char *key,
+                                  void *value)
+{
+    const char *handle;
+    int ret;
+
+    ret = hashlib_try_intern(hash->pool, key, &handle);
+
+    return ret ? ret : hashlib_try_put_interned(hash, handle, value);
+}
+
+extern int hashlib_put(struct hashlib_hash *hash, char *key, void *value)
+{
+    int ret;
+
+    ret = hashlib_try_put(hash, key, value);
+
+    if (ret < 0) {
+        errno = -ret;
+        dief("hashlib_put");
+    }
+
+    return ret;
+}
+
+/* returns 1 if inserted, 0 if key was already in hash, or -ENOMEM and
+ * -EOVERFLOW with hash unchanged and value not freed */
+extern int hashlib_try_put(struct hashlib_hash *hash, char *key, void *value)
+{
+    unsigned int h;
+    unsigned int index;
+    struct hashlib_entry *e;
+    size_t len;
+
+    assert(hash);
+    assert(key);
+    assert(value);
+
+    if (hash->pool)
+        return hashlib_try_put_pooled(hash, key, value);
+
+    h     = hashlib_index_len(key, &len);
+    index = hashlib_slot(h, hash->tblsize);
+
+    if (hashlib_maybe_contains(hash, h)
+        && hashlib_bucket_find(hash->tbl[index], key, len, h, NULL)) {
+        /* already in hash, the new value is discarded */
+        if (hash->free_function)
+            hash->free_function(value);
+
+        return 0;
+    }
+
+    e = hashlib_entry_new(key, len, h, value, hash->free_function,
+                          hash->size_function, hash->pack_function);
+
+    if (!e)
+        return -errno;
+
+    return hashlib_insert(hash, index, e);
+}
+
+extern int hashlib_put_interned(struct hashlib_hash *hash, const char *handle,
+                                void *value)
+{
+    int ret;
+
+    ret = hashlib_try_put_interned(hash, handle, value);
+
+    if (ret < 0) {
+        errno = -ret;
+        dief("hashlib_put_interned");
+    }
+
+    return ret;
+}
+
+/*
+ * hashlib_try_put with the handle of a key interned in the pool of hash;
+ * the hash of the key is not computed again and keys are compared by
+ * their address
+ */
+extern int hashlib_try_put_interned(struct hashlib_hash *hash,
+                                    const char *handle, void *value)
+{
+    unsigned int h;
+    unsigned int index;
+    struct hashlib_entry *e;
+
+    assert(hash);
+    assert(hash->pool);
+    assert(handle);
+    assert(value);
+
+    h     = hashlib_handle_key(handle)->hash;
+    index = hashlib_slot(h, hash->tblsize);
+
+    if (hashlib_maybe_contains(hash, h)
+        && hashlib_bucket_find_interned(hash->tbl[index], handle, NULL)) {
+        if (hash->free_function)
+            hash->free_function(value);
+
+        return 0;
+    }
+
+    e = hashlib_entry_new_interned(handle, value, hash->free_function,
+                                   hash->size_function, hash->pack_function);
+
+    if (!e)
+        return -ENOMEM;
+
+    return hashlib_insert(hash, index, e);
+}
+
+static struct hashlib_entry *hashlib_lookup(struct hashlib_hash *hash,
+                                            const char *key)
+{
+    unsigned int h;
+    size_t len;
+
+    h = hashlib_index_len(key, &len);
+
+    /* most misses end here */
+    if (!hashlib_maybe_contains(hash, h))
+        return NULL;
+
+    return hashlib_bucket_find(hash->tbl[hashlib_slot(h, hash->tblsize)], key,
+                               len, h, NULL);
+}
+
+extern void *hashlib_get(struct hashlib_hash *hash, char *key)
+{
+    struct hashlib_entry *e;
+
+    assert(hash);
+    assert(key);
+
+    e = hashlib_lookup(hash, key);
+
+    if (!e)
+        return NULL;
+
+    return e->value;
+}
+
+extern int hashlib_replace(struct hashlib_hash *hash, char *key, void *value)
+{
+    int ret;
+
+    ret = hashlib_try_replace(hash, key, value);
+
+    if (ret < 0) {
+        errno = -ret;
+        dief("hashlib_replace");
+    }
+
+    return ret;
+}
+
+/* replaces the entry at pos of b, which a clone shares, by a copy of it
+ * with value; the clone keeps the entry and its value */
+static int hashlib_entry_unshare(struct hashlib_hash *hash,
+                                 struct hashlib_bucket *b, unsigned int pos,
+                                 void *value)
+{
+    struct hashlib_entry *e, *copy;
+
+    e = b->entry[pos];
+
+    if (hashlib_entry_interned(e))
+        copy = hashlib_entry_new_interned(e->key, value, e->free_function,
+                                          e->size_function, e->pack_function);
+    else
+        copy = hashlib_entry_new(e->key, e->keylen, e->hash, value,
+                                 e->free_function, e->size_function,
+                                 e->pack_function);
+
+    if (!copy)
+        return -ENOMEM;
+
+    if (hash->order)
+        hashlib_order_replace(hash->order, e, copy);
+
+    hashlib_account(hash, e, 0);
+    hashlib_account(hash, copy, 1);
+
+    b->entry[pos] = copy;
+    hashlib_entry_unref(e);
+
+    return 0;
+}
+
+/* sets the value of the entry at pos of the bucket of slot index */
+static int hashlib_replace_at(struct hashlib_hash *hash, size_t index,
+                              unsigned int pos, void *value)
+{
+    struct hashlib_bucket *b;
+    struct hashlib_entry *e;
+    void *old;
+
+    if (hashlib_bucket_own(&hash->tbl[index]))
+        return -ENOMEM;
+
+    b = hash->tbl[index];
+    e = b->entry[pos];
+
+    if (__atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) > 1)
+        return hashlib_entry_unshare(hash, b, pos, value);
+
+    hashlib_account(hash, e, 0);
+
+    old      = e->value;
+    e->value = value;
+
+    hashlib_account(hash, e, 1);
+
+    if (e->free_function && old != value)
+        e->free_function(old);
+
+    return 0;
+}
+
+/*
+ * the address of the value of key in hash, or NULL if key is missing; a
+ * value can be updated through it without another lookup.  The address is
+ * valid until key is removed or replaced, or hash is deleted.  An entry
+ * shared with a clone is copied first, so the clone does not see the
+ * change; if hash frees its values, the value is copied with the copy
+ * function, which must be set then.  A value stored through the address
+ * replaces the old one without freeing it, and value accounting does not
+ * notice the change.
+ */
+extern void **hashlib_get_ref(struct hashlib_hash *hash, char *key)
+{
+    struct hashlib_bucket *b;
+    struct hashlib_entry *e;
+    unsigned int h;
+    unsigned int index;
+    unsigned int pos;
+    size_t len;
+    void *value;
+
+    assert(hash);
+    assert(key);
+
+    h     = hashlib_index_len(key, &len);
+    index = hashlib_slot(h, hash->tblsize);
+
+    if (!hashlib_maybe_contains(hash, h)
+        || !hashlib_bucket_find(hash->tbl[index], key, len, h, &pos))
+        return NULL;
+
+    if (hashlib_bucket_own(&hash->tbl[index])) {
+        errno = ENOMEM;
+        dief("hashlib_get_ref");
+    }
+
+    b = hash->tbl[index];
+    e = b->entry[pos];
+
+    if (__atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) > 1) {
+        value = e->value;
+
+        if (e->free_function) {
+            if (!hash->copy_function)
+                diefx("hashlib_get_ref: shared value without copy function");
+
+            if (!(value = hash->copy_function(e->value)))
+                diefx("hashlib_get_ref: unable to copy value");
+        }
+
+        if (hashlib_entry_unshare(hash, b, pos, value)) {
+            errno = ENOMEM;
+            dief("hashlib_get_ref");
+        }
+
+        e = b->entry[pos];
+    }
+
+    return &e->value;
+}
+
+/*
+ * sets the value of key to value, key is put if it is missing.  The old
+ * value is freed with the free function.  Returns 1 if key was put, 0 if
+ * its value was replaced, or -ENOMEM.
+ */
+extern int hashlib_try_replace(struct hashlib_hash *hash, char *key,
+                               void *value)
+{
+    struct hashlib_entry *e;
+    unsigned int h;
+    unsigned int index;
+    unsigned int pos;
+    size_t len;
+
+    assert(hash);
+    assert(key);
+    assert(value);
+
+    h     = hashlib_index_len(key, &len);
+    index = hashlib_slot(h, hash->tblsize);
+    e     = NULL;
+
+    if (hashlib_maybe_contains(hash, h))
+        e = hashlib_bucket_find(hash->tbl[index], key, len, h, &pos);
+
+    if (!e)
+        return hashlib_try_put(hash, key, value);
+
+    return hashlib_replace_at(hash, index, pos, value);
+}
+
+/* hashlib_get with the handle of a key interned in the pool of hash */
+extern void *hashlib_get_interned(struct hashlib_hash *hash, const char *handle)
+{
+    struct hashlib_entry *e;
+    unsigned int h;
+
+    assert(hash);
+    assert(hash->pool);
+    assert(handle);
+
+    h = hashlib_handle_key(handle)->hash;
+
+    if (!hashlib_maybe_contains(hash, h))
+        return NULL;
+
+    e = hashlib_bucket_find_interned(hash->tbl[hashlib_slot(h, hash->tblsize)],
+                                     handle, NULL);
 
-    return fd;
+    return e ? e->value : NULL;
 }
 
-static inline void hashlib_close(int fd)
+/*
+ * makes the keys of hash interned in pool, which must outlive hash; hash
+ * must be empty.  Tables of one pool store only a pointer per key.
+ */
+extern void hashlib_set_pool(struct hashlib_hash *hash,
+                             struct hashlib_pool *pool)
 {
-    int ret;
+    assert(hash);
+    assert(!hash->count);
 
-    ret = close(fd);
+    if (hash->pool)
+        hash->pool->tables--;
 
-    if (ret == -1)
-        dief("close");
+    if (pool)
+        pool->tables++;
+
+    hash->pool = pool;
 }
 
-static inline void hashlib_write(int fd, void *data, size_t bytes)
+/* partition of the slot of a key with hash h, partitions are slot ranges */
+static inline size_t hashlib_build_part(struct hashlib_build_state *s,
+                                        unsigned int h)
 {
-    ssize_t ret;
-
-    ret = write(fd, data, bytes);
-
-    if (ret == -1)
-        dief("write");
+    return (uint64_t) hashlib_slot(h, s->hash->tblsize) * s->parts
+           / s->hash->tblsize;
 }
 
-static inline size_t hashlib_read(int fd, void *buf, size_t bytes)
+/* first slot of partition part */
+static inline size_t hashlib_build_part_slot(struct hashlib_build_state *s,
+                                             size_t part)
 {
-    ssize_t ret;
-
-    ret = read(fd, buf, bytes);
-
-    if (ret == -1)
-        dief("read");
-
-    return ret;
+    return ((uint64_t) part * s->hash->tblsize + s->parts - 1) / s->parts;
 }
 
-static int hashlib_current_fd(int fd)
+/* inserts the entries of partition part, t is the only writer of its slots */
+static void hashlib_build_part_fill(struct hashlib_build_thread *t, size_t part,
+                                    size_t *count,
+                                    struct hashlib_build_item *sorted)
 {
-    static int cfd = QUERY;
+    struct hashlib_build_state *s;
+    struct hashlib_build_item *item;
+    struct hashlib_hash *hash;
+    struct hashlib_bucket *b;
+    struct hashlib_entry *e;
+    size_t first, slots, slot, start, end, i, j, k;
+    unsigned int need;
+
+    s     = t->state;
+    hash  = s->hash;
+    first = hashlib_build_part_slot(s, part);
+    slots = hashlib_build_part_slot(s, part + 1) - first;
+    start = s->part_start[part];
+    end   = s->part_start[part + 1];
+
+    /* counting sort of the entries of this partition by slot */
+    memset(count, 0, (slots + 1) * sizeof(*count));
+
+    for (i = start; i < end; i++) {
+        slot = hashlib_slot(s->order[i].hash, hash->tblsize) - first;
+        count[slot + 1]++;
+    }
 
-    if (fd == RESET) {
-        cfd = QUERY;
-        return RESET;
+    for (i = 1; i <= slots; i++)
+        count[i] += count[i - 1];
+
+    for (i = start; i < end; i++) {
+        slot = hashlib_slot(s->order[i].hash, hash->tblsize) - first;
+        sorted[count[slot]++] = s->order[i];
     }
 
-    if (fd == QUERY)
-        assert(cfd != QUERY);
-    else
-        cfd = fd;
+    /* count[i] is now the end of slot first + i in sorted */
+    for (i = 0, j = 0; i < slots; j = count[i], i++) {
+        if (j == count[i])
+            continue;
 
-    return cfd;
-}
+        if (hashlib_bucket_own(&hash->tbl[first + i]))
+            dief("malloc");
 
-static HASHLIB_FCT_SIZE(hashlib_default_size_function, e)
-{
-    return sizeof(e);
-}
+        b    = hash->tbl[first + i];
+        need = (b ? b->count : 0) + (count[i] - j);
 
-static HASHLIB_FCT_PACK(hashlib_default_pack_function, e, bytes, fd)
-{
-    int ret;
+        if (!b || b->size < need) {
+            t->bucket_bytes -= b ? hashlib_bucket_bytes(b->size) : 0;
+            b                = hashlib_bucket_resize(b, need);
 
-    ret = write(fd, e, bytes);
+            if (!b)
+                dief("realloc");
 
-    if (ret == -1)
-        dief("write");
-}
+            t->bucket_bytes += hashlib_bucket_bytes(need);
 
-static HASHLIB_FCT_UNPACK(hashlib_default_unpack_function, data, bytes)
-{
-    void *e;
+            hash->tbl[first + i] = b;
+        }
 
-    e = malloc(bytes);
+        for (k = j; k < count[i]; k++) {
+            item = &sorted[k];
+            e    = item->entry;
 
-    if (!e)
-        dief("malloc");
+            if (!(s->flags & HASHLIB_BUILD_UNIQUE)
+                && hashlib_bucket_find(b, e->key, e->keylen, item->hash,
+                                       NULL)) {
+                /* already in hash, discarded like in hashlib_put */
+                t->key_bytes -= hashlib_entry_key_bytes(e);
+                hashlib_entry_delete(e);
+                continue;
+            }
 
-    memcpy(e, data, bytes);
+            hashlib_bucket_push(b, e);
 
-    return e;
+            t->count++;
+
+            if (hash->account_values)
+                t->value_bytes += e->size_function(e->value);
+        }
+    }
 }
 
-extern unsigned int hashlib_index(char *key)
+static void *hashlib_build_thread(void *arg)
 {
-    unsigned int index;
+    struct hashlib_build_thread *t;
+    struct hashlib_build_state *s;
+    struct hashlib_build_item *item, *sorted;
+    struct hashlib_hash *hash;
+    size_t *offset, *count;
+    size_t lo, hi, i, len, part, tmp, sum, max;
+    unsigned int j;
+
+    t      = arg;
+    s      = t->state;
+    hash   = s->hash;
+    lo     = s->n * t->id / s->threads;
+    hi     = s->n * (t->id + 1) / s->threads;
+    offset = s->offset + t->id * s->parts;
+
+    /* hash the keys in input order, create the entries and count them per
+     * partition */
+    for (i = lo; i < hi; i++) {
+        item = &(s->items[i]);
+
+        if (hash->pool) {
+            item->hash  = hashlib_handle_key(s->keys[i])->hash;
+            item->entry = hashlib_entry_new_interned(s->keys[i], s->values[i],
+                                                     hash->free_function,
+                                                     hash->size_function,
+                                                     hash->pack_function);
+        } else {
+            item->hash  = hashlib_index_len(s->keys[i], &len);
+            item->entry = hashlib_entry_new(s->keys[i], len, item->hash,
+                                            s->values[i], hash->free_function,
+                                            hash->size_function,
+                                            hash->pack_function);
+        }
+
+        if (!item->entry)
+            dief("hashlib_entry_new");
+
+        t->key_bytes += hashlib_entry_key_bytes(item->entry);
+
+        offset[hashlib_build_part(s, item->hash)]++;
+    }
 
-    assert(key);
+    pthread_barrier_wait(&(s->barrier));
 
-    index = 0;
+    if (t->id == 0) {
+        sum = 0;
 
-    while (*key) {
-        index = 5 * index + *key;
-        key++;
-    }
+        for (part = 0; part < s->parts; part++) {
+            s->part_start[part] = sum;
 
-    return index;
-}
+            for (j = 0; j < s->threads; j++) {
+                tmp = s->offset[j * s->parts + part];
+                s->offset[j * s->parts + part] = sum;
+                sum += tmp;
+            }
+        }
 
-static struct hashlib_entry *hashlib_entry_new(char *key, void *value,
-                                               HASHLIB_FP_FREE(free_function),
-                                               HASHLIB_FP_SIZE(size_function),
-                                               HASHLIB_FP_PACK(pack_function))
-{
-    struct hashlib_entry *e;
+        s->part_start[s->parts] = sum;
+    }
 
-    e = calloc(1, sizeof(*e));
+    pthread_barrier_wait(&(s->barrier));
 
-    if (!e)
-        dief("calloc");
+    /* radix partition the entries by slot range */
+    for (i = lo; i < hi; i++)
+        s->order[offset[hashlib_build_part(s, s->items[i].hash)]++] =
+            s->items[i];
 
-    e->key             = strdup(key);
-    e->value           = value;
-    e->free_function   = free_function;
-    e->size_function   = size_function;
-    e->pack_function   = pack_function;
+    pthread_barrier_wait(&(s->barrier));
 
-    return e;
-}
+    max = 0;
 
-static void hashlib_entry_delete(struct hashlib_entry *e)
-{
-    if (e->free_function)
-        e->free_function(e->value);
+    for (part = 0; part < s->parts; part++)
+        if (s->part_start[part + 1] - s->part_start[part] > max)
+            max = s->part_start[part + 1] - s->part_start[part];
 
-    free(e->key);
-    free(e);
-}
+    count  = hashlib_calloc(hash->tblsize / s->parts + 3, sizeof(*count));
+    sorted = hashlib_calloc(max + 1, sizeof(*sorted));
 
-/* this function is taken from glibc's misc/hsearch_r.c */
-static int isprime(unsigned int number)
-{
-    /* no even number will be passed */
-    unsigned int div = 3;
+    while ((part = __atomic_fetch_add(&(s->next_part), 1, __ATOMIC_RELAXED))
+           < s->parts)
+        hashlib_build_part_fill(t, part, count, sorted);
 
-    while (div * div < number && number % div != 0)
-        div += 2;
+    free(count);
+    free(sorted);
 
-    return number % div != 0;
+    return NULL;
 }
 
-extern struct hashlib_hash *hashlib_hash_new(size_t size)
+/*
+ * builds the ordered index and the filter of hash again, if it has them;
+ * the bulk inserts of hashlib_build, hashlib_merge and hashlib_ingest fill
+ * the buckets from several threads without touching them
+ */
+extern void hashlib_rebuild_indexes(struct hashlib_hash *hash)
 {
-    struct hashlib_hash *hash;
+    if (hash->order)
+        hashlib_set_ordered(hash, 1);
 
-    if (size > HASHLIB_MAX_TBLSIZE)
-        diefx("table size too big");
+    if (hash->filter)
+        hashlib_set_filter(hash, hash->filter->bits_per_key);
+}
 
-    if (size <= 0)
-        diefx("table size must be greater than zero");
+extern size_t hashlib_build(struct hashlib_hash *hash, char **keys,
+                            void **values, size_t n, unsigned int threads,
+                            int flags)
+{
+    struct hashlib_build_state s;
+    struct hashlib_build_thread *t;
+    pthread_t *tids;
+    size_t size, inserted, tblbytes, k;
+    char **handles;
+    void **tbl;
+    unsigned int i;
+    int ret;
 
-    hash = calloc(1, sizeof(*hash));
+    assert(hash);
+    assert(keys || !n);
+    assert(values || !n);
 
-    if (!hash)
-        dief("calloc(hash)");
+    if (!n)
+        return 0;
 
-    /* the next five lines of code are taken from glibc's misc/hsearch_r.c */
-    if (size < 3)
-        size = 3;
+    /* size the slot array once for all keys */
+    if (!hash->count && n > hash->tblsize) {
+        size = hashlib_tblsize(n < HASHLIB_MAX_TBLSIZE ? n : HASHLIB_MAX_TBLSIZE);
 
-    size |= 1;
+        tbl = hashlib_mem_alloc(size * sizeof(*tbl), hash->alloc_flags,
+                                hash->alloc_node, &tblbytes);
 
-    while (!isprime(size))
-        size += 2;
+        if (!tbl)
+            dief("hashlib_mem_alloc");
 
-    hash->tbl = calloc(size, sizeof(*(hash->tbl)));
+        hashlib_mem_free(hash->tbl, hash->tblbytes);
 
-    if (!hash->tbl)
-        dief("calloc(hash->tbl)");
+        hash->tbl      = tbl;
+        hash->tblbytes = tblbytes;
+        hash->tblsize  = size;
+    }
 
-    hash->tblsize         = size;
-    hash->size_function   = hashlib_default_size_function;
-    hash->pack_function   = hashlib_default_pack_function;
+    /* a pool is not thread safe, the keys are interned up front */
+    handles = NULL;
 
-    return hash;
-}
+    if (hash->pool) {
+        handles = hashlib_calloc(n, sizeof(*handles));
 
-static void hashlib_tree_delete(void *a)
-{
-    hashlib_entry_delete(a);
-}
+        for (k = 0; k < n; k++)
+            handles[k] = (char *) hashlib_intern(hash->pool, keys[k]);
 
-static int hashlib_compare(const void *a, const void *b)
-{
-    struct hashlib_entry *e;
-    struct hashlib_entry *f;
+        keys = handles;
+    }
 
-    e = (struct hashlib_entry *) a;
-    f = (struct hashlib_entry *) b;
+    if (!threads)
+        threads = 1;
 
-    return strcmp(e->key, f->key);
-}
+    if (threads > n)
+        threads = n;
 
-extern int hashlib_put(struct hashlib_hash *hash, char *key, void *value)
-{
-    unsigned int index;
-    struct hashlib_entry *e;
-    struct hashlib_entry *r;
-    void *ret;
+    memset(&s, 0, sizeof(s));
 
-    assert(hash);
-    assert(key);
-    assert(value);
+    s.hash    = hash;
+    s.keys    = keys;
+    s.values  = values;
+    s.n       = n;
+    s.flags   = flags;
+    s.threads = threads;
+    s.parts   = hash->tblsize / HASHLIB_BUILD_PART_SLOTS + 1;
 
-    index = hashlib_index(key) % hash->tblsize;
+    if (s.parts < 4 * threads)
+        s.parts = 4 * threads;
 
-    e = hashlib_entry_new(key, value, hash->free_function,
-                          hash->size_function, hash->pack_function);
+    if (s.parts > hash->tblsize)
+        s.parts = hash->tblsize;
 
-    ret = tsearch(e, &(hash->tbl[index]), hashlib_compare);
+    s.items      = hashlib_calloc(n, sizeof(*(s.items)));
+    s.order      = hashlib_calloc(n, sizeof(*(s.order)));
+    s.offset     = hashlib_calloc(threads * s.parts, sizeof(*(s.offset)));
+    s.part_start = hashlib_calloc(s.parts + 1, sizeof(*(s.part_start)));
 
-    if (!ret)
-        dief("tsearch");
+    t    = hashlib_calloc(threads, sizeof(*t));
+    tids = hashlib_calloc(threads, sizeof(*tids));
 
-    r = *(struct hashlib_entry **) ret;
+    pthread_barrier_init(&(s.barrier), NULL, threads);
 
-    if (r != e) {
-        /* already in hash */
-        hashlib_entry_delete(e);
-        return 0;
+    for (i = 0; i < threads; i++) {
+        t[i].state = &s;
+        t[i].id    = i;
     }
 
-    /* e was inserted */
-    hash->count++;
+    for (i = 1; i < threads; i++) {
+        ret = pthread_create(&tids[i], NULL, hashlib_build_thread, &t[i]);
 
-    return 1;
-}
+        if (ret)
+            diefx("pthread_create: %s", strerror(ret));
+    }
 
-extern void *hashlib_get(struct hashlib_hash *hash, char *key)
-{
-    unsigned int index;
-    struct hashlib_entry *e;
-    struct hashlib_entry f;
+    hashlib_build_thread(&t[0]);
 
-    assert(hash);
-    assert(key);
+    inserted = 0;
 
-    index = hashlib_index(key) % hash->tblsize;
+    for (i = 0; i < threads; i++) {
+        if (i)
+            pthread_join(tids[i], NULL);
 
-    if (!hash->tbl[index])
-        return NULL;
+        inserted           += t[i].count;
+        hash->key_bytes    += t[i].key_bytes;
+        hash->value_bytes  += t[i].value_bytes;
+        hash->bucket_bytes += t[i].bucket_bytes;
+    }
 
-    f.key = key;
+    hash->count += inserted;
 
-    e = tfind(&f, &(hash->tbl[index]), hashlib_compare);
+    pthread_barrier_destroy(&(s.barrier));
 
-    if (!e)
-        return NULL;
+    hashlib_rebuild_indexes(hash);
 
-    e = *(struct hashlib_entry **) e;
+    free(s.items);
+    free(s.order);
+    free(s.offset);
+    free(s.part_start);
+    free(t);
+    free(tids);
+    free(handles);
 
-    return e->value;
+    return inserted;
 }
 
 extern void hashlib_set_free_function(struct hashlib_hash *hash,
@@ -343,33 +1133,115 @@ extern void hashlib_set_pack_function(struct hashlib_hash *hash,
     hash->pack_function = pack_function;
 }
 
+extern void hashlib_set_copy_function(struct hashlib_hash *hash,
+                                      HASHLIB_FP_COPY(copy_function))
+{
+    assert(hash);
+    hash->copy_function = copy_function;
+}
+
+extern void hashlib_set_value_accounting(struct hashlib_hash *hash, int enable)
+{
+    struct hashlib_bucket *b;
+    struct hashlib_entry *e;
+    unsigned int i, j;
+
+    assert(hash);
+
+    hash->value_bytes    = 0;
+    hash->account_values = enable;
+
+    if (!enable)
+        return;
+
+    for (i = 0; i < hash->tblsize; i++) {
+        b = hash->tbl[i];
+
+        for (j = 0; b && j < b->count; j++) {
+            e = b->entry[j];
+            hash->value_bytes += e->size_function(e->value);
+        }
+    }
+}
+
+extern void hashlib_memory_stats(struct hashlib_hash *hash,
+                                 struct hashlib_memory *memory)
+{
+    assert(hash);
+    assert(memory);
+
+    memory->table   = sizeof(*hash);
+    memory->slots   = hash->tblbytes ? hash->tblbytes
+                                     : hash->tblsize * sizeof(*(hash->tbl));
+    memory->entries = hash->count * sizeof(struct hashlib_entry);
+    memory->keys    = hash->key_bytes;
+    memory->buckets = hash->bucket_bytes;
+    memory->values  = hash->value_bytes;
+    memory->order   = hash->order ? hashlib_order_bytes(hash->order) : 0;
+    memory->filter  = hash->filter ? hashlib_filter_bytes(hash->filter) : 0;
+}
+
+extern size_t hashlib_memory_usage(struct hashlib_hash *hash)
+{
+    struct hashlib_memory m;
+
+    hashlib_memory_stats(hash, &m);
+
+    return m.table + m.slots + m.entries + m.keys + m.buckets + m.values
+           + m.order + m.filter;
+}
+
 extern void *hashlib_remove(struct hashlib_hash *hash, char *key)
 {
+    struct hashlib_bucket *b;
     struct hashlib_entry *e;
-    struct hashlib_entry f;
     void *ret;
+    unsigned int h;
     unsigned int index;
+    unsigned int pos;
+    size_t len;
 
     assert(hash);
     assert(key);
 
-    f.key = key;
-    index = hashlib_index(key) % hash->tblsize;
+    h = hashlib_index_len(key, &len);
+
+    if (!hashlib_maybe_contains(hash, h))
+        return NULL;
 
-    e = tfind(&f, &(hash->tbl[index]), hashlib_compare);
+    index = hashlib_slot(h, hash->tblsize);
+    e     = hashlib_bucket_find(hash->tbl[index], key, len, h, &pos);
 
     if (!e)
         return NULL;
 
-    e   = *(struct hashlib_entry **) e;
+    if (hashlib_bucket_own(&hash->tbl[index]))
+        dief("malloc");
+
+    b   = hash->tbl[index];
     ret = e->value;
 
-    tdelete(&f, &(hash->tbl[index]), hashlib_compare);
+    b->count--;
+    b->entry[pos]               = b->entry[b->count];
+    hashlib_bucket_tags(b)[pos] = hashlib_bucket_tags(b)[b->count];
+
+    if (!b->count) {
+        hash->bucket_bytes -= hashlib_bucket_bytes(b->size);
+        hash->tbl[index]    = NULL;
+        free(b);
+    }
+
+    if (hash->order)
+        hashlib_order_remove(hash->order, e);
 
-    hashlib_entry_delete(e);
+    hashlib_account(hash, e, 0);
+    hashlib_entry_unref(e);
 
     hash->count--;
 
+    if (hash->filter)
+        hashlib_filter_remove(hash);
+
     return ret;
 }
 
@@ -381,87 +1253,241 @@ extern void hashlib_hash_delete(struct hashlib_hash *hash)
 
     for (i = 0; i < hash->tblsize; i++)
         if (hash->tbl[i])
-            tdestroy(hash->tbl[i], hashlib_tree_delete);
+            hashlib_bucket_unref(hash->tbl[i]);
+
+    if (hash->pool)
+        hash->pool->tables--;
+
+    if (hash->order)
+        hashlib_order_delete(hash->order);
 
-    free(hash->tbl);
+    if (hash->filter)
+        hashlib_filter_delete(hash->filter);
+
+    hashlib_mem_free(hash->tbl, hash->tblbytes);
     free(hash);
 }
 
-static void hashlib_store_action(const void *nodep,
-                                 const VISIT which,
-                                 const int depth)
+extern struct hashlib_hash *hashlib_clone(struct hashlib_hash *hash)
 {
-    struct hashlib_entry *e;
-    int fd;
-    size_t bytes;
-    size_t keylen;
+    struct hashlib_hash *clone;
+    int ret;
 
-    if (which == preorder || which == endorder)
-        return;
+    ret = hashlib_try_clone(&clone, hash);
+
+    if (ret) {
+        errno = -ret;
+        dief("hashlib_clone");
+    }
+
+    return clone;
+}
+
+/*
+ * the clone shares all buckets with hash, a bucket is copied when either
+ * table changes it; only the slot array is copied.  hash and its clones may
+ * be used by different threads.  Returns 0 or -ENOMEM.
+ */
+extern int hashlib_try_clone(struct hashlib_hash **clonep,
+                             struct hashlib_hash *hash)
+{
+    struct hashlib_hash *clone;
+    struct hashlib_bucket *b;
+    size_t i;
+
+    assert(clonep);
+    assert(hash);
+
+    *clonep = NULL;
 
-    e = *(struct hashlib_entry **) nodep;
+    clone = malloc(sizeof(*clone));
 
-    bytes = e->size_function(e);
-    fd    = hashlib_current_fd(QUERY);
+    if (!clone)
+        return -ENOMEM;
+
+    *clone        = *hash;
+    clone->order  = NULL;
+    clone->filter = NULL;
+    clone->tbl    = hashlib_mem_alloc(hash->tblsize * sizeof(*(hash->tbl)),
+                                      hash->alloc_flags, hash->alloc_node,
+                                      &clone->tblbytes);
+
+    if (!clone->tbl) {
+        free(clone);
+        return -ENOMEM;
+    }
+
+    if (hash->order && hashlib_order_clone(&clone->order, hash->order))
+        goto fail;
+
+    if (hash->filter
+        && !(clone->filter = hashlib_filter_copy(hash->filter,
+                                                 hash->alloc_flags,
+                                                 hash->alloc_node)))
+        goto fail;
+
+    /* the new slot array is zeroed, writing only the used slots keeps a
+     * sparse mapped array sparse */
+    for (i = 0; i < hash->tblsize; i++) {
+        b = hash->tbl[i];
+
+        if (!b)
+            continue;
+
+        __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+        clone->tbl[i] = b;
+    }
+
+    if (clone->pool)
+        clone->pool->tables++;
+
+    *clonep = clone;
+
+    return 0;
+
+fail:
+    if (clone->order)
+        hashlib_order_delete(clone->order);
+
+    hashlib_mem_free(clone->tbl, clone->tblbytes);
+    free(clone);
+
+    return -ENOMEM;
+}
+
+/*
+ * returns 0 or -errno; values of a custom pack function are packed into
+ * *scratch first, a memfd created on first use, since pack functions write
+ * to a file descriptor
+ */
+static int hashlib_store_entry(struct hashlib_entry *e,
+                               struct hashlib_writer *w, int *scratch)
+{
+    size_t bytes;
+    size_t keylen;
+    int ret;
+
+    bytes = e->size_function(e->value);
 
     /* write size */
-    hashlib_write(fd, &bytes, sizeof(bytes));
+    ret = hashlib_writer_put(w, &bytes, sizeof(bytes));
+
+    if (ret)
+        return ret;
 
     /* write data */
-    e->pack_function(e->value, bytes, fd);
+    if (e->pack_function == hashlib_default_pack_function) {
+        ret = hashlib_writer_put(w, e->value, bytes);
+    } else {
+        if (*scratch == -1 && (*scratch = memfd_create("hashlib", 0)) == -1)
+            return -errno;
+
+        if (ftruncate(*scratch, 0) || lseek(*scratch, 0, SEEK_SET))
+            return -errno;
+
+        e->pack_function(e->value, bytes, *scratch);
+
+        /* pack functions cannot report errors, a short write is one */
+        if (lseek(*scratch, 0, SEEK_CUR) != (off_t) bytes)
+            return -EIO;
+
+        lseek(*scratch, 0, SEEK_SET);
+
+        ret = hashlib_writer_put_fd(w, *scratch, bytes);
+    }
+
+    if (ret)
+        return ret;
 
-    keylen = strlen(e->key);
+    keylen = e->keylen;
 
     /* write length of key */
-    hashlib_write(fd, &keylen, sizeof(keylen));
+    ret = hashlib_writer_put(w, &keylen, sizeof(keylen));
+
+    if (ret)
+        return ret;
 
     /* write key */
-    hashlib_write(fd, e->key, sizeof(*(e->key)) * keylen);
+    return hashlib_writer_put(w, e->key, sizeof(*(e->key)) * keylen);
+}
+
+extern void hashlib_store(struct hashlib_hash *hash, const char *filename)
+{
+    int ret;
 
-    return;
+    ret = hashlib_try_store(hash, filename);
 
-    /* avoid gcc warning */
-    (void) depth;
+    if (ret) {
+        errno = -ret;
+        dief("%s", filename);
+    }
 }
 
-static void hashlib_write_header(struct hashlib_hash *hash, int fd)
+/* returns 0 or -errno, filename is removed if it could not be written */
+extern int hashlib_try_store(struct hashlib_hash *hash, const char *filename)
 {
-    size_t h;
+    int fd;
+    int ret;
 
     assert(hash);
-    assert(fd >= 0);
+    assert(filename);
+
+    fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+
+    if (fd == -1)
+        return -errno;
+
+    ret = hashlib_store_fd(hash, fd);
 
-    h = HASHLIB_FILE_HEADER;
+    if (close(fd) == -1 && !ret)
+        ret = -errno;
 
-    hashlib_write(fd, &h, sizeof(h));
-    hashlib_write(fd, &(hash->tblsize), sizeof(hash->tblsize));
-    hashlib_write(fd, &(hash->count), sizeof(hash->count));
+    if (ret)
+        unlink(filename);
+
+    return ret;
 }
 
-extern void hashlib_store(struct hashlib_hash *hash, const char *filename)
+/* records are written one by one through a buffer, returns 0 or -errno */
+extern int hashlib_store_to(struct hashlib_hash *hash,
+                            struct hashlib_stream *out)
 {
-    int fd;
-    unsigned int i;
+    struct hashlib_writer *w;
+    struct hashlib_bucket *b;
+    size_t header[3];
+    int scratch;
+    int ret;
+    int flushed;
+    unsigned int i, j;
 
     assert(hash);
-    assert(filename);
+    assert(out);
 
-    fd = hashlib_open(filename, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+    w = hashlib_writer_new(out);
 
-    hashlib_current_fd(fd);
+    if (!w)
+        return -ENOMEM;
 
-    hashlib_write_header(hash, fd);
+    scratch   = -1;
+    header[0] = HASHLIB_FILE_HEADER;
+    header[1] = hash->tblsize;
+    header[2] = hash->count;
 
-    for (i = 0; i < hash->tblsize; i++) {
-        if (!hash->tbl[i])
-            continue;
+    ret = hashlib_writer_put(w, header, sizeof(header));
+
+    for (i = 0; !ret && i < hash->tblsize; i++) {
+        b = hash->tbl[i];
 
-        twalk(hash->tbl[i], hashlib_store_action);
+        for (j = 0; !ret && b && j < b->count; j++)
+            ret = hashlib_store_entry(b->entry[j], w, &scratch);
     }
 
-    hashlib_current_fd(RESET);
+    if (scratch != -1)
+        close(scratch);
 
-    hashlib_close(fd);
+    flushed = hashlib_writer_delete(w, !ret);
+
+    return ret ? ret : flushed;
 }
 
 extern struct hashlib_hash *hashlib_retrieve(const char *filename,
@@ -469,77 +1495,166 @@ extern struct hashlib_hash *hashlib_retrieve(const char *filename,
                                              HASHLIB_FP_FREE(ff))
 {
     struct hashlib_hash *hash;
-    size_t tblsize;
-    size_t count;
-    size_t h;
-    size_t size;
-    size_t data_len;
-    size_t key_len;
-    size_t ret;
+    int ret;
+
+    ret = hashlib_try_retrieve(&hash, filename, unpack, ff);
+
+    if (ret == -EINVAL)
+        diefx("%s: not a hashlib file or truncated", filename);
+
+    if (ret) {
+        errno = -ret;
+        dief("%s", filename);
+    }
+
+    return hash;
+}
+
+/*
+ * returns 0, -EINVAL if filename is not a hashlib file or truncated, -ENOMEM
+ * or the error of open or read; *hashp is NULL on failure
+ */
+extern int hashlib_try_retrieve(struct hashlib_hash **hashp,
+                                const char *filename,
+                                HASHLIB_FP_UNPACK(unpack),
+                                HASHLIB_FP_FREE(ff))
+{
     int fd;
-    void *data;
+    int ret;
+
+    assert(hashp);
+    assert(filename);
+
+    *hashp = NULL;
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd == -1)
+        return -errno;
+
+    ret = hashlib_retrieve_fd(hashp, fd, unpack, ff);
+
+    close(fd);
+
+    return ret;
+}
+
+/*
+ * reads records one by one, the memory used besides the table is bounded by
+ * the largest record; returns 0, -EINVAL if the stream is not in the format
+ * of hashlib_store or truncated, -ENOMEM or the error of in
+ */
+extern int hashlib_retrieve_from(struct hashlib_hash **hashp,
+                                 struct hashlib_stream *in,
+                                 HASHLIB_FP_UNPACK(unpack),
+                                 HASHLIB_FP_FREE(ff))
+{
+    struct hashlib_hash *hash;
+    struct hashlib_reader *r;
+    size_t header[3];
+    size_t data_len, data_size;
+    size_t key_len, key_size;
+    ssize_t got;
+    int ret;
+    int put;
+    void *value;
+    char *data;
     char *key;
 
-    size = sizeof(size_t);
-    data = key = NULL;
+    assert(hashp);
+    assert(in);
+
+    *hashp    = NULL;
+    hash      = NULL;
+    data      = key = NULL;
+    data_size = key_size = 0;
 
     if (!unpack)
         unpack = hashlib_default_unpack_function;
 
-    fd = hashlib_open(filename, O_RDONLY, 0);
+    r = hashlib_reader_new(in);
+
+    if (!r)
+        return -ENOMEM;
 
-    ret = hashlib_read(fd, &h, size);
+    /* filetype, table size and entry count */
+    ret = hashlib_reader_get_exact(r, header, sizeof(header));
 
-    if (ret != size)
-        diefx("%s: unable to read filetype", filename);
+    if (!ret && header[0] != HASHLIB_FILE_HEADER)
+        ret = -EINVAL;
 
-    if (h != HASHLIB_FILE_HEADER)
-        diefx("%s: not a hashlib file", filename);
+    if (!ret)
+        ret = hashlib_try_hash_new(&hash, header[1]);
+
+    if (!ret)
+        hashlib_set_free_function(hash, ff);
 
-    ret = hashlib_read(fd, &tblsize, size);
+    while (!ret) {
+        got = hashlib_reader_get(r, &data_len, sizeof(data_len));
 
-    if (ret != size)
-        diefx("%s: unable to read table size", filename);
+        if (!got)
+            break;
 
-    hash = hashlib_hash_new(tblsize);
+        if (got < 0) {
+            ret = got;
+            break;
+        }
 
-    hashlib_set_free_function(hash, ff);
+        if (got != sizeof(data_len)) {
+            ret = -EINVAL;
+            break;
+        }
 
-    ret = hashlib_read(fd, &count, size);
+        ret = hashlib_reserve(&data, &data_size, data_len ? data_len : 1);
 
-    if (ret != size)
-        diefx("%s: unable to read entry count", filename);
+        if (!ret)
+            ret = hashlib_reader_get_exact(r, data, data_len);
 
-    while((ret = hashlib_read(fd, &data_len, size))) {
-        if (ret != size)
-            diefx("%s: unable to read size of data", filename);
+        if (!ret)
+            ret = hashlib_reader_get_exact(r, &key_len, sizeof(key_len));
 
-        data = hashlib_calloc(1, data_len);
+        if (!ret && key_len == SIZE_MAX)
+            ret = -EINVAL;
 
-        ret = hashlib_read(fd, data, data_len);
+        if (!ret)
+            ret = hashlib_reserve(&key, &key_size, key_len + 1);
 
-        if (ret != data_len)
-            diefx("%s: unable to read data", filename);
+        if (!ret)
+            ret = hashlib_reader_get_exact(r, key, key_len);
 
-        ret = hashlib_read(fd, &key_len, size);
+        if (ret)
+            break;
 
-        if (ret != size)
-            diefx("%s: unable to read length of key", filename);
+        key[key_len] = '\0';
 
-        key = hashlib_calloc(1, key_len + 1);
+        value = unpack(data, data_len);
 
-        ret = hashlib_read(fd, key, key_len);
+        if (!value) {
+            ret = -ENOMEM;
+            break;
+        }
 
-        if (ret != key_len)
-            diefx("%s: unable to read key", filename);
+        put = hashlib_try_put(hash, key, value);
 
-        hashlib_put(hash, key, unpack(data, data_len));
+        /* a failed put leaves value to the caller */
+        if (put < 0 && ff)
+            ff(value);
 
-        free(data);
-        free(key);
+        ret = put < 0 ? put : 0;
     }
 
-    hashlib_close(fd);
+    free(data);
+    free(key);
+    hashlib_reader_delete(r);
 
-    return hash;
+    if (ret) {
+        if (hash)
+            hashlib_hash_delete(hash);
+
+        return ret;
+    }
+
+    *hashp = hash;
+
+    return 0;
 }
@@ -20,6 +20,8 @@
 #ifndef HASHLIB_HASHLIB_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define HASHLIB_HASHLIB_H
 
@@ -27,6 +29,30 @@
 
 #define hashlib_count(hash) (hash)->count
 
+#define hashlib_frozen_count(frozen) (frozen)->count
+
+#define hashlib_u64_count(hash) (hash)->count
+
+#define hashlib_pool_count(pool) (pool)->count
+
+/* levels of hashlib_set_simd_level */
+#define HASHLIB_SIMD_SCALAR 0
+#define HASHLIB_SIMD_SSE2   1
+#define HASHLIB_SIMD_AVX2   2
+
+/* flags of hashlib_hash_new_alloc */
+#define HASHLIB_ALLOC_THP        (1 << 0) /* transparent huge pages */
+#define HASHLIB_ALLOC_HUGETLB    (1 << 1) /* reserved huge pages, else THP */
+#define HASHLIB_ALLOC_INTERLEAVE (1 << 2) /* interleave over all NUMA nodes */
+#define HASHLIB_ALLOC_BIND       (1 << 3) /* bind to one NUMA node */
+
+/* flags of hashlib_store_async and hashlib_retrieve_async */
+#define HASHLIB_AIO_DIRECT (1 << 0) /* bypass the page cache with O_DIRECT */
+#define HASHLIB_AIO_THREAD (1 << 1) /* an I/O thread even if io_uring works */
+
+/* flags of hashlib_build */
+#define HASHLIB_BUILD_UNIQUE (1 << 0) /* keys are known to be unique */
+
 #define HASHLIB_FP_FREE(fname) \
         void (*(fname))(void *)
 
@@ -39,6 +65,27 @@
 #define HASHLIB_FP_UNPACK(fname) \
         void *(*(fname))(void *, size_t)
 
+#define HASHLIB_FP_COPY(fname) \
+        void *(*(fname))(void *)
+
+#define HASHLIB_FP_WRITE(fname) \
+        int (*(fname))(void *, const void *, size_t)
+
+#define HASHLIB_FP_READ(fname) \
+        ssize_t (*(fname))(void *, void *, size_t)
+
+#define HASHLIB_FP_CONFLICT(fname) \
+        int (*(fname))(const char *, void *, void *)
+
+#define HASHLIB_FP_EQUAL(fname) \
+        int (*(fname))(void *, void *)
+
+#define HASHLIB_FP_DIFF(fname) \
+        void (*(fname))(const char *, void *, void *, void *)
+
+#define HASHLIB_FP_RANGE(fname) \
+        int (*(fname))(const char *, void *, void *)
+
 #define HASHLIB_FCT_FREE(fname, arg) \
         void (fname)(void *(arg))
 
@@ -51,10 +98,117 @@
 #define HASHLIB_FCT_UNPACK(fname, arg, bytes) \
         void *(fname)(void *(arg), size_t (bytes))
 
+#define HASHLIB_FCT_COPY(fname, arg) \
+        void *(fname)(void *(arg))
+
+#define HASHLIB_FCT_WRITE(fname, ctx, data, bytes) \
+        int (fname)(void *(ctx), const void *(data), size_t (bytes))
+
+#define HASHLIB_FCT_READ(fname, ctx, buf, bytes) \
+        ssize_t (fname)(void *(ctx), void *(buf), size_t (bytes))
+
+struct hashlib_entry;
+struct hashlib_pool;
+struct hashlib_order;
+struct hashlib_filter;
+struct hashlib_ingest;
+
 struct hashlib_hash {
     void **tbl;
     size_t count;
     size_t tblsize;
+    size_t key_bytes;
+    size_t value_bytes;
+    size_t bucket_bytes;
+    size_t tblbytes;    /* length of the mapped slot array, or 0 */
+    int account_values;
+    int alloc_flags;
+    int alloc_node;
+    struct hashlib_pool *pool;  /* keys are interned in pool, or NULL */
+    struct hashlib_order *order;    /* ordered index of the keys, or NULL */
+    struct hashlib_filter *filter;  /* Bloom filter of the keys, or NULL */
+    HASHLIB_FP_FREE(free_function);
+    HASHLIB_FP_SIZE(size_function);
+    HASHLIB_FP_PACK(pack_function);
+    HASHLIB_FP_COPY(copy_function); /* copies a value, see hashlib_get_ref */
+};
+
+/*
+ * interned keys shared by a group of tables; a key is stored once and
+ * handed out as a handle, a pointer to the stored string that stays valid
+ * until the pool is deleted.  index is a table generated by HASHLIB_DECLARE.
+ */
+struct hashlib_pool {
+    void *index;
+    void *chunk;    /* newest block of key storage */
+    size_t count;
+    size_t bytes;   /* blocks of key storage */
+    size_t tables;  /* tables using the pool */
+};
+
+/*
+ * sink of hashlib_store_to and source of hashlib_retrieve_from; write returns
+ * 0 or -errno, read returns the bytes read, 0 at the end, or -errno
+ */
+struct hashlib_stream {
+    void *ctx;
+    HASHLIB_FP_WRITE(write);
+    HASHLIB_FP_READ(read);
+};
+
+/* mapping of a table in shared memory, see hashlib_shm_create */
+struct hashlib_shm {
+    void *base;
+    size_t bytes;
+    int writable;
+};
+
+/* bytes of a shared memory segment, see hashlib_shm_memory_stats */
+struct hashlib_shm_memory {
+    size_t bytes;   /* size of the segment */
+    size_t used;    /* header, slots and all entries ever put */
+    size_t garbage; /* removed and replaced entries, part of used */
+};
+
+/* bytes requested from the allocator, allocator overhead is not included */
+struct hashlib_memory {
+    size_t table;   /* struct hashlib_hash */
+    size_t slots;   /* slot array */
+    size_t entries; /* one entry per key */
+    size_t keys;    /* key strings including terminating null byte */
+    size_t buckets; /* buckets holding the entries of a slot */
+    size_t values;  /* values, only if value accounting is enabled */
+    size_t order;   /* ordered index, only if the table is ordered */
+    size_t filter;  /* Bloom filter, only if the table has one */
+};
+
+/* a slot of a frozen table, key is the offset of the key in keys */
+struct hashlib_frozen_slot {
+    size_t key;
+    void *value;
+};
+
+/* immutable table using a minimal perfect hash function */
+struct hashlib_frozen {
+    struct hashlib_frozen_slot *slot;
+    unsigned int *pilot;
+    char *keys;
+    size_t count;
+    size_t buckets;
+    size_t keys_size;
+    size_t seed;
+    struct hashlib_filter *filter;  /* Bloom filter of the keys, or NULL */
+    struct hashlib_entry **shared;  /* per slot, entry of a clone owning the
+                                     * value or NULL, NULL if none is shared */
+    HASHLIB_FP_FREE(free_function);
+    HASHLIB_FP_SIZE(size_function);
+    HASHLIB_FP_PACK(pack_function);
+};
+
+/* table with uint64_t keys, tbl is a table generated by HASHLIB_DECLARE */
+struct hashlib_u64 {
+    void *tbl;
+    size_t count;
     HASHLIB_FP_FREE(free_function);
     HASHLIB_FP_SIZE(size_function);
     HASHLIB_FP_PACK(pack_function);
@@ -66,15 +220,143 @@ void hashlib_set_size_function(struct hashlib_hash *hash,
                                HASHLIB_FP_SIZE(size_function));
 void hashlib_set_pack_function(struct hashlib_hash *hash,
                                HASHLIB_FP_PACK(pack_function));
+void hashlib_set_copy_function(struct hashlib_hash *hash,
+                               HASHLIB_FP_COPY(copy_function));
+void hashlib_set_value_accounting(struct hashlib_hash *hash, int enable);
+void hashlib_memory_stats(struct hashlib_hash *hash,
+                          struct hashlib_memory *memory);
+size_t hashlib_memory_usage(struct hashlib_hash *hash);
 void *hashlib_remove(struct hashlib_hash *hash, char *key);
 struct hashlib_hash *hashlib_hash_new(size_t size);
+struct hashlib_hash *hashlib_hash_new_alloc(size_t size, int flags, int node);
+int hashlib_try_hash_new(struct hashlib_hash **hash, size_t size);
+int hashlib_try_hash_new_alloc(struct hashlib_hash **hash, size_t size,
+                               int flags, int node);
 int hashlib_put(struct hashlib_hash *hash, char *key, void *data);
+int hashlib_try_put(struct hashlib_hash *hash, char *key, void *data);
+size_t hashlib_build(struct hashlib_hash *hash, char **keys, void **values,
+                     size_t n, unsigned int threads, int flags);
+struct hashlib_ingest *hashlib_ingest_new(struct hashlib_hash *hash,
+                                          unsigned int threads);
+int hashlib_try_ingest_new(struct hashlib_ingest **ingest,
+                           struct hashlib_hash *hash, unsigned int threads);
+void hashlib_ingest_submit(struct hashlib_ingest *ingest, char **keys,
+                           void **values, size_t n);
+size_t hashlib_ingest_flush(struct hashlib_ingest *ingest);
+void hashlib_ingest_delete(struct hashlib_ingest *ingest);
 void *hashlib_get(struct hashlib_hash *hash, char *key);
+void **hashlib_get_ref(struct hashlib_hash *hash, char *key);
+int hashlib_replace(struct hashlib_hash *hash, char *key, void *value);
+int hashlib_try_replace(struct hashlib_hash *hash, char *key, void *value);
 unsigned int hashlib_index(char *key);
 void hashlib_hash_delete(struct hashlib_hash *hash);
+struct hashlib_hash *hashlib_clone(struct hashlib_hash *hash);
+int hashlib_try_clone(struct hashlib_hash **clone, struct hashlib_hash *hash);
+size_t hashlib_merge(struct hashlib_hash *dst, struct hashlib_hash *src,
+                     HASHLIB_FP_CONFLICT(conflict), unsigned int threads);
+size_t hashlib_diff(struct hashlib_hash *a, struct hashlib_hash *b,
+                    HASHLIB_FP_EQUAL(equal), HASHLIB_FP_DIFF(diff), void *arg,
+                    unsigned int threads);
+
+void hashlib_set_ordered(struct hashlib_hash *hash, int enable);
+int hashlib_try_set_ordered(struct hashlib_hash *hash, int enable);
+size_t hashlib_range(struct hashlib_hash *hash, const char *lo,
+                     const char *hi, HASHLIB_FP_RANGE(cb), void *arg);
+size_t hashlib_prefix(struct hashlib_hash *hash, const char *prefix,
+                      HASHLIB_FP_RANGE(cb), void *arg);
+size_t hashlib_remove_prefix(struct hashlib_hash *hash, const char *prefix);
+void hashlib_set_filter(struct hashlib_hash *hash, unsigned int bits_per_key);
+int hashlib_try_set_filter(struct hashlib_hash *hash,
+                           unsigned int bits_per_key);
+
+struct hashlib_pool *hashlib_pool_new(size_t size);
+int hashlib_try_pool_new(struct hashlib_pool **pool, size_t size);
+void hashlib_pool_delete(struct hashlib_pool *pool);
+size_t hashlib_pool_memory_usage(struct hashlib_pool *pool);
+const char *hashlib_intern(struct hashlib_pool *pool, const char *key);
+int hashlib_try_intern(struct hashlib_pool *pool, const char *key,
+                       const char **handle);
+const char *hashlib_interned(struct hashlib_pool *pool, const char *key);
+void hashlib_set_pool(struct hashlib_hash *hash, struct hashlib_pool *pool);
+int hashlib_put_interned(struct hashlib_hash *hash, const char *handle,
+                         void *value);
+int hashlib_try_put_interned(struct hashlib_hash *hash, const char *handle,
+                             void *value);
+void *hashlib_get_interned(struct hashlib_hash *hash, const char *handle);
+
 void hashlib_store(struct hashlib_hash *hash, const char *filename);
 extern struct hashlib_hash *hashlib_retrieve(const char *filename,
                                              HASHLIB_FP_UNPACK(unpack),
                                              HASHLIB_FP_FREE(ff));
 
+/* variants that return 0 or a negative errno instead of exiting */
+int hashlib_try_store(struct hashlib_hash *hash, const char *filename);
+int hashlib_try_retrieve(struct hashlib_hash **hash, const char *filename,
+                         HASHLIB_FP_UNPACK(unpack), HASHLIB_FP_FREE(ff));
+
+/* streaming variants, in the format of hashlib_store */
+int hashlib_store_to(struct hashlib_hash *hash, struct hashlib_stream *out);
+int hashlib_store_fd(struct hashlib_hash *hash, int fd);
+int hashlib_store_buffer(struct hashlib_hash *hash, void **data, size_t *len);
+int hashlib_retrieve_from(struct hashlib_hash **hash,
+                          struct hashlib_stream *in,
+                          HASHLIB_FP_UNPACK(unpack), HASHLIB_FP_FREE(ff));
+int hashlib_retrieve_fd(struct hashlib_hash **hash, int fd,
+                        HASHLIB_FP_UNPACK(unpack), HASHLIB_FP_FREE(ff));
+int hashlib_retrieve_buffer(struct hashlib_hash **hash, const void *data,
+                            size_t len, HASHLIB_FP_UNPACK(unpack),
+                            HASHLIB_FP_FREE(ff));
+
+/* variants overlapping the file I/O with the table walk */
+int hashlib_store_async(struct hashlib_hash *hash, const char *filename,
+                        int flags);
+int hashlib_retrieve_async(struct hashlib_hash **hash, const char *filename,
+                           HASHLIB_FP_UNPACK(unpack), HASHLIB_FP_FREE(ff),
+                           int flags);
+
+struct hashlib_frozen *hashlib_freeze(struct hashlib_hash *hash);
+void *hashlib_frozen_get(struct hashlib_frozen *frozen, char *key);
+void hashlib_frozen_delete(struct hashlib_frozen *frozen);
+void hashlib_frozen_set_filter(struct hashlib_frozen *frozen,
+                               unsigned int bits_per_key);
+void hashlib_frozen_store(struct hashlib_frozen *frozen, const char *filename);
+struct hashlib_frozen *hashlib_frozen_retrieve(const char *filename,
+                                               HASHLIB_FP_UNPACK(unpack),
+                                               HASHLIB_FP_FREE(ff));
+
+int hashlib_shm_create(struct hashlib_shm **shm, const char *name,
+                       size_t size, size_t bytes);
+int hashlib_shm_open(struct hashlib_shm **shm, const char *name, int writable);
+void hashlib_shm_close(struct hashlib_shm *shm);
+int hashlib_shm_unlink(const char *name);
+int hashlib_shm_put(struct hashlib_shm *shm, const char *key,
+                    const void *value, size_t size);
+int hashlib_shm_remove(struct hashlib_shm *shm, const char *key);
+const void *hashlib_shm_get(struct hashlib_shm *shm, const char *key,
+                            size_t *size);
+size_t hashlib_shm_count(struct hashlib_shm *shm);
+uint64_t hashlib_shm_version(struct hashlib_shm *shm);
+void hashlib_shm_memory_stats(struct hashlib_shm *shm,
+                              struct hashlib_shm_memory *m);
+int hashlib_shm_load(struct hashlib_shm *shm, const char *filename);
+
+int hashlib_simd_level(void);
+int hashlib_set_simd_level(int level);
+
+struct hashlib_u64 *hashlib_u64_new(size_t size);
+void hashlib_u64_set_free_function(struct hashlib_u64 *hash,
+                                   HASHLIB_FP_FREE(free_function));
+void hashlib_u64_set_size_function(struct hashlib_u64 *hash,
+                                   HASHLIB_FP_SIZE(size_function));
+void hashlib_u64_set_pack_function(struct hashlib_u64 *hash,
+                                   HASHLIB_FP_PACK(pack_function));
+int hashlib_u64_put(struct hashlib_u64 *hash, uint64_t key, void *value);
+void *hashlib_u64_get(struct hashlib_u64 *hash, uint64_t key);
+void *hashlib_u64_remove(struct hashlib_u64 *hash, uint64_t key);
+void hashlib_u64_delete(struct hashlib_u64 *hash);
+void hashlib_u64_store(struct hashlib_u64 *hash, const char *filename);
+struct hashlib_u64 *hashlib_u64_retrieve(const char *filename,
+                                         HASHLIB_FP_UNPACK(unpack),
+                                         HASHLIB_FP_FREE(ff));
+
 #endif
@@ -0,0 +1,733 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Double buffered file I/O for hashlib_store and hashlib_retrieve.  While
+ * the table is walked into one buffer the other one is written, and while
+ * records are parsed from one buffer the next one is read ahead, so the
+ * CPU and the disk work at the same time.
+ *
+ * The transfers go through io_uring where the kernel provides it and
+ * through an I/O thread otherwise; both are used through the syscalls,
+ * liburing is not required.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef SYS_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* a multiple of the block size of any device, as O_DIRECT requires */
+#define HASHLIB_AIO_BUFFER ((size_t) 2 << 20)
+#define HASHLIB_AIO_ALIGN  4096
+
+struct hashlib_aio_buf {
+    struct iovec iov;   /* data and bytes of the transfer */
+    off_t offset;
+    ssize_t result;     /* bytes transferred or -errno */
+    int pending;
+};
+
+struct hashlib_uring {
+    int fd;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+#ifdef SYS_io_uring_setup
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+struct hashlib_aio {
+    int fd;
+    int writing;
+    int direct;
+    int error;          /* first error of a write, reported on close */
+    unsigned int cur;   /* buffer the caller fills or reads */
+    size_t pos;         /* read position in the current buffer */
+    int ready;          /* the current buffer has been waited for */
+    off_t offset;       /* file offset of the next transfer */
+    struct hashlib_aio_buf buf[2];
+
+    /* either the ring, or the thread if ring.fd is -1 */
+    struct hashlib_uring ring;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int queue[2];
+    unsigned int queued;
+    unsigned int done;
+    int stop;
+};
+
+/* pread or pwrite of len bytes, returns the bytes transferred or -errno */
+static ssize_t hashlib_aio_pio(struct hashlib_aio *a, char *data, size_t len,
+                               off_t offset)
+{
+    ssize_t ret;
+    size_t done;
+
+    for (done = 0; done < len; done += ret) {
+        if (a->writing)
+            ret = pwrite(a->fd, data + done, len - done, offset + done);
+        else
+            ret = pread(a->fd, data + done, len - done, offset + done);
+
+        if (ret == -1 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+
+        if (ret == -1)
+            return -errno;
+
+        /* the end of the file */
+        if (!ret)
+            break;
+    }
+
+    return done;
+}
+
+static void *hashlib_aio_thread(void *arg)
+{
+    struct hashlib_aio *a;
+    unsigned int i;
+    ssize_t ret;
+
+    a = arg;
+
+    pthread_mutex_lock(&a->lock);
+
+    for (;;) {
+        while (a->done == a->queued && !a->stop)
+            pthread_cond_wait(&a->cond, &a->lock);
+
+        if (a->done == a->queued)
+            break;
+
+        i = a->queue[a->done % 2];
+
+        pthread_mutex_unlock(&a->lock);
+        ret = hashlib_aio_pio(a, a->buf[i].iov.iov_base, a->buf[i].iov.iov_len,
+                              a->buf[i].offset);
+        pthread_mutex_lock(&a->lock);
+
+        a->buf[i].result = ret;
+        __atomic_store_n(&a->buf[i].pending, 0, __ATOMIC_RELEASE);
+        a->done++;
+
+        pthread_cond_broadcast(&a->cond);
+    }
+
+    pthread_mutex_unlock(&a->lock);
+
+    return NULL;
+}
+
+#ifdef SYS_io_uring_setup
+/* returns 0 or -errno, the ring is unusable after an error */
+static int hashlib_uring_init(struct hashlib_uring *u)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+
+    u->fd = syscall(SYS_io_uring_setup, 2, &p);
+
+    if (u->fd == -1)
+        return -errno;
+
+    u->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* both rings share one mapping on kernels since 5.4 */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_len = u->sq_len > u->cq_len ? u->sq_len : u->cq_len;
+        u->cq_len = 0;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = u->sq_ring;
+    u->sqes    = MAP_FAILED;
+
+    if (u->sq_ring != MAP_FAILED && u->cq_len)
+        u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+
+    if (u->cq_ring != MAP_FAILED)
+        u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+    if (u->sqes == MAP_FAILED) {
+        if (u->cq_len && u->cq_ring != MAP_FAILED)
+            munmap(u->cq_ring, u->cq_len);
+
+        if (u->sq_ring != MAP_FAILED)
+            munmap(u->sq_ring, u->sq_len);
+
+        close(u->fd);
+        u->fd = -1;
+
+        return -ENOMEM;
+    }
+
+    sq = u->sq_ring;
+    cq = u->cq_ring;
+
+    u->sq_tail  = (unsigned int *) (sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned int *) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *) (sq + p.sq_off.array);
+    u->cq_head  = (unsigned int *) (cq + p.cq_off.head);
+    u->cq_tail  = (unsigned int *) (cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned int *) (cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void hashlib_uring_exit(struct hashlib_uring *u)
+{
+    munmap(u->sqes, u->sqes_len);
+
+    if (u->cq_len)
+        munmap(u->cq_ring, u->cq_len);
+
+    munmap(u->sq_ring, u->sq_len);
+    close(u->fd);
+}
+
+static int hashlib_uring_enter(struct hashlib_uring *u, unsigned int submit,
+                               unsigned int wait)
+{
+    long ret;
+
+    do {
+        ret = syscall(SYS_io_uring_enter, u->fd, submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == -1 ? -errno : 0;
+}
+
+static int hashlib_uring_submit(struct hashlib_aio *a, unsigned int i)
+{
+    struct hashlib_uring *u;
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+
+    u     = &a->ring;
+    tail  = *u->sq_tail;
+    index = tail & *u->sq_mask;
+    sqe   = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    /* readv and writev are the oldest operations of io_uring */
+    sqe->opcode    = a->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = a->fd;
+    sqe->addr      = (uintptr_t) &a->buf[i].iov;
+    sqe->len       = 1;
+    sqe->off       = a->buf[i].offset;
+    sqe->user_data = i;
+
+    u->sq_array[index] = index;
+
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return hashlib_uring_enter(u, 1, 0);
+}
+
+/* waits for the completion of buf i */
+static int hashlib_uring_wait(struct hashlib_aio *a, unsigned int i)
+{
+    struct hashlib_uring *u;
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int ret;
+
+    u = &a->ring;
+
+    while (a->buf[i].pending) {
+        head = *u->cq_head;
+
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            if ((ret = hashlib_uring_enter(u, 0, 1)))
+                return ret;
+
+            continue;
+        }
+
+        cqe = &u->cqes[head & *u->cq_mask];
+
+        a->buf[cqe->user_data].result  = cqe->res;
+        a->buf[cqe->user_data].pending = 0;
+
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+#else
+static int hashlib_uring_init(struct hashlib_uring *u)
+{
+    u->fd = -1;
+
+    return -ENOSYS;
+}
+
+static void hashlib_uring_exit(struct hashlib_uring *u)
+{
+    (void) u;
+}
+
+static int hashlib_uring_submit(struct hashlib_aio *a, unsigned int i)
+{
+    (void) a;
+    (void) i;
+
+    return -ENOSYS;
+}
+
+static int hashlib_uring_wait(struct hashlib_aio *a, unsigned int i)
+{
+    (void) a;
+    (void) i;
+
+    return -ENOSYS;
+}
+#endif
+
+/* nonzero while buf i is transferred, the I/O thread clears it */
+static inline int hashlib_aio_pending(struct hashlib_aio *a, unsigned int i)
+{
+    return __atomic_load_n(&a->buf[i].pending, __ATOMIC_ACQUIRE);
+}
+
+/* starts the transfer of bytes bytes of buf i at offset */
+static int hashlib_aio_submit(struct hashlib_aio *a, unsigned int i,
+                              off_t offset, size_t bytes)
+{
+    struct hashlib_aio_buf *b;
+    int ret;
+
+    b = &a->buf[i];
+
+    assert(!b->pending);
+
+    b->iov.iov_len = bytes;
+    b->offset      = offset;
+    b->pending     = 1;
+
+    if (a->ring.fd != -1) {
+        ret = hashlib_uring_submit(a, i);
+
+        if (ret)
+            b->pending = 0;
+
+        return ret;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    a->queue[a->queued++ % 2] = i;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+
+    return 0;
+}
+
+/*
+ * waits for buf i and returns the bytes transferred or -errno.  The ring
+ * may complete a transfer in part, the rest is done here; a short read is
+ * the end of the file and a short write a full device.
+ */
+static ssize_t hashlib_aio_wait(struct hashlib_aio *a, unsigned int i)
+{
+    struct hashlib_aio_buf *b;
+    ssize_t ret;
+    int err;
+
+    b = &a->buf[i];
+
+    if (a->ring.fd == -1) {
+        pthread_mutex_lock(&a->lock);
+
+        while (b->pending)
+            pthread_cond_wait(&a->cond, &a->lock);
+
+        pthread_mutex_unlock(&a->lock);
+
+        return b->result;
+    }
+
+    if ((err = hashlib_uring_wait(a, i)))
+        return err;
+
+    /* O_DIRECT reads end short only at the end of the file */
+    if (b->result <= 0 || (size_t) b->result == b->iov.iov_len
+        || (a->direct && b->result % HASHLIB_AIO_ALIGN))
+        return b->result;
+
+    ret = hashlib_aio_pio(a, (char *) b->iov.iov_base + b->result,
+                          b->iov.iov_len - b->result, b->offset + b->result);
+
+    if (ret < 0)
+        return ret;
+
+    b->result += ret;
+
+    if (a->writing && (size_t) b->result < b->iov.iov_len)
+        return -ENOSPC;
+
+    return b->result;
+}
+
+static void hashlib_aio_free(struct hashlib_aio *a)
+{
+    if (a->ring.fd != -1) {
+        hashlib_uring_exit(&a->ring);
+    } else {
+        pthread_mutex_lock(&a->lock);
+        a->stop = 1;
+        pthread_cond_broadcast(&a->cond);
+        pthread_mutex_unlock(&a->lock);
+
+        pthread_join(a->thread, NULL);
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->cond);
+    }
+
+    free(a->buf[0].iov.iov_base);
+    free(a->buf[1].iov.iov_base);
+    free(a);
+}
+
+/* opens filename for writing or reading, returns 0 or -errno */
+static int hashlib_aio_open(struct hashlib_aio **ap, const char *filename,
+                            int writing, int flags)
+{
+    struct hashlib_aio *a;
+    int oflags;
+    int ret;
+    int i;
+
+    *ap = NULL;
+
+    a = calloc(1, sizeof(*a));
+
+    if (!a)
+        return -ENOMEM;
+
+    a->writing = writing;
+    a->ring.fd = -1;
+
+    for (i = 0; i < 2; i++) {
+        if ((ret = posix_memalign(&a->buf[i].iov.iov_base, HASHLIB_AIO_ALIGN,
+                                  HASHLIB_AIO_BUFFER))) {
+            free(a->buf[0].iov.iov_base);
+            free(a);
+
+            return -ret;
+        }
+    }
+
+    oflags = writing ? O_WRONLY | O_TRUNC | O_CREAT : O_RDONLY;
+    a->fd  = -1;
+
+    /* file systems like tmpfs refuse O_DIRECT, the page cache is used then */
+    if (flags & HASHLIB_AIO_DIRECT) {
+        a->fd     = open(filename, oflags | O_DIRECT, 0644);
+        a->direct = a->fd != -1;
+    }
+
+    if (a->fd == -1 && (a->fd = open(filename, oflags, 0644)) == -1) {
+        ret = -errno;
+
+        free(a->buf[0].iov.iov_base);
+        free(a->buf[1].iov.iov_base);
+        free(a);
+
+        return ret;
+    }
+
+    if ((flags & HASHLIB_AIO_THREAD) || hashlib_uring_init(&a->ring)) {
+        a->ring.fd = -1;
+
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_cond_init(&a->cond, NULL);
+
+        if ((ret = pthread_create(&a->thread, NULL, hashlib_aio_thread, a))) {
+            pthread_mutex_destroy(&a->lock);
+            pthread_cond_destroy(&a->cond);
+            close(a->fd);
+
+            free(a->buf[0].iov.iov_base);
+            free(a->buf[1].iov.iov_base);
+            free(a);
+
+            return -ret;
+        }
+    }
+
+    *ap = a;
+
+    return 0;
+}
+
+/* hands the full current buffer over and continues in the other one */
+static int hashlib_aio_switch(struct hashlib_aio *a, size_t len)
+{
+    ssize_t ret;
+    int err;
+
+    if ((err = hashlib_aio_submit(a, a->cur, a->offset, len)))
+        return err;
+
+    a->offset += len;
+    a->cur    ^= 1;
+    a->pos     = 0;
+
+    if (!hashlib_aio_pending(a, a->cur))
+        return 0;
+
+    ret = hashlib_aio_wait(a, a->cur);
+
+    return ret < 0 ? ret : 0;
+}
+
+static HASHLIB_FCT_WRITE(hashlib_aio_write, ctx, data, bytes)
+{
+    struct hashlib_aio *a;
+    size_t n;
+
+    a = ctx;
+
+    while (!a->error && bytes) {
+        n = HASHLIB_AIO_BUFFER - a->pos;
+        n = n < bytes ? n : bytes;
+
+        memcpy((char *) a->buf[a->cur].iov.iov_base + a->pos, data, n);
+
+        a->pos += n;
+        data    = (const char *) data + n;
+        bytes  -= n;
+
+        if (a->pos == HASHLIB_AIO_BUFFER)
+            a->error = hashlib_aio_switch(a, HASHLIB_AIO_BUFFER);
+    }
+
+    return a->error;
+}
+
+static HASHLIB_FCT_READ(hashlib_aio_read, ctx, buf, bytes)
+{
+    struct hashlib_aio *a;
+    struct hashlib_aio_buf *b;
+    ssize_t ret;
+    size_t done, n;
+
+    a = ctx;
+
+    for (done = 0; done < bytes; done += n) {
+        b = &a->buf[a->cur];
+
+        if (!a->ready) {
+            ret = hashlib_aio_wait(a, a->cur);
+
+            if (ret < 0)
+                return ret;
+
+            a->pos   = 0;
+            a->ready = 1;
+        }
+
+        n = b->result - a->pos;
+        n = n < bytes - done ? n : bytes - done;
+
+        memcpy((char *) buf + done, (char *) b->iov.iov_base + a->pos, n);
+        a->pos += n;
+
+        if (a->pos < (size_t) b->result)
+            continue;
+
+        if ((size_t) b->result < HASHLIB_AIO_BUFFER)
+            return done + n;
+
+        /* refill the buffer while the other one is read */
+        ret = hashlib_aio_submit(a, a->cur, a->offset, HASHLIB_AIO_BUFFER);
+
+        if (ret)
+            return ret;
+
+        a->offset += HASHLIB_AIO_BUFFER;
+        a->cur    ^= 1;
+        a->ready   = 0;
+    }
+
+    return done;
+}
+
+/* waits for all transfers and closes a; returns the first error */
+static int hashlib_aio_close(struct hashlib_aio *a, int flush)
+{
+    ssize_t got;
+    size_t len;
+    off_t end;
+    int ret;
+    int i;
+
+    ret = a->writing ? a->error : 0;
+    end = a->offset + a->pos;
+
+    /* O_DIRECT writes whole blocks, the file is cut to its length below */
+    if (!ret && flush && a->pos) {
+        len = a->pos;
+
+        if (a->direct) {
+            len = (len + HASHLIB_AIO_ALIGN - 1) & ~(HASHLIB_AIO_ALIGN - 1);
+            memset((char *) a->buf[a->cur].iov.iov_base + a->pos, 0,
+                   len - a->pos);
+        }
+
+        ret = hashlib_aio_submit(a, a->cur, a->offset, len);
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (hashlib_aio_pending(a, i)) {
+            got = hashlib_aio_wait(a, i);
+
+            if (!ret && a->writing && got < 0)
+                ret = got;
+        }
+    }
+
+    if (!ret && flush && a->direct && ftruncate(a->fd, end) == -1)
+        ret = -errno;
+
+    if (close(a->fd) == -1 && !ret && a->writing)
+        ret = -errno;
+
+    hashlib_aio_free(a);
+
+    return ret;
+}
+
+/*
+ * hashlib_try_store, with the table walked while the previous part of the
+ * file is written; returns 0 or -errno, filename is removed on failure
+ */
+extern int hashlib_store_async(struct hashlib_hash *hash, const char *filename,
+                               int flags)
+{
+    struct hashlib_stream out;
+    struct hashlib_aio *a;
+    int ret;
+    int closed;
+
+    assert(hash);
+    assert(filename);
+
+    ret = hashlib_aio_open(&a, filename, 1, flags);
+
+    if (ret)
+        return ret;
+
+    out.ctx   = a;
+    out.write = hashlib_aio_write;
+    out.read  = NULL;
+
+    ret    = hashlib_store_to(hash, &out);
+    closed = hashlib_aio_close(a, !ret);
+    ret    = ret ? ret : closed;
+
+    if (ret)
+        unlink(filename);
+
+    return ret;
+}
+
+/*
+ * hashlib_try_retrieve, with the file read ahead while records are put
+ * into the table; returns 0 or -errno as hashlib_try_retrieve
+ */
+extern int hashlib_retrieve_async(struct hashlib_hash **hashp,
+                                  const char *filename,
+                                  HASHLIB_FP_UNPACK(unpack),
+                                  HASHLIB_FP_FREE(ff), int flags)
+{
+    struct hashlib_stream in;
+    struct hashlib_aio *a;
+    int ret;
+
+    assert(hashp);
+    assert(filename);
+
+    *hashp = NULL;
+
+    ret = hashlib_aio_open(&a, filename, 0, flags);
+
+    if (ret)
+        return ret;
+
+    in.ctx   = a;
+    in.write = NULL;
+    in.read  = hashlib_aio_read;
+
+    /* the first two buffers are read right away */
+    ret = hashlib_aio_submit(a, 0, 0, HASHLIB_AIO_BUFFER);
+
+    if (!ret)
+        ret = hashlib_aio_submit(a, 1, HASHLIB_AIO_BUFFER, HASHLIB_AIO_BUFFER);
+
+    a->offset = 2 * HASHLIB_AIO_BUFFER;
+
+    if (!ret)
+        ret = hashlib_retrieve_from(hashp, &in, unpack, ff);
+
+    hashlib_aio_close(a, 0);
+
+    return ret;
+}
@@ -0,0 +1,212 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Bloom filters in front of the lookups of tables.  A block of the split
+ * block filter is 32 bytes and aligned to them, so a lookup of a missing
+ * key usually ends after one cache line instead of touching the slot and
+ * the bucket.  Removed keys cannot be taken out of a Bloom filter; the
+ * filter of a table is built again when too many of its keys were
+ * removed, and with twice the capacity when it holds too many keys.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* bits of a block */
+#define HASHLIB_FILTER_BLOCK_BITS (HASHLIB_FILTER_WORDS * 32)
+
+/* smallest capacity of the filter of a table */
+#define HASHLIB_FILTER_MIN_KEYS 1024
+
+/* more bits per key do not lower the false positive rate noticeably */
+#define HASHLIB_FILTER_MAX_BITS 64
+
+/* returns NULL with errno set on failure */
+extern struct hashlib_filter *hashlib_filter_new(size_t capacity,
+                                                 unsigned int bits_per_key,
+                                                 int flags, int node)
+{
+    struct hashlib_filter *f;
+
+    f = calloc(1, sizeof(*f));
+
+    if (!f)
+        return NULL;
+
+    f->capacity     = capacity;
+    f->bits_per_key = bits_per_key;
+    f->blocks       = capacity * bits_per_key / HASHLIB_FILTER_BLOCK_BITS + 1;
+    f->block        = hashlib_mem_alloc(f->blocks * sizeof(*(f->block)), flags,
+                                        node, &f->mapped);
+
+    if (!f->block) {
+        free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+extern struct hashlib_filter *hashlib_filter_copy(struct hashlib_filter *f,
+                                                  int flags, int node)
+{
+    struct hashlib_filter *copy;
+
+    copy = hashlib_filter_new(f->capacity, f->bits_per_key, flags, node);
+
+    if (!copy)
+        return NULL;
+
+    memcpy(copy->block, f->block, f->blocks * sizeof(*(f->block)));
+    copy->stale = f->stale;
+
+    return copy;
+}
+
+extern void hashlib_filter_delete(struct hashlib_filter *f)
+{
+    hashlib_mem_free(f->block, f->mapped);
+    free(f);
+}
+
+extern size_t hashlib_filter_bytes(struct hashlib_filter *f)
+{
+    return sizeof(*f) + f->blocks * sizeof(*(f->block));
+}
+
+/* replaces the filter of hash by one for capacity keys, holding the keys of
+ * hash; returns 0 or -ENOMEM */
+static int hashlib_filter_rebuild(struct hashlib_hash *hash, size_t capacity,
+                                  unsigned int bits_per_key)
+{
+    struct hashlib_filter *f;
+    struct hashlib_bucket *b;
+    size_t i;
+    unsigned int j;
+
+    f = hashlib_filter_new(capacity, bits_per_key, hash->alloc_flags,
+                           hash->alloc_node);
+
+    if (!f)
+        return -ENOMEM;
+
+    for (i = 0; i < hash->tblsize; i++) {
+        b = hash->tbl[i];
+
+        for (j = 0; b && j < b->count; j++)
+            hashlib_filter_add(f, hashlib_filter_hash(b->entry[j]->hash));
+    }
+
+    if (hash->filter)
+        hashlib_filter_delete(hash->filter);
+
+    hash->filter = f;
+
+    return 0;
+}
+
+/* e was added to hash */
+extern void hashlib_filter_put(struct hashlib_hash *hash,
+                               struct hashlib_entry *e)
+{
+    struct hashlib_filter *f;
+
+    f = hash->filter;
+
+    hashlib_filter_add(f, hashlib_filter_hash(e->hash));
+
+    if (hash->count <= f->capacity)
+        return;
+
+    /* without memory the filter stays correct, only less selective; the
+     * next attempt is made at twice the capacity */
+    if (hashlib_filter_rebuild(hash, 2 * f->capacity, f->bits_per_key))
+        f->capacity *= 2;
+}
+
+/* a key was removed from hash */
+extern void hashlib_filter_remove(struct hashlib_hash *hash)
+{
+    struct hashlib_filter *f;
+
+    f = hash->filter;
+
+    if (++f->stale <= f->capacity / 2)
+        return;
+
+    if (hashlib_filter_rebuild(hash, f->capacity, f->bits_per_key))
+        f->stale = 0;
+}
+
+extern void hashlib_set_filter(struct hashlib_hash *hash,
+                               unsigned int bits_per_key)
+{
+    int ret;
+
+    ret = hashlib_try_set_filter(hash, bits_per_key);
+
+    if (ret == -EINVAL)
+        diefx("too many bits per key");
+
+    if (ret) {
+        errno = -ret;
+        dief("hashlib_set_filter");
+    }
+}
+
+/*
+ * puts a Bloom filter with bits_per_key bits per key in front of the
+ * lookups of hash, 0 drops the filter.  With 10 bits per key, about one
+ * miss in a hundred gets past the filter; every hit checks it in vain.
+ * The filter is not part of the file of hashlib_store, a retrieved table
+ * has none until it is set again.  Clones and frozen tables keep it, the
+ * file of hashlib_frozen_store too.  Returns 0, -EINVAL or -ENOMEM.
+ */
+extern int hashlib_try_set_filter(struct hashlib_hash *hash,
+                                  unsigned int bits_per_key)
+{
+    size_t capacity;
+
+    assert(hash);
+
+    if (bits_per_key > HASHLIB_FILTER_MAX_BITS)
+        return -EINVAL;
+
+    if (!bits_per_key) {
+        if (hash->filter)
+            hashlib_filter_delete(hash->filter);
+
+        hash->filter = NULL;
+
+        return 0;
+    }
+
+    for (capacity = HASHLIB_FILTER_MIN_KEYS; capacity < hash->count;
+         capacity *= 2)
+        ;
+
+    return hashlib_filter_rebuild(hash, capacity, bits_per_key);
+}
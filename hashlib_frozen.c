@@ -0,0 +1,574 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Frozen tables are built once from a hashlib_hash and are read-only
+ * afterwards.  They use a minimal perfect hash function in the style of
+ * PTHash: the keys are distributed over buckets, and for every bucket a
+ * pilot value is searched that maps all of its keys to free slots.  A
+ * lookup is a single probe into the slot array followed by one key
+ * compare, and there are no empty slots.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* number of seeds tried before giving up */
+#define HASHLIB_FROZEN_ATTEMPTS 64
+
+/* temporary state of hashlib_freeze */
+struct hashlib_frozen_build {
+    struct hashlib_entry **entry;
+    unsigned char *shared;
+    uint64_t *hash;
+    size_t *order;
+    size_t *start;
+    size_t *by_size;
+    uint64_t *taken;
+    size_t *pos;
+};
+
+static inline uint64_t hashlib_frozen_pilot_hash(unsigned int pilot)
+{
+    return hashlib_mix64(pilot + 0x9E3779B97F4A7C15ULL);
+}
+
+static inline size_t hashlib_frozen_bucket(struct hashlib_frozen *frozen,
+                                           uint64_t h)
+{
+    return hashlib_fastrange64(h, frozen->buckets);
+}
+
+/* the key hash is mixed again, keys of one bucket share their high bits */
+static inline size_t hashlib_frozen_pos(struct hashlib_frozen *frozen,
+                                        uint64_t h, uint64_t pilot_hash)
+{
+    return hashlib_fastrange64(hashlib_mix64(h ^ pilot_hash), frozen->count);
+}
+
+static inline int hashlib_frozen_taken(uint64_t *taken, size_t pos)
+{
+    return (taken[pos / 64] >> (pos % 64)) & 1;
+}
+
+/* searches a pilot for every bucket with the current seed, the slots get
+ * the index of their entry as key, returns 0 if the seed does not work */
+static int hashlib_frozen_place(struct hashlib_frozen *frozen,
+                                struct hashlib_frozen_build *b)
+{
+    size_t n, i, j, k, l, bucket, max, size;
+    uint64_t ph;
+    unsigned int pilot;
+    int ok;
+
+    n = frozen->count;
+
+    for (i = 0; i < n; i++)
+        b->hash[i] = hashlib_hash64(b->entry[i]->key, b->entry[i]->keylen,
+                                    frozen->seed);
+
+    /* counting sort of the keys by bucket */
+    memset(b->start, 0, (frozen->buckets + 1) * sizeof(*(b->start)));
+
+    for (i = 0; i < n; i++)
+        b->start[hashlib_frozen_bucket(frozen, b->hash[i]) + 1]++;
+
+    max = 0;
+
+    for (i = 1; i <= frozen->buckets; i++) {
+        if (b->start[i] > max)
+            max = b->start[i];
+
+        b->start[i] += b->start[i - 1];
+    }
+
+    for (i = 0; i < n; i++)
+        b->order[b->start[hashlib_frozen_bucket(frozen, b->hash[i])]++] = i;
+
+    for (i = frozen->buckets; i > 0; i--)
+        b->start[i] = b->start[i - 1];
+
+    b->start[0] = 0;
+
+    /* counting sort of the buckets by descending size, large buckets are
+     * placed first, b->pos is used for the counters */
+    memset(b->pos, 0, (max + 2) * sizeof(*(b->pos)));
+
+    for (i = 0; i < frozen->buckets; i++)
+        b->pos[max - (b->start[i + 1] - b->start[i]) + 1]++;
+
+    for (size = 1; size <= max + 1; size++)
+        b->pos[size] += b->pos[size - 1];
+
+    for (i = 0; i < frozen->buckets; i++)
+        b->by_size[b->pos[max - (b->start[i + 1] - b->start[i])]++] = i;
+
+    /* the empty buckets are at the end */
+    k = max ? b->pos[max - 1] : 0;
+
+    memset(b->taken, 0, (n + 63) / 64 * sizeof(*(b->taken)));
+    memset(frozen->pilot, 0, frozen->buckets * sizeof(*(frozen->pilot)));
+
+    for (i = 0; i < k; i++) {
+        bucket = b->by_size[i];
+        size   = b->start[bucket + 1] - b->start[bucket];
+
+        /* keys with equal hashes can never be separated */
+        for (j = 1; j < size; j++)
+            for (l = 0; l < j; l++)
+                if (b->hash[b->order[b->start[bucket] + j]]
+                    == b->hash[b->order[b->start[bucket] + l]])
+                    return 0;
+
+        for (pilot = 0; ; pilot++) {
+            ph = hashlib_frozen_pilot_hash(pilot);
+            ok = 1;
+
+            for (j = 0; ok && j < size; j++) {
+                b->pos[j] = hashlib_frozen_pos(frozen,
+                                b->hash[b->order[b->start[bucket] + j]], ph);
+
+                if (hashlib_frozen_taken(b->taken, b->pos[j]))
+                    ok = 0;
+
+                for (l = 0; ok && l < j; l++)
+                    if (b->pos[l] == b->pos[j])
+                        ok = 0;
+            }
+
+            if (ok)
+                break;
+
+            if (pilot == UINT32_MAX)
+                return 0;
+        }
+
+        frozen->pilot[bucket] = pilot;
+
+        for (j = 0; j < size; j++) {
+            b->taken[b->pos[j] / 64] |= (uint64_t) 1 << (b->pos[j] % 64);
+            frozen->slot[b->pos[j]].key = b->order[b->start[bucket] + j];
+        }
+    }
+
+    return 1;
+}
+
+static struct hashlib_frozen *hashlib_frozen_new(size_t count)
+{
+    struct hashlib_frozen *frozen;
+
+    frozen = hashlib_calloc(1, sizeof(*frozen));
+
+    frozen->count   = count;
+    frozen->buckets = count / HASHLIB_FROZEN_BUCKET_SIZE + 1;
+    frozen->slot    = hashlib_calloc(count + 1, sizeof(*(frozen->slot)));
+    frozen->pilot   = hashlib_calloc(frozen->buckets,
+                                     sizeof(*(frozen->pilot)));
+
+    return frozen;
+}
+
+/* the frozen table gets a filter if hash has one */
+extern struct hashlib_frozen *hashlib_freeze(struct hashlib_hash *hash)
+{
+    struct hashlib_frozen *frozen;
+    struct hashlib_frozen_build b;
+    struct hashlib_bucket *bucket;
+    struct hashlib_entry *e;
+    size_t i, j, n, len, offset;
+    unsigned int attempt, bits_per_key;
+
+    assert(hash);
+
+    n      = hashlib_count(hash);
+    frozen = hashlib_frozen_new(n);
+
+    frozen->free_function = hash->free_function;
+    frozen->size_function = hash->size_function;
+    frozen->pack_function = hash->pack_function;
+
+    b.entry   = hashlib_calloc(n + 1, sizeof(*(b.entry)));
+    b.shared  = hashlib_calloc(n + 1, sizeof(*(b.shared)));
+    b.hash    = hashlib_calloc(n + 1, sizeof(*(b.hash)));
+    b.order   = hashlib_calloc(n + 1, sizeof(*(b.order)));
+    b.start   = hashlib_calloc(frozen->buckets + 1, sizeof(*(b.start)));
+    b.by_size = hashlib_calloc(frozen->buckets, sizeof(*(b.by_size)));
+    b.taken   = hashlib_calloc(n / 64 + 1, sizeof(*(b.taken)));
+    b.pos     = hashlib_calloc(n + 2, sizeof(*(b.pos)));
+
+    for (i = 0, n = 0; i < hash->tblsize; i++) {
+        bucket = hash->tbl[i];
+
+        for (j = 0; bucket && j < bucket->count; j++) {
+            e = bucket->entry[j];
+
+            b.shared[n]  = __atomic_load_n(&bucket->refs, __ATOMIC_ACQUIRE) > 1
+                           || __atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) > 1;
+            b.entry[n++] = e;
+        }
+    }
+
+    for (attempt = 0; attempt < HASHLIB_FROZEN_ATTEMPTS; attempt++) {
+        frozen->seed = hashlib_mix64(HASHLIB_FILE_HEADER + attempt);
+
+        if (hashlib_frozen_place(frozen, &b))
+            break;
+    }
+
+    if (attempt == HASHLIB_FROZEN_ATTEMPTS)
+        diefx("unable to find a perfect hash function");
+
+    /* the keys are stored in slot order, the entries are not needed
+     * anymore, their values now belong to the frozen table.  An entry
+     * shared with a clone keeps its value, the frozen table holds a
+     * reference to it instead */
+    /* interned keys are not counted in hash->key_bytes */
+    for (i = 0, frozen->keys_size = 0; i < n; i++)
+        frozen->keys_size += b.entry[i]->keylen + 1;
+
+    frozen->keys = hashlib_calloc(frozen->keys_size + 1, 1);
+
+    for (i = 0, offset = 0; i < n; i++) {
+        j   = frozen->slot[i].key;
+        e   = b.entry[j];
+        len = e->keylen + 1;
+
+        memcpy(frozen->keys + offset, e->key, len);
+
+        frozen->slot[i].key   = offset;
+        frozen->slot[i].value = e->value;
+
+        offset += len;
+
+        if (b.shared[j]) {
+            if (!frozen->shared)
+                frozen->shared = hashlib_calloc(n, sizeof(*(frozen->shared)));
+
+            __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+            frozen->shared[i] = e;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        if (!b.shared[i])
+            b.entry[i]->free_function = NULL;
+
+    bits_per_key = hash->filter ? hash->filter->bits_per_key : 0;
+
+    hashlib_hash_delete(hash);
+
+    if (bits_per_key)
+        hashlib_frozen_set_filter(frozen, bits_per_key);
+
+    free(b.entry);
+    free(b.shared);
+    free(b.hash);
+    free(b.order);
+    free(b.start);
+    free(b.by_size);
+    free(b.taken);
+    free(b.pos);
+
+    return frozen;
+}
+
+extern void *hashlib_frozen_get(struct hashlib_frozen *frozen, char *key)
+{
+    struct hashlib_frozen_slot *s;
+    uint64_t h;
+    size_t pos;
+
+    assert(frozen);
+    assert(key);
+
+    if (!frozen->count)
+        return NULL;
+
+    h = hashlib_hash64(key, strlen(key), frozen->seed);
+
+    if (frozen->filter && !hashlib_filter_test(frozen->filter, h))
+        return NULL;
+
+    pos = hashlib_frozen_pos(frozen, h,
+              hashlib_frozen_pilot_hash(
+                  frozen->pilot[hashlib_frozen_bucket(frozen, h)]));
+    s   = &(frozen->slot[pos]);
+
+    if (strcmp(frozen->keys + s->key, key))
+        return NULL;
+
+    return s->value;
+}
+
+extern void hashlib_frozen_delete(struct hashlib_frozen *frozen)
+{
+    size_t i;
+
+    assert(frozen);
+
+    for (i = 0; i < frozen->count; i++) {
+        if (frozen->shared && frozen->shared[i])
+            hashlib_entry_unref(frozen->shared[i]);
+        else if (frozen->free_function)
+            frozen->free_function(frozen->slot[i].value);
+    }
+
+    free(frozen->shared);
+
+    if (frozen->filter)
+        hashlib_filter_delete(frozen->filter);
+
+    free(frozen->slot);
+    free(frozen->pilot);
+    free(frozen->keys);
+    free(frozen);
+}
+
+/*
+ * puts a Bloom filter with bits_per_key bits per key in front of the
+ * lookups of frozen, 0 drops the filter.  The filter is stored with the
+ * table.  A miss then usually costs one cache line instead of three.
+ */
+extern void hashlib_frozen_set_filter(struct hashlib_frozen *frozen,
+                                      unsigned int bits_per_key)
+{
+    const char *key;
+    size_t i;
+
+    assert(frozen);
+    assert(bits_per_key <= 64);
+
+    if (frozen->filter)
+        hashlib_filter_delete(frozen->filter);
+
+    frozen->filter = NULL;
+
+    if (!bits_per_key)
+        return;
+
+    frozen->filter = hashlib_filter_new(frozen->count, bits_per_key, 0, 0);
+
+    if (!frozen->filter)
+        dief("hashlib_filter_new");
+
+    for (i = 0; i < frozen->count; i++) {
+        key = frozen->keys + frozen->slot[i].key;
+        hashlib_filter_add(frozen->filter,
+                           hashlib_hash64(key, strlen(key), frozen->seed));
+    }
+}
+
+/*
+ * file format, all numbers are of type size_t:
+ * header, count, buckets, seed, size of keys, pilots (unsigned int),
+ * keys in slot order, then size and data of every value in slot order.
+ * With a filter, the header differs and the bits per key, the number of
+ * blocks and the blocks follow the pilots.
+ */
+extern void hashlib_frozen_store(struct hashlib_frozen *frozen,
+                                 const char *filename)
+{
+    struct hashlib_frozen_slot *s;
+    struct hashlib_filter *f;
+    size_t h;
+    size_t i;
+    size_t bytes;
+    int fd;
+
+    assert(frozen);
+    assert(filename);
+
+    fd = hashlib_open(filename, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+
+    f = frozen->filter;
+    h = f ? HASHLIB_FROZEN_FILTER_FILE_HEADER : HASHLIB_FROZEN_FILE_HEADER;
+
+    hashlib_write(fd, &h, sizeof(h));
+    hashlib_write(fd, &(frozen->count), sizeof(frozen->count));
+    hashlib_write(fd, &(frozen->buckets), sizeof(frozen->buckets));
+    hashlib_write(fd, &(frozen->seed), sizeof(frozen->seed));
+    hashlib_write(fd, &(frozen->keys_size), sizeof(frozen->keys_size));
+    hashlib_write(fd, frozen->pilot, frozen->buckets * sizeof(*(frozen->pilot)));
+
+    if (f) {
+        bytes = f->bits_per_key;
+
+        hashlib_write(fd, &bytes, sizeof(bytes));
+        hashlib_write(fd, &(f->blocks), sizeof(f->blocks));
+        hashlib_write(fd, f->block, f->blocks * sizeof(*(f->block)));
+    }
+
+    hashlib_write(fd, frozen->keys, frozen->keys_size);
+
+    for (i = 0; i < frozen->count; i++) {
+        s     = &(frozen->slot[i]);
+        bytes = frozen->size_function(s->value);
+
+        hashlib_write(fd, &bytes, sizeof(bytes));
+        frozen->pack_function(s->value, bytes, fd);
+    }
+
+    hashlib_close(fd);
+}
+
+/* reads the filter stored behind the pilots */
+static void hashlib_frozen_read_filter(struct hashlib_frozen *frozen, int fd,
+                                       const char *filename)
+{
+    struct hashlib_filter *f;
+    size_t bits_per_key, blocks, size, ret;
+
+    size = sizeof(size_t);
+    ret  = hashlib_read(fd, &bits_per_key, size);
+    ret += hashlib_read(fd, &blocks, size);
+
+    if (ret != 2 * size)
+        diefx("%s: unable to read filter", filename);
+
+    if (!bits_per_key || bits_per_key > 64)
+        diefx("%s: invalid filter", filename);
+
+    f = hashlib_filter_new(frozen->count, bits_per_key, 0, 0);
+
+    if (!f)
+        dief("hashlib_filter_new");
+
+    if (f->blocks != blocks)
+        diefx("%s: invalid number of filter blocks", filename);
+
+    size = blocks * sizeof(*(f->block));
+
+    if (hashlib_read(fd, f->block, size) != size)
+        diefx("%s: unable to read filter", filename);
+
+    frozen->filter = f;
+}
+
+extern struct hashlib_frozen *hashlib_frozen_retrieve(const char *filename,
+                                                      HASHLIB_FP_UNPACK(unpack),
+                                                      HASHLIB_FP_FREE(ff))
+{
+    struct hashlib_frozen *frozen;
+    size_t count;
+    size_t buckets;
+    size_t h;
+    size_t size;
+    size_t data_len;
+    size_t ret;
+    size_t i, offset;
+    int fd;
+    void *data;
+
+    size = sizeof(size_t);
+
+    if (!unpack)
+        unpack = hashlib_default_unpack_function;
+
+    fd = hashlib_open(filename, O_RDONLY, 0);
+
+    ret = hashlib_read(fd, &h, size);
+
+    if (ret != size)
+        diefx("%s: unable to read filetype", filename);
+
+    if (h != HASHLIB_FROZEN_FILE_HEADER
+        && h != HASHLIB_FROZEN_FILTER_FILE_HEADER)
+        diefx("%s: not a frozen hashlib file", filename);
+
+    ret  = hashlib_read(fd, &count, size);
+    ret += hashlib_read(fd, &buckets, size);
+
+    if (ret != 2 * size)
+        diefx("%s: unable to read entry count", filename);
+
+    frozen = hashlib_frozen_new(count);
+
+    if (frozen->buckets != buckets)
+        diefx("%s: invalid number of buckets", filename);
+
+    frozen->free_function = ff;
+    frozen->size_function = hashlib_default_size_function;
+    frozen->pack_function = hashlib_default_pack_function;
+
+    ret  = hashlib_read(fd, &(frozen->seed), size);
+    ret += hashlib_read(fd, &(frozen->keys_size), size);
+
+    if (ret != 2 * size)
+        diefx("%s: unable to read seed", filename);
+
+    size = buckets * sizeof(*(frozen->pilot));
+    ret  = hashlib_read(fd, frozen->pilot, size);
+
+    if (ret != size)
+        diefx("%s: unable to read pilots", filename);
+
+    if (h == HASHLIB_FROZEN_FILTER_FILE_HEADER)
+        hashlib_frozen_read_filter(frozen, fd, filename);
+
+    frozen->keys = hashlib_calloc(frozen->keys_size + 1, 1);
+
+    ret = hashlib_read(fd, frozen->keys, frozen->keys_size);
+
+    if (ret != frozen->keys_size)
+        diefx("%s: unable to read keys", filename);
+
+    size = sizeof(size_t);
+
+    for (i = 0, offset = 0; i < count; i++) {
+        if (offset >= frozen->keys_size)
+            diefx("%s: invalid keys", filename);
+
+        frozen->slot[i].key = offset;
+        offset += strlen(frozen->keys + offset) + 1;
+
+        ret = hashlib_read(fd, &data_len, size);
+
+        if (ret != size)
+            diefx("%s: unable to read size of data", filename);
+
+        data = hashlib_calloc(1, data_len);
+
+        ret = hashlib_read(fd, data, data_len);
+
+        if (ret != data_len)
+            diefx("%s: unable to read data", filename);
+
+        frozen->slot[i].value = unpack(data, data_len);
+
+        if (!frozen->slot[i].value)
+            diefx("%s: unable to unpack data", filename);
+
+        free(data);
+    }
+
+    hashlib_close(fd);
+
+    return frozen;
+}
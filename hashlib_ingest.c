@@ -0,0 +1,514 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Pipelined bulk insert into a table from many batches.  Submitted keys
+ * are cut into jobs of HASHLIB_INGEST_BATCH keys.  Any worker takes a job,
+ * hashes its keys, creates the entries and radix partitions them by slot
+ * range, the high bits of the slot index.  Every worker owns one range of
+ * slots and is the only one writing to it, so the entries are inserted
+ * without locks; the only lock protects the queues and is taken once per
+ * batch.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* keys of a job */
+#define HASHLIB_INGEST_BATCH 4096
+
+/* jobs of submitted keys per worker before hashlib_ingest_submit waits */
+#define HASHLIB_INGEST_QUEUE 2
+
+/* keys to be hashed, or the entries of the slot range of one worker */
+struct hashlib_ingest_job {
+    struct hashlib_ingest_job *next;
+    size_t seq;                 /* submission order of keys to be hashed */
+    size_t n;
+    char **keys;
+    void **values;
+    struct hashlib_entry *entry[];
+};
+
+struct hashlib_ingest_worker {
+    struct hashlib_ingest *ingest;
+    struct hashlib_ingest_job *head;    /* entries of the slots of the */
+    struct hashlib_ingest_job *tail;    /* worker, in submission order */
+    struct hashlib_entry **entry;       /* of the job being hashed */
+    unsigned int *owner;                /* worker of each entry */
+    size_t *count;                      /* entries per worker */
+    struct hashlib_ingest_job **part;   /* jobs per worker */
+    size_t inserted;
+    size_t key_bytes;
+    size_t value_bytes;
+    size_t bucket_bytes;                /* modulo arithmetic */
+};
+
+struct hashlib_ingest {
+    struct hashlib_hash *hash;
+    unsigned int workers;
+    struct hashlib_ingest_worker *worker;
+    pthread_t *tids;
+    pthread_mutex_t lock;
+    pthread_mutex_t pool_lock;          /* interning is not thread safe */
+    pthread_cond_t work;                /* a job was queued, or stop */
+    pthread_cond_t done;                /* a job was taken or finished */
+    struct hashlib_ingest_job *head;    /* keys to be hashed */
+    struct hashlib_ingest_job *tail;
+    size_t queued;                      /* jobs in head */
+    size_t pending;                     /* jobs not finished */
+    size_t submitted;                   /* jobs of keys to be hashed */
+    size_t partitioned;                 /* of them whose entries are queued */
+    int stop;
+};
+
+/* worker owning the slot of a key with hash h */
+static inline unsigned int hashlib_ingest_owner(struct hashlib_ingest *ing,
+                                                unsigned int h)
+{
+    return (uint64_t) hashlib_slot(h, ing->hash->tblsize) * ing->workers
+           / ing->hash->tblsize;
+}
+
+/* inserts the entries of job, w is the only writer of their slots */
+static void hashlib_ingest_insert(struct hashlib_ingest_worker *w,
+                                  struct hashlib_ingest_job *job)
+{
+    struct hashlib_hash *hash;
+    struct hashlib_entry *e, *found;
+    void **slot;
+    size_t i;
+
+    hash = w->ingest->hash;
+
+    for (i = 0; i < job->n; i++) {
+        e    = job->entry[i];
+        slot = &hash->tbl[hashlib_slot(e->hash, hash->tblsize)];
+
+        if (hashlib_entry_interned(e))
+            found = hashlib_bucket_find_interned(*slot, e->key, NULL);
+        else
+            found = hashlib_bucket_find(*slot, e->key, e->keylen, e->hash,
+                                        NULL);
+
+        /* already in hash, discarded like in hashlib_put */
+        if (found) {
+            hashlib_entry_unref(e);
+            continue;
+        }
+
+        if (hashlib_bucket_append(slot, e, &w->bucket_bytes)) {
+            errno = ENOMEM;
+            dief("hashlib_bucket_append");
+        }
+
+        w->inserted++;
+        w->key_bytes += hashlib_entry_key_bytes(e);
+
+        if (hash->account_values)
+            w->value_bytes += e->size_function(e->value);
+    }
+}
+
+/* hashes the keys of job and queues their entries at their workers; called
+ * and returns with the lock of ing held */
+static void hashlib_ingest_hash(struct hashlib_ingest_worker *w,
+                                struct hashlib_ingest_job *job)
+{
+    struct hashlib_ingest *ing;
+    struct hashlib_ingest_job *part;
+    struct hashlib_hash *hash;
+    struct hashlib_entry *e;
+    const char *handle;
+    unsigned int h, p;
+    size_t i, len;
+
+    ing  = w->ingest;
+    hash = ing->hash;
+
+    pthread_mutex_unlock(&ing->lock);
+
+    memset(w->count, 0, ing->workers * sizeof(*(w->count)));
+
+    for (i = 0; i < job->n; i++) {
+        if (hash->pool) {
+            pthread_mutex_lock(&ing->pool_lock);
+            handle = hashlib_intern(hash->pool, job->keys[i]);
+            pthread_mutex_unlock(&ing->pool_lock);
+
+            e = hashlib_entry_new_interned(handle, job->values[i],
+                                           hash->free_function,
+                                           hash->size_function,
+                                           hash->pack_function);
+        } else {
+            h = hashlib_index_len(job->keys[i], &len);
+            e = hashlib_entry_new(job->keys[i], len, h, job->values[i],
+                                  hash->free_function, hash->size_function,
+                                  hash->pack_function);
+        }
+
+        if (!e)
+            dief("hashlib_entry_new");
+
+        w->entry[i] = e;
+        w->owner[i] = hashlib_ingest_owner(ing, e->hash);
+        w->count[w->owner[i]]++;
+    }
+
+    /* one job per worker with entries, in the order of the keys */
+    for (p = 0; p < ing->workers; p++) {
+        w->part[p] = NULL;
+
+        if (!w->count[p])
+            continue;
+
+        w->part[p] = hashlib_calloc(1, sizeof(*part) + w->count[p]
+                                               * sizeof(*(part->entry)));
+    }
+
+    for (i = 0; i < job->n; i++) {
+        part = w->part[w->owner[i]];
+        part->entry[part->n++] = w->entry[i];
+    }
+
+    pthread_mutex_lock(&ing->lock);
+
+    /* the first of equal keys wins, so the entries of the jobs are queued
+     * in submission order */
+    while (ing->partitioned != job->seq)
+        pthread_cond_wait(&ing->done, &ing->lock);
+
+    for (p = 0; p < ing->workers; p++) {
+        if (!w->part[p])
+            continue;
+
+        if (ing->worker[p].tail)
+            ing->worker[p].tail->next = w->part[p];
+        else
+            ing->worker[p].head = w->part[p];
+
+        ing->worker[p].tail = w->part[p];
+        ing->pending++;
+    }
+
+    ing->partitioned++;
+
+    pthread_cond_broadcast(&ing->work);
+}
+
+static void *hashlib_ingest_thread(void *arg)
+{
+    struct hashlib_ingest_worker *w;
+    struct hashlib_ingest *ing;
+    struct hashlib_ingest_job *job;
+
+    w   = arg;
+    ing = w->ingest;
+
+    pthread_mutex_lock(&ing->lock);
+
+    for (;;) {
+        /* entries first, they hold the memory of the pipeline */
+        if (w->head) {
+            job     = w->head;
+            w->head = job->next;
+
+            if (!w->head)
+                w->tail = NULL;
+
+            pthread_mutex_unlock(&ing->lock);
+            hashlib_ingest_insert(w, job);
+            free(job);
+            pthread_mutex_lock(&ing->lock);
+        } else if (ing->head) {
+            job       = ing->head;
+            ing->head = job->next;
+
+            if (!ing->head)
+                ing->tail = NULL;
+
+            ing->queued--;
+            pthread_cond_broadcast(&ing->done);
+
+            hashlib_ingest_hash(w, job);
+            free(job);
+        } else if (ing->stop) {
+            break;
+        } else {
+            pthread_cond_wait(&ing->work, &ing->lock);
+            continue;
+        }
+
+        ing->pending--;
+        pthread_cond_broadcast(&ing->done);
+    }
+
+    pthread_mutex_unlock(&ing->lock);
+
+    return NULL;
+}
+
+/* frees ing after its workers are stopped */
+static void hashlib_ingest_free(struct hashlib_ingest *ing)
+{
+    unsigned int i;
+
+    pthread_mutex_destroy(&ing->lock);
+    pthread_mutex_destroy(&ing->pool_lock);
+    pthread_cond_destroy(&ing->work);
+    pthread_cond_destroy(&ing->done);
+
+    for (i = 0; ing->worker && i < ing->workers; i++) {
+        free(ing->worker[i].entry);
+        free(ing->worker[i].owner);
+        free(ing->worker[i].count);
+        free(ing->worker[i].part);
+    }
+
+    free(ing->worker);
+    free(ing->tids);
+    free(ing);
+}
+
+extern struct hashlib_ingest *hashlib_ingest_new(struct hashlib_hash *hash,
+                                                 unsigned int threads)
+{
+    struct hashlib_ingest *ing;
+    int ret;
+
+    ret = hashlib_try_ingest_new(&ing, hash, threads);
+
+    if (ret) {
+        errno = -ret;
+        dief("hashlib_ingest_new");
+    }
+
+    return ing;
+}
+
+/*
+ * starts threads workers inserting into hash, 0 means 1.  Until
+ * hashlib_ingest_flush returns, hash must not be used by anything else.
+ * The number of slots of hash is not changed, it should be sized for all
+ * keys.  Returns 0, -ENOMEM or -EAGAIN.
+ */
+extern int hashlib_try_ingest_new(struct hashlib_ingest **ingp,
+                                  struct hashlib_hash *hash,
+                                  unsigned int threads)
+{
+    struct hashlib_ingest_worker *w;
+    struct hashlib_ingest *ing;
+    unsigned int i;
+    int ret;
+
+    assert(ingp);
+    assert(hash);
+
+    *ingp = NULL;
+
+    if (!threads)
+        threads = 1;
+
+    if (threads > hash->tblsize)
+        threads = hash->tblsize;
+
+    ing = calloc(1, sizeof(*ing));
+
+    if (!ing)
+        return -ENOMEM;
+
+    ing->hash    = hash;
+    ing->workers = threads;
+    ing->worker  = calloc(threads, sizeof(*(ing->worker)));
+    ing->tids    = calloc(threads, sizeof(*(ing->tids)));
+
+    pthread_mutex_init(&ing->lock, NULL);
+    pthread_mutex_init(&ing->pool_lock, NULL);
+    pthread_cond_init(&ing->work, NULL);
+    pthread_cond_init(&ing->done, NULL);
+
+    for (i = 0; ing->worker && i < threads; i++) {
+        w = &ing->worker[i];
+
+        w->ingest = ing;
+        w->entry  = malloc(HASHLIB_INGEST_BATCH * sizeof(*(w->entry)));
+        w->owner  = malloc(HASHLIB_INGEST_BATCH * sizeof(*(w->owner)));
+        w->count  = malloc(threads * sizeof(*(w->count)));
+        w->part   = malloc(threads * sizeof(*(w->part)));
+
+        if (!w->entry || !w->owner || !w->count || !w->part)
+            break;
+    }
+
+    if (!ing->worker || !ing->tids || i < threads) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for (i = 0; i < threads; i++) {
+        ret = pthread_create(&ing->tids[i], NULL, hashlib_ingest_thread,
+                             &ing->worker[i]);
+
+        if (ret)
+            break;
+    }
+
+    if (i < threads) {
+        ret = -ret;
+
+        pthread_mutex_lock(&ing->lock);
+        ing->stop = 1;
+        pthread_cond_broadcast(&ing->work);
+        pthread_mutex_unlock(&ing->lock);
+
+        while (i--)
+            pthread_join(ing->tids[i], NULL);
+
+        goto fail;
+    }
+
+    *ingp = ing;
+
+    return 0;
+
+fail:
+    hashlib_ingest_free(ing);
+
+    return ret;
+}
+
+/*
+ * queues n keys with their values for insertion, it may be called by many
+ * threads at once.  The arrays and the keys must stay valid until the next
+ * hashlib_ingest_flush.  Waits while the workers are behind.
+ */
+extern void hashlib_ingest_submit(struct hashlib_ingest *ing, char **keys,
+                                  void **values, size_t n)
+{
+    struct hashlib_ingest_job *job;
+    size_t i;
+
+    assert(ing);
+    assert(keys || !n);
+    assert(values || !n);
+
+    for (i = 0; i < n; i += HASHLIB_INGEST_BATCH) {
+        job         = hashlib_calloc(1, sizeof(*job));
+        job->keys   = keys + i;
+        job->values = values + i;
+        job->n      = n - i < HASHLIB_INGEST_BATCH ? n - i
+                                                   : HASHLIB_INGEST_BATCH;
+
+        pthread_mutex_lock(&ing->lock);
+
+        while (ing->queued >= HASHLIB_INGEST_QUEUE * ing->workers)
+            pthread_cond_wait(&ing->done, &ing->lock);
+
+        job->seq = ing->submitted++;
+
+        if (ing->tail)
+            ing->tail->next = job;
+        else
+            ing->head = job;
+
+        ing->tail = job;
+        ing->queued++;
+        ing->pending++;
+
+        pthread_cond_signal(&ing->work);
+        pthread_mutex_unlock(&ing->lock);
+    }
+}
+
+/*
+ * waits until the submitted keys are in the table and brings its counts,
+ * ordered index and filter up to date; hash can be used until the next
+ * hashlib_ingest_submit.  Must not run at the same time as a submit.
+ * Returns the number of keys inserted since the last flush, keys already
+ * in hash are discarded like in hashlib_put.
+ */
+extern size_t hashlib_ingest_flush(struct hashlib_ingest *ing)
+{
+    struct hashlib_ingest_worker *w;
+    struct hashlib_hash *hash;
+    size_t inserted;
+    unsigned int i;
+
+    assert(ing);
+
+    hash = ing->hash;
+
+    pthread_mutex_lock(&ing->lock);
+
+    while (ing->pending)
+        pthread_cond_wait(&ing->done, &ing->lock);
+
+    pthread_mutex_unlock(&ing->lock);
+
+    inserted = 0;
+
+    for (i = 0; i < ing->workers; i++) {
+        w = &ing->worker[i];
+
+        inserted           += w->inserted;
+        hash->count        += w->inserted;
+        hash->key_bytes    += w->key_bytes;
+        hash->value_bytes  += w->value_bytes;
+        hash->bucket_bytes += w->bucket_bytes;
+
+        w->inserted     = 0;
+        w->key_bytes    = 0;
+        w->value_bytes  = 0;
+        w->bucket_bytes = 0;
+    }
+
+    if (inserted)
+        hashlib_rebuild_indexes(hash);
+
+    return inserted;
+}
+
+/* flushes the submitted keys and stops the workers */
+extern void hashlib_ingest_delete(struct hashlib_ingest *ing)
+{
+    unsigned int i;
+
+    if (!ing)
+        return;
+
+    hashlib_ingest_flush(ing);
+
+    pthread_mutex_lock(&ing->lock);
+    ing->stop = 1;
+    pthread_cond_broadcast(&ing->work);
+    pthread_mutex_unlock(&ing->lock);
+
+    for (i = 0; i < ing->workers; i++)
+        pthread_join(ing->tids[i], NULL);
+
+    hashlib_ingest_free(ing);
+}
@@ -0,0 +1,176 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Allocation of large arrays, lazily zeroed, with huge pages and NUMA
+ * placement.  Every option degrades gracefully: without huge pages or
+ * NUMA support the memory is simply mapped with the default page size
+ * and policy.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+#define HASHLIB_HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
+#define HASHLIB_CACHE_LINE 64
+
+/* larger arrays are mapped, the kernel then hands out zero pages on the
+ * first touch instead of calloc clearing them up front */
+#define HASHLIB_MMAP_THRESHOLD ((size_t) 1 << 20)
+
+/* from linux/mempolicy.h, libnuma is not required */
+#define HASHLIB_MPOL_BIND          2
+#define HASHLIB_MPOL_INTERLEAVE    3
+#define HASHLIB_MPOL_F_MEMS_ALLOWED (1 << 2)
+
+#define HASHLIB_MAX_NODES 1024
+
+#define HASHLIB_ALLOC_MMAP (HASHLIB_ALLOC_THP | HASHLIB_ALLOC_HUGETLB \
+                            | HASHLIB_ALLOC_INTERLEAVE | HASHLIB_ALLOC_BIND)
+
+static inline size_t hashlib_round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+/* applies the NUMA policy of flags to p, errors of the kernel are
+ * ignored; returns -EINVAL for a bad node */
+static int hashlib_mem_policy(void *p, size_t len, int flags, int node)
+{
+#ifdef SYS_mbind
+    unsigned long mask[HASHLIB_MAX_NODES / (8 * sizeof(unsigned long))];
+    int mode;
+
+    memset(mask, 0, sizeof(mask));
+
+    if (flags & HASHLIB_ALLOC_BIND) {
+        if (node < 0 || node >= HASHLIB_MAX_NODES)
+            return -EINVAL;
+
+        mask[node / (8 * sizeof(*mask))] |= 1UL << (node % (8 * sizeof(*mask)));
+        mode = HASHLIB_MPOL_BIND;
+    } else if (flags & HASHLIB_ALLOC_INTERLEAVE) {
+        /* interleave over all nodes this process may use */
+        if (syscall(SYS_get_mempolicy, NULL, mask, HASHLIB_MAX_NODES, NULL,
+                    HASHLIB_MPOL_F_MEMS_ALLOWED))
+            return 0;
+
+        mode = HASHLIB_MPOL_INTERLEAVE;
+    } else {
+        return 0;
+    }
+
+    /* the kernel ignores the last bit of maxnode */
+    syscall(SYS_mbind, p, len, mode, mask, HASHLIB_MAX_NODES + 1, 0);
+#else
+    (void) p;
+    (void) len;
+    (void) flags;
+    (void) node;
+#endif
+
+    return 0;
+}
+
+/*
+ * returns zeroed memory of at least bytes bytes; *mapped is the length of
+ * the mapping, or 0 if the memory came from the heap.  Returns NULL with
+ * errno set on failure.
+ */
+extern void *hashlib_mem_alloc(size_t bytes, int flags, int node,
+                               size_t *mapped)
+{
+    void *p;
+    size_t len;
+
+    assert(mapped);
+
+    *mapped = 0;
+
+    /* aligned to a cache line, like the blocks of hashlib_filter.c need */
+    if (!(flags & HASHLIB_ALLOC_MMAP) && bytes < HASHLIB_MMAP_THRESHOLD) {
+        if (posix_memalign(&p, HASHLIB_CACHE_LINE, bytes ? bytes : 1)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        return memset(p, 0, bytes);
+    }
+
+    p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (flags & HASHLIB_ALLOC_HUGETLB) {
+        len = hashlib_round_up(bytes, HASHLIB_HUGE_PAGE_SIZE);
+        p   = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+
+    /* no huge pages reserved, fall back to transparent huge pages */
+    if (p == MAP_FAILED) {
+        if (flags & (HASHLIB_ALLOC_THP | HASHLIB_ALLOC_HUGETLB))
+            len = hashlib_round_up(bytes, HASHLIB_HUGE_PAGE_SIZE);
+        else
+            len = hashlib_round_up(bytes, sysconf(_SC_PAGESIZE));
+
+        /* sparse tables never commit most of their pages */
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (p == MAP_FAILED)
+            return NULL;
+
+#ifdef MADV_HUGEPAGE
+        if (flags & (HASHLIB_ALLOC_THP | HASHLIB_ALLOC_HUGETLB))
+            madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    /* before the first touch, pages are placed when they are faulted in */
+    if (hashlib_mem_policy(p, len, flags, node)) {
+        munmap(p, len);
+        errno = EINVAL;
+
+        return NULL;
+    }
+
+    *mapped = len;
+
+    return p;
+}
+
+/* frees memory of hashlib_mem_alloc */
+extern void hashlib_mem_free(void *p, size_t mapped)
+{
+    if (!mapped)
+        free(p);
+    else if (munmap(p, mapped))
+        dief("munmap");
+}
@@ -0,0 +1,405 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Merge and diff of two tables.  Entries cache their hash, so they move
+ * between tables of any size without hashing the keys again.  The slot
+ * of a hash is monotonic in the table size, so a range of slots of one
+ * table maps onto a range of slots of the other; threads work on disjoint
+ * ranges.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* units claimed by a thread at a time */
+#define HASHLIB_MERGE_CHUNK (1 << 12)
+
+struct hashlib_merge_thread;
+
+struct hashlib_merge_state {
+    struct hashlib_hash *dst;   /* a of hashlib_diff */
+    struct hashlib_hash *src;   /* b of hashlib_diff */
+    HASHLIB_FP_CONFLICT(conflict);
+    HASHLIB_FP_EQUAL(equal);
+    HASHLIB_FP_DIFF(diff);
+    void *arg;
+    size_t units;               /* slots of the smaller table */
+    size_t next;                /* next unit to claim */
+    void (*unit)(struct hashlib_merge_thread *, size_t);
+};
+
+struct hashlib_merge_thread {
+    struct hashlib_merge_state *state;
+    size_t dropped;             /* entries of src not moved */
+    size_t dropped_key_bytes;
+    size_t value_delta;         /* modulo arithmetic */
+    size_t bucket_bytes;        /* modulo arithmetic */
+    size_t found;               /* differences */
+};
+
+/* moves the entries of b into dst, b was taken out of src */
+static void hashlib_merge_bucket(struct hashlib_merge_thread *t,
+                                 struct hashlib_bucket *b)
+{
+    struct hashlib_merge_state *s;
+    struct hashlib_hash *dst;
+    struct hashlib_entry *e, *old;
+    void **slot;
+    unsigned int i, pos;
+    int own, account;
+
+    s       = t->state;
+    dst     = s->dst;
+    account = dst->account_values && s->src->account_values;
+
+    /* the references of an unshared bucket move with its entries */
+    own = __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1;
+
+    for (i = 0; i < b->count; i++) {
+        e    = b->entry[i];
+        slot = &dst->tbl[hashlib_slot(e->hash, dst->tblsize)];
+        old  = hashlib_bucket_find(*slot, e->key, e->keylen, e->hash, &pos);
+
+        if (!old) {
+            if (!own)
+                __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+
+            if (hashlib_bucket_append(slot, e, &t->bucket_bytes)) {
+                errno = ENOMEM;
+                dief("hashlib_bucket_append");
+            }
+
+            continue;
+        }
+
+        t->dropped++;
+        t->dropped_key_bytes += hashlib_entry_key_bytes(e);
+
+        if (old != e && s->conflict && s->conflict(e->key, old->value,
+                                                   e->value)) {
+            /* the entry of src takes the place of the one of dst */
+            if (hashlib_bucket_own(slot)) {
+                errno = ENOMEM;
+                dief("hashlib_bucket_own");
+            }
+
+            if (!own)
+                __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+
+            if (account)
+                t->value_delta -= old->size_function(old->value);
+
+            ((struct hashlib_bucket *) *slot)->entry[pos] = e;
+            hashlib_entry_unref(old);
+        } else {
+            if (account)
+                t->value_delta -= e->size_function(e->value);
+
+            if (own)
+                hashlib_entry_unref(e);
+        }
+    }
+
+    if (own)
+        free(b);
+    else
+        hashlib_bucket_unref(b);
+}
+
+static void hashlib_merge_unit(struct hashlib_merge_thread *t, size_t unit)
+{
+    struct hashlib_merge_state *s;
+    struct hashlib_hash *dst, *src;
+    struct hashlib_bucket *b;
+    size_t i, ratio;
+
+    s     = t->state;
+    dst   = s->dst;
+    src   = s->src;
+    ratio = src->tblsize / s->units;
+
+    for (i = unit * ratio; i < (unit + 1) * ratio; i++) {
+        b = src->tbl[i];
+
+        if (!b)
+            continue;
+
+        src->tbl[i] = NULL;
+
+        /* with equal sizes, a bucket moves as a whole into an empty slot */
+        if (dst->tblsize == src->tblsize && !dst->tbl[i]) {
+            dst->tbl[i]      = b;
+            t->bucket_bytes += hashlib_bucket_bytes(b->size);
+            continue;
+        }
+
+        hashlib_merge_bucket(t, b);
+    }
+}
+
+/* reports the entries of the slots [lo, hi) of x that differ in y */
+static void hashlib_diff_slots(struct hashlib_merge_thread *t,
+                               struct hashlib_hash *x, struct hashlib_hash *y,
+                               size_t lo, size_t hi, int x_is_a)
+{
+    struct hashlib_merge_state *s;
+    struct hashlib_bucket *b;
+    struct hashlib_entry *e, *other;
+    size_t i;
+    unsigned int j;
+
+    s = t->state;
+
+    for (i = lo; i < hi; i++) {
+        b = x->tbl[i];
+
+        for (j = 0; b && j < b->count; j++) {
+            e     = b->entry[j];
+            other = hashlib_bucket_find(y->tbl[hashlib_slot(e->hash,
+                                                            y->tblsize)],
+                                        e->key, e->keylen, e->hash, NULL);
+
+            if (!other) {
+                s->diff(e->key, x_is_a ? e->value : NULL,
+                        x_is_a ? NULL : e->value, s->arg);
+                t->found++;
+                continue;
+            }
+
+            /* keys in both tables are reported once, from a */
+            if (!x_is_a || other == e)
+                continue;
+
+            if (s->equal ? !s->equal(e->value, other->value)
+                         : e->value != other->value) {
+                s->diff(e->key, e->value, other->value, s->arg);
+                t->found++;
+            }
+        }
+    }
+}
+
+static void hashlib_diff_unit(struct hashlib_merge_thread *t, size_t unit)
+{
+    struct hashlib_merge_state *s;
+    struct hashlib_hash *a, *b;
+    size_t ra, rb;
+
+    s  = t->state;
+    a  = s->dst;
+    b  = s->src;
+    ra = a->tblsize / s->units;
+    rb = b->tblsize / s->units;
+
+    /* a bucket shared by clones is the same in both tables */
+    if (a->tblsize == b->tblsize && a->tbl[unit] == b->tbl[unit])
+        return;
+
+    hashlib_diff_slots(t, a, b, unit * ra, (unit + 1) * ra, 1);
+    hashlib_diff_slots(t, b, a, unit * rb, (unit + 1) * rb, 0);
+}
+
+static void *hashlib_merge_thread(void *arg)
+{
+    struct hashlib_merge_thread *t;
+    struct hashlib_merge_state *s;
+    size_t unit, end;
+
+    t = arg;
+    s = t->state;
+
+    for (;;) {
+        unit = __atomic_fetch_add(&s->next, HASHLIB_MERGE_CHUNK,
+                                  __ATOMIC_RELAXED);
+
+        if (unit >= s->units)
+            break;
+
+        end = unit + HASHLIB_MERGE_CHUNK < s->units
+              ? unit + HASHLIB_MERGE_CHUNK : s->units;
+
+        for (; unit < end; unit++)
+            s->unit(t, unit);
+    }
+
+    return NULL;
+}
+
+/* runs s->unit over all units with threads threads, t has threads elements */
+static void hashlib_merge_run(struct hashlib_merge_state *s,
+                              struct hashlib_merge_thread *t,
+                              unsigned int threads)
+{
+    pthread_t *tids;
+    unsigned int i;
+    int ret;
+
+    s->units = s->dst->tblsize < s->src->tblsize ? s->dst->tblsize
+                                                 : s->src->tblsize;
+    s->next  = 0;
+    tids     = hashlib_calloc(threads, sizeof(*tids));
+
+    for (i = 0; i < threads; i++)
+        t[i].state = s;
+
+    for (i = 1; i < threads; i++) {
+        ret = pthread_create(&tids[i], NULL, hashlib_merge_thread, &t[i]);
+
+        if (ret)
+            diefx("pthread_create: %s", strerror(ret));
+    }
+
+    hashlib_merge_thread(&t[0]);
+
+    for (i = 1; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+}
+
+static unsigned int hashlib_merge_threads(struct hashlib_hash *a,
+                                          struct hashlib_hash *b,
+                                          unsigned int threads)
+{
+    size_t units, max;
+
+    units = a->tblsize < b->tblsize ? a->tblsize : b->tblsize;
+    max   = (units + HASHLIB_MERGE_CHUNK - 1) / HASHLIB_MERGE_CHUNK;
+
+    if (!threads)
+        threads = 1;
+
+    return threads < max ? threads : max;
+}
+
+/*
+ * moves all entries of src into dst and leaves src empty.  For a key in
+ * both tables, the entry of dst is kept unless conflict returns nonzero;
+ * the other entry is deleted.  conflict may be NULL and is called from
+ * several threads at once if threads is greater than one.  Both tables
+ * must use the same pool, if any.  The ordered index and the filter of dst
+ * are built again.  Returns the number of keys added to dst.
+ */
+extern size_t hashlib_merge(struct hashlib_hash *dst, struct hashlib_hash *src,
+                            HASHLIB_FP_CONFLICT(conflict),
+                            unsigned int threads)
+{
+    struct hashlib_merge_state s;
+    struct hashlib_merge_thread *t;
+    size_t dropped, dropped_key_bytes, value_delta, added;
+    unsigned int i;
+
+    assert(dst);
+    assert(src);
+    assert(dst != src);
+    assert(dst->pool == src->pool);
+
+    memset(&s, 0, sizeof(s));
+
+    s.dst      = dst;
+    s.src      = src;
+    s.conflict = conflict;
+    s.unit     = hashlib_merge_unit;
+
+    threads = hashlib_merge_threads(dst, src, threads);
+    t       = hashlib_calloc(threads, sizeof(*t));
+
+    hashlib_merge_run(&s, t, threads);
+
+    dropped = dropped_key_bytes = value_delta = 0;
+
+    for (i = 0; i < threads; i++) {
+        dropped            += t[i].dropped;
+        dropped_key_bytes  += t[i].dropped_key_bytes;
+        value_delta        += t[i].value_delta;
+        dst->bucket_bytes  += t[i].bucket_bytes;
+    }
+
+    added           = src->count - dropped;
+    dst->count     += added;
+    dst->key_bytes += src->key_bytes - dropped_key_bytes;
+
+    if (dst->account_values && src->account_values)
+        dst->value_bytes += src->value_bytes + value_delta;
+    else if (dst->account_values)
+        hashlib_set_value_accounting(dst, 1);
+
+    src->count        = 0;
+    src->key_bytes    = 0;
+    src->value_bytes  = 0;
+    src->bucket_bytes = 0;
+
+    hashlib_rebuild_indexes(dst);
+    hashlib_rebuild_indexes(src);
+
+    free(t);
+
+    return added;
+}
+
+/*
+ * calls diff for every key that is only in a, only in b, or whose values
+ * differ; the missing value is NULL.  Values are compared with equal, or
+ * by pointer if equal is NULL.  Buckets shared by clones are skipped.  diff
+ * is called from several threads at once if threads is greater than one.
+ * Returns the number of calls of diff.
+ */
+extern size_t hashlib_diff(struct hashlib_hash *a, struct hashlib_hash *b,
+                           HASHLIB_FP_EQUAL(equal), HASHLIB_FP_DIFF(diff),
+                           void *arg, unsigned int threads)
+{
+    struct hashlib_merge_state s;
+    struct hashlib_merge_thread *t;
+    size_t found;
+    unsigned int i;
+
+    assert(a);
+    assert(b);
+    assert(diff);
+
+    memset(&s, 0, sizeof(s));
+
+    s.dst   = a;
+    s.src   = b;
+    s.equal = equal;
+    s.diff  = diff;
+    s.arg   = arg;
+    s.unit  = hashlib_diff_unit;
+
+    threads = hashlib_merge_threads(a, b, threads);
+    t       = hashlib_calloc(threads, sizeof(*t));
+
+    hashlib_merge_run(&s, t, threads);
+
+    for (i = 0, found = 0; i < threads; i++)
+        found += t[i].found;
+
+    free(t);
+
+    return found;
+}
@@ -0,0 +1,976 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Ordered index of the entries of a table, a B+tree ordered by strcmp.
+ * Nodes keep the first four bytes of their keys, most comparisons are
+ * decided without touching the keys.  Inner nodes own copies of their
+ * separators, so a separator may outlive the key it was copied from;
+ * child[i] < key[i] <= child[i + 1] holds for all keys below a node.
+ * Full nodes are split on the way down, so an insertion fails without
+ * changing the tree.  Removals never allocate: empty nodes are freed and
+ * neighbours are merged when both fit into half a node.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+#define HASHLIB_ORDER_FANOUT 32
+
+/* bulk loaded nodes are filled to three quarters */
+#define HASHLIB_ORDER_FILL (HASHLIB_ORDER_FANOUT * 3 / 4)
+
+#define hashlib_order_leaf(n)  ((struct hashlib_order_leaf *) (n))
+#define hashlib_order_inner(n) ((struct hashlib_order_inner *) (n))
+
+struct hashlib_order_node {
+    unsigned int count;     /* entries of a leaf, children of an inner node */
+    unsigned int leaf;
+    uint32_t prefix[HASHLIB_ORDER_FANOUT];  /* of the keys, big endian */
+};
+
+struct hashlib_order_leaf {
+    struct hashlib_order_node node;
+    struct hashlib_order_leaf *prev;
+    struct hashlib_order_leaf *next;
+    struct hashlib_entry *entry[HASHLIB_ORDER_FANOUT];
+};
+
+struct hashlib_order_inner {
+    struct hashlib_order_node node;
+    char *key[HASHLIB_ORDER_FANOUT - 1];
+    struct hashlib_order_node *child[HASHLIB_ORDER_FANOUT];
+};
+
+struct hashlib_order {
+    struct hashlib_order_node *root;    /* NULL if empty */
+    size_t bytes;
+};
+
+/* the first four bytes of key, shorter keys are padded with null bytes */
+static inline uint32_t hashlib_order_prefix(const char *key)
+{
+    uint32_t prefix;
+    unsigned int i;
+
+    prefix = 0;
+
+    for (i = 0; i < 4 && key[i]; i++)
+        prefix |= (uint32_t) (unsigned char) key[i] << (24 - 8 * i);
+
+    return prefix;
+}
+
+static inline int hashlib_order_cmp(const char *a, uint32_t pa,
+                                    const char *b, uint32_t pb)
+{
+    if (pa != pb)
+        return pa < pb ? -1 : 1;
+
+    return strcmp(a, b);
+}
+
+static inline const char *hashlib_order_key(struct hashlib_order_node *n,
+                                            unsigned int i)
+{
+    return n->leaf ? hashlib_order_leaf(n)->entry[i]->key
+                   : hashlib_order_inner(n)->key[i];
+}
+
+/* number of keys of n below key, or not above key if upper is nonzero */
+static unsigned int hashlib_order_search(struct hashlib_order_node *n,
+                                         const char *key, uint32_t prefix,
+                                         int upper)
+{
+    unsigned int lo, hi, mid;
+    int c;
+
+    lo = 0;
+    hi = n->leaf ? n->count : n->count - 1;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        c   = hashlib_order_cmp(key, prefix, hashlib_order_key(n, mid),
+                                n->prefix[mid]);
+
+        if (c > 0 || (upper && !c))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static struct hashlib_order_node *hashlib_order_node_new(
+        struct hashlib_order *o, int leaf)
+{
+    struct hashlib_order_node *n;
+    size_t size;
+
+    size = leaf ? sizeof(struct hashlib_order_leaf)
+                : sizeof(struct hashlib_order_inner);
+    n    = malloc(size);
+
+    if (!n)
+        return NULL;
+
+    n->count  = 0;
+    n->leaf   = leaf;
+    o->bytes += size;
+
+    return n;
+}
+
+/* frees n and the nodes below it */
+static void hashlib_order_node_delete(struct hashlib_order *o,
+                                      struct hashlib_order_node *n)
+{
+    struct hashlib_order_inner *in;
+    unsigned int i;
+
+    if (n->leaf) {
+        o->bytes -= sizeof(struct hashlib_order_leaf);
+        free(n);
+        return;
+    }
+
+    in = hashlib_order_inner(n);
+
+    for (i = 0; i < n->count; i++) {
+        if (i)
+            free(in->key[i - 1]);
+
+        hashlib_order_node_delete(o, in->child[i]);
+    }
+
+    o->bytes -= sizeof(*in);
+    free(in);
+}
+
+static char *hashlib_order_key_dup(struct hashlib_order *o, const char *key)
+{
+    char *copy;
+
+    copy = strdup(key);
+
+    if (copy)
+        o->bytes += strlen(copy) + 1;
+
+    return copy;
+}
+
+static void hashlib_order_key_free(struct hashlib_order *o, char *key)
+{
+    o->bytes -= strlen(key) + 1;
+    free(key);
+}
+
+/* splits the full child i of p, which is not full; returns 0 or -ENOMEM */
+static int hashlib_order_split(struct hashlib_order *o,
+                               struct hashlib_order_inner *p, unsigned int i)
+{
+    const unsigned int half = HASHLIB_ORDER_FANOUT / 2;
+    struct hashlib_order_node *child, *right;
+    struct hashlib_order_leaf *l, *r;
+    struct hashlib_order_inner *li, *ri;
+    uint32_t prefix;
+    char *sep;
+    unsigned int j;
+
+    child = p->child[i];
+    right = hashlib_order_node_new(o, child->leaf);
+
+    if (!right)
+        return -ENOMEM;
+
+    if (child->leaf) {
+        l   = hashlib_order_leaf(child);
+        r   = hashlib_order_leaf(right);
+        sep = hashlib_order_key_dup(o, l->entry[half]->key);
+
+        if (!sep) {
+            hashlib_order_node_delete(o, right);
+            return -ENOMEM;
+        }
+
+        prefix = child->prefix[half];
+
+        memcpy(r->entry, l->entry + half,
+               (HASHLIB_ORDER_FANOUT - half) * sizeof(*(r->entry)));
+
+        r->prev = l;
+        r->next = l->next;
+
+        if (l->next)
+            l->next->prev = r;
+
+        l->next = r;
+    } else {
+        li = hashlib_order_inner(child);
+        ri = hashlib_order_inner(right);
+
+        /* the middle separator moves up */
+        sep    = li->key[half - 1];
+        prefix = child->prefix[half - 1];
+
+        memcpy(ri->key, li->key + half,
+               (HASHLIB_ORDER_FANOUT - 1 - half) * sizeof(*(ri->key)));
+        memcpy(ri->child, li->child + half,
+               (HASHLIB_ORDER_FANOUT - half) * sizeof(*(ri->child)));
+    }
+
+    /* the prefixes of the keys that moved, one more than needed for an
+     * inner node */
+    memcpy(right->prefix, child->prefix + half,
+           (HASHLIB_ORDER_FANOUT - half) * sizeof(*(right->prefix)));
+
+    right->count = HASHLIB_ORDER_FANOUT - half;
+    child->count = half;
+
+    for (j = p->node.count - 1; j > i; j--) {
+        p->key[j]         = p->key[j - 1];
+        p->node.prefix[j] = p->node.prefix[j - 1];
+        p->child[j + 1]   = p->child[j];
+    }
+
+    p->key[i]         = sep;
+    p->node.prefix[i] = prefix;
+    p->child[i + 1]   = right;
+    p->node.count++;
+
+    return 0;
+}
+
+/* e must not be in o; returns 0 or -ENOMEM, o is unchanged on failure */
+extern int hashlib_order_insert(struct hashlib_order *o,
+                                struct hashlib_entry *e)
+{
+    struct hashlib_order_node *n, *root;
+    struct hashlib_order_inner *p;
+    struct hashlib_order_leaf *l;
+    uint32_t prefix;
+    unsigned int i, j;
+
+    assert(o);
+    assert(e);
+
+    if (!o->root) {
+        o->root = hashlib_order_node_new(o, 1);
+
+        if (!o->root)
+            return -ENOMEM;
+
+        hashlib_order_leaf(o->root)->prev = NULL;
+        hashlib_order_leaf(o->root)->next = NULL;
+    }
+
+    if (o->root->count == HASHLIB_ORDER_FANOUT) {
+        root = hashlib_order_node_new(o, 0);
+
+        if (!root)
+            return -ENOMEM;
+
+        root->count                        = 1;
+        hashlib_order_inner(root)->child[0] = o->root;
+
+        if (hashlib_order_split(o, hashlib_order_inner(root), 0)) {
+            root->count = 0;
+            hashlib_order_node_delete(o, root);
+            return -ENOMEM;
+        }
+
+        o->root = root;
+    }
+
+    prefix = hashlib_order_prefix(e->key);
+
+    for (n = o->root; !n->leaf; n = p->child[i]) {
+        p = hashlib_order_inner(n);
+        i = hashlib_order_search(n, e->key, prefix, 1);
+
+        if (p->child[i]->count < HASHLIB_ORDER_FANOUT)
+            continue;
+
+        if (hashlib_order_split(o, p, i))
+            return -ENOMEM;
+
+        if (hashlib_order_cmp(e->key, prefix, p->key[i],
+                              n->prefix[i]) >= 0)
+            i++;
+    }
+
+    l = hashlib_order_leaf(n);
+    i = hashlib_order_search(n, e->key, prefix, 0);
+
+    for (j = n->count; j > i; j--) {
+        l->entry[j]  = l->entry[j - 1];
+        n->prefix[j] = n->prefix[j - 1];
+    }
+
+    l->entry[i]  = e;
+    n->prefix[i] = prefix;
+    n->count++;
+
+    return 0;
+}
+
+/* takes the empty child i out of p */
+static void hashlib_order_drop(struct hashlib_order *o,
+                               struct hashlib_order_inner *p, unsigned int i)
+{
+    struct hashlib_order_leaf *l;
+    unsigned int j, k;
+
+    if (p->child[i]->leaf) {
+        l = hashlib_order_leaf(p->child[i]);
+
+        if (l->prev)
+            l->prev->next = l->next;
+
+        if (l->next)
+            l->next->prev = l->prev;
+    }
+
+    hashlib_order_node_delete(o, p->child[i]);
+
+    if (!--p->node.count)
+        return;
+
+    /* the separator left of the child, right of it for the first one */
+    k = i ? i - 1 : 0;
+
+    hashlib_order_key_free(o, p->key[k]);
+
+    for (j = k; j + 1 < p->node.count; j++) {
+        p->key[j]         = p->key[j + 1];
+        p->node.prefix[j] = p->node.prefix[j + 1];
+    }
+
+    for (j = i; j < p->node.count; j++)
+        p->child[j] = p->child[j + 1];
+}
+
+/* merges child i + 1 of p into child i */
+static void hashlib_order_merge(struct hashlib_order *o,
+                                struct hashlib_order_inner *p, unsigned int i)
+{
+    struct hashlib_order_node *l, *r;
+    struct hashlib_order_leaf *ll, *rl;
+    struct hashlib_order_inner *li, *ri;
+    unsigned int j;
+
+    l = p->child[i];
+    r = p->child[i + 1];
+
+    if (l->leaf) {
+        ll = hashlib_order_leaf(l);
+        rl = hashlib_order_leaf(r);
+
+        memcpy(ll->entry + l->count, rl->entry,
+               r->count * sizeof(*(rl->entry)));
+        memcpy(l->prefix + l->count, r->prefix, r->count * sizeof(*(r->prefix)));
+
+        ll->next = rl->next;
+
+        if (rl->next)
+            rl->next->prev = ll;
+
+        hashlib_order_key_free(o, p->key[i]);
+    } else {
+        li = hashlib_order_inner(l);
+        ri = hashlib_order_inner(r);
+
+        /* the separator moves down between the children */
+        li->key[l->count - 1]   = p->key[i];
+        l->prefix[l->count - 1] = p->node.prefix[i];
+
+        memcpy(li->key + l->count, ri->key, (r->count - 1) * sizeof(*(ri->key)));
+        memcpy(l->prefix + l->count, r->prefix,
+               (r->count - 1) * sizeof(*(r->prefix)));
+        memcpy(li->child + l->count, ri->child,
+               r->count * sizeof(*(ri->child)));
+    }
+
+    l->count += r->count;
+    r->count  = 0;
+
+    hashlib_order_node_delete(o, r);
+
+    p->node.count--;
+
+    for (j = i; j + 1 < p->node.count; j++) {
+        p->key[j]         = p->key[j + 1];
+        p->node.prefix[j] = p->node.prefix[j + 1];
+    }
+
+    for (j = i + 1; j < p->node.count; j++)
+        p->child[j] = p->child[j + 1];
+}
+
+static void hashlib_order_remove_below(struct hashlib_order *o,
+                                       struct hashlib_order_node *n,
+                                       struct hashlib_entry *e,
+                                       uint32_t prefix)
+{
+    struct hashlib_order_inner *p;
+    struct hashlib_order_leaf *l;
+    struct hashlib_order_node *child;
+    unsigned int i;
+
+    if (n->leaf) {
+        l = hashlib_order_leaf(n);
+        i = hashlib_order_search(n, e->key, prefix, 0);
+
+        assert(i < n->count && l->entry[i] == e);
+
+        for (n->count--; i < n->count; i++) {
+            l->entry[i]  = l->entry[i + 1];
+            n->prefix[i] = n->prefix[i + 1];
+        }
+
+        return;
+    }
+
+    p     = hashlib_order_inner(n);
+    i     = hashlib_order_search(n, e->key, prefix, 1);
+    child = p->child[i];
+
+    hashlib_order_remove_below(o, child, e, prefix);
+
+    if (!child->count) {
+        hashlib_order_drop(o, p, i);
+        return;
+    }
+
+    if (child->count >= HASHLIB_ORDER_FANOUT / 4 || n->count < 2)
+        return;
+
+    if (i + 1 == n->count)
+        i--;
+
+    if (p->child[i]->count + p->child[i + 1]->count
+        <= HASHLIB_ORDER_FANOUT / 2)
+        hashlib_order_merge(o, p, i);
+}
+
+/* e must be in o */
+extern void hashlib_order_remove(struct hashlib_order *o,
+                                 struct hashlib_entry *e)
+{
+    struct hashlib_order_node *root;
+
+    assert(o);
+    assert(o->root);
+    assert(e);
+
+    hashlib_order_remove_below(o, o->root, e, hashlib_order_prefix(e->key));
+
+    /* an inner root with a single child is replaced by the child */
+    while ((root = o->root) && !root->leaf && root->count <= 1) {
+        o->root     = root->count ? hashlib_order_inner(root)->child[0] : NULL;
+        root->count = 0;
+
+        hashlib_order_node_delete(o, root);
+    }
+
+    if (o->root && !o->root->count) {
+        hashlib_order_node_delete(o, o->root);
+        o->root = NULL;
+    }
+}
+
+/* puts e in the place of old, which has the same key */
+extern void hashlib_order_replace(struct hashlib_order *o,
+                                  struct hashlib_entry *old,
+                                  struct hashlib_entry *e)
+{
+    struct hashlib_order_node *n;
+    uint32_t prefix;
+    unsigned int i;
+
+    assert(o);
+    assert(o->root);
+
+    prefix = hashlib_order_prefix(old->key);
+
+    for (n = o->root; !n->leaf;)
+        n = hashlib_order_inner(n)->child[hashlib_order_search(n, old->key,
+                                                               prefix, 1)];
+
+    i = hashlib_order_search(n, old->key, prefix, 0);
+
+    assert(i < n->count && hashlib_order_leaf(n)->entry[i] == old);
+
+    hashlib_order_leaf(n)->entry[i] = e;
+}
+
+static int hashlib_order_entry_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct hashlib_entry * const *) a)->key,
+                  (*(struct hashlib_entry * const *) b)->key);
+}
+
+static const char *hashlib_order_min(struct hashlib_order_node *n)
+{
+    while (!n->leaf)
+        n = hashlib_order_inner(n)->child[0];
+
+    return hashlib_order_leaf(n)->entry[0]->key;
+}
+
+static void hashlib_order_nodes_delete(struct hashlib_order *o,
+                                       struct hashlib_order_node **nodes,
+                                       size_t from, size_t to)
+{
+    for (; from < to; from++)
+        hashlib_order_node_delete(o, nodes[from]);
+}
+
+/* leaves holding the sorted entries e, nodes receives them */
+static int hashlib_order_load_leaves(struct hashlib_order *o,
+                                     struct hashlib_entry **e, size_t n,
+                                     struct hashlib_order_node **nodes,
+                                     size_t leaves)
+{
+    struct hashlib_order_leaf *l, *prev;
+    size_t k, lo, hi, i;
+
+    prev = NULL;
+
+    for (k = 0; k < leaves; k++) {
+        l = (struct hashlib_order_leaf *) hashlib_order_node_new(o, 1);
+
+        if (!l) {
+            hashlib_order_nodes_delete(o, nodes, 0, k);
+            return -ENOMEM;
+        }
+
+        lo = n * k / leaves;
+        hi = n * (k + 1) / leaves;
+
+        for (i = lo; i < hi; i++) {
+            l->entry[i - lo]       = e[i];
+            l->node.prefix[i - lo] = hashlib_order_prefix(e[i]->key);
+        }
+
+        l->node.count = hi - lo;
+        l->prev       = prev;
+        l->next       = NULL;
+
+        if (prev)
+            prev->next = l;
+
+        nodes[k] = &l->node;
+        prev     = l;
+    }
+
+    return 0;
+}
+
+/* replaces the count nodes of a level by their parents, returns the
+ * number of parents or 0 on failure, which frees all nodes */
+static size_t hashlib_order_load_level(struct hashlib_order *o,
+                                       struct hashlib_order_node **nodes,
+                                       size_t count)
+{
+    struct hashlib_order_inner *p;
+    size_t parents, k, lo, hi, c;
+
+    parents = (count + HASHLIB_ORDER_FILL - 1) / HASHLIB_ORDER_FILL;
+
+    for (k = 0; k < parents; k++) {
+        lo = count * k / parents;
+        hi = count * (k + 1) / parents;
+        p  = (struct hashlib_order_inner *) hashlib_order_node_new(o, 0);
+
+        if (!p) {
+            c = lo;
+            goto fail;
+        }
+
+        for (c = lo; c < hi; c++) {
+            if (c > lo) {
+                p->key[c - lo - 1] = hashlib_order_key_dup(
+                        o, hashlib_order_min(nodes[c]));
+
+                if (!p->key[c - lo - 1])
+                    goto fail;
+
+                p->node.prefix[c - lo - 1] =
+                        hashlib_order_prefix(p->key[c - lo - 1]);
+            }
+
+            p->child[c - lo] = nodes[c];
+            p->node.count    = c - lo + 1;
+        }
+
+        /* nodes[lo] was read, k <= lo */
+        nodes[k] = &p->node;
+    }
+
+    return parents;
+
+fail:
+    /* the parents done own nodes[k..lo), p owns the children it has */
+    if (p)
+        hashlib_order_node_delete(o, &p->node);
+
+    hashlib_order_nodes_delete(o, nodes, 0, k);
+    hashlib_order_nodes_delete(o, nodes, c, count);
+
+    return 0;
+}
+
+/* the index of the entries of hash; returns 0 or -ENOMEM */
+extern int hashlib_order_new(struct hashlib_order **op,
+                             struct hashlib_hash *hash)
+{
+    struct hashlib_order *o;
+    struct hashlib_order_node **nodes;
+    struct hashlib_bucket *b;
+    struct hashlib_entry **e;
+    size_t i, n, count;
+    unsigned int j;
+
+    *op = NULL;
+
+    o = calloc(1, sizeof(*o));
+
+    if (!o)
+        return -ENOMEM;
+
+    if (!hash->count) {
+        *op = o;
+        return 0;
+    }
+
+    count = (hash->count + HASHLIB_ORDER_FILL - 1) / HASHLIB_ORDER_FILL;
+    e     = malloc(hash->count * sizeof(*e));
+    nodes = malloc(count * sizeof(*nodes));
+
+    if (!e || !nodes)
+        goto fail;
+
+    for (i = 0, n = 0; i < hash->tblsize; i++) {
+        b = hash->tbl[i];
+
+        for (j = 0; b && j < b->count; j++)
+            e[n++] = b->entry[j];
+    }
+
+    qsort(e, n, sizeof(*e), hashlib_order_entry_cmp);
+
+    if (hashlib_order_load_leaves(o, e, n, nodes, count))
+        goto fail;
+
+    while (count > 1)
+        if (!(count = hashlib_order_load_level(o, nodes, count)))
+            goto fail;
+
+    o->root = nodes[0];
+    *op     = o;
+
+    free(e);
+    free(nodes);
+
+    return 0;
+
+fail:
+    free(e);
+    free(nodes);
+    free(o);
+
+    return -ENOMEM;
+}
+
+/* copies n, *last is the leaf copied before; returns NULL on failure */
+static struct hashlib_order_node *hashlib_order_node_copy(
+        struct hashlib_order *o, struct hashlib_order_node *n,
+        struct hashlib_order_leaf **last)
+{
+    struct hashlib_order_node *copy;
+    struct hashlib_order_inner *in, *ci;
+    struct hashlib_order_leaf *l;
+    unsigned int i;
+
+    copy = hashlib_order_node_new(o, n->leaf);
+
+    if (!copy)
+        return NULL;
+
+    if (n->leaf) {
+        memcpy(copy, n, sizeof(*l));
+
+        l       = hashlib_order_leaf(copy);
+        l->prev = *last;
+        l->next = NULL;
+
+        if (*last)
+            (*last)->next = l;
+
+        *last = l;
+
+        return copy;
+    }
+
+    in = hashlib_order_inner(n);
+    ci = hashlib_order_inner(copy);
+
+    memcpy(copy->prefix, n->prefix, sizeof(n->prefix));
+
+    for (i = 0; i < n->count; i++) {
+        if (i && !(ci->key[i - 1] = hashlib_order_key_dup(o, in->key[i - 1])))
+            goto fail;
+
+        ci->child[i] = hashlib_order_node_copy(o, in->child[i], last);
+
+        if (!ci->child[i]) {
+            if (i)
+                hashlib_order_key_free(o, ci->key[i - 1]);
+
+            goto fail;
+        }
+
+        copy->count = i + 1;
+    }
+
+    return copy;
+
+fail:
+    hashlib_order_node_delete(o, copy);
+
+    return NULL;
+}
+
+/* returns 0 or -ENOMEM */
+extern int hashlib_order_clone(struct hashlib_order **copyp,
+                               struct hashlib_order *o)
+{
+    struct hashlib_order *copy;
+    struct hashlib_order_leaf *last;
+
+    *copyp = NULL;
+
+    copy = calloc(1, sizeof(*copy));
+
+    if (!copy)
+        return -ENOMEM;
+
+    last = NULL;
+
+    if (o->root && !(copy->root = hashlib_order_node_copy(copy, o->root,
+                                                          &last))) {
+        free(copy);
+        return -ENOMEM;
+    }
+
+    *copyp = copy;
+
+    return 0;
+}
+
+extern void hashlib_order_delete(struct hashlib_order *o)
+{
+    if (o->root)
+        hashlib_order_node_delete(o, o->root);
+
+    free(o);
+}
+
+extern size_t hashlib_order_bytes(struct hashlib_order *o)
+{
+    return sizeof(*o) + o->bytes;
+}
+
+extern void hashlib_set_ordered(struct hashlib_hash *hash, int enable)
+{
+    int ret;
+
+    ret = hashlib_try_set_ordered(hash, enable);
+
+    if (ret) {
+        errno = -ret;
+        dief("hashlib_set_ordered");
+    }
+}
+
+/*
+ * keeps an ordered index of the keys of hash for hashlib_range and
+ * hashlib_prefix if enable is nonzero, it is built from the keys in hash;
+ * otherwise the index is dropped.  Returns 0 or -ENOMEM.
+ */
+extern int hashlib_try_set_ordered(struct hashlib_hash *hash, int enable)
+{
+    struct hashlib_order *order;
+    int ret;
+
+    assert(hash);
+
+    order = NULL;
+
+    if (enable && (ret = hashlib_order_new(&order, hash)))
+        return ret;
+
+    if (hash->order)
+        hashlib_order_delete(hash->order);
+
+    hash->order = order;
+
+    return 0;
+}
+
+/* the leaf and position of the first entry not below key, or of the first
+ * entry if key is NULL; the position may be behind the last entry */
+static struct hashlib_order_leaf *hashlib_order_seek(struct hashlib_order *o,
+                                                     const char *key,
+                                                     unsigned int *pos)
+{
+    struct hashlib_order_node *n;
+    uint32_t prefix;
+
+    n = o->root;
+
+    if (!n)
+        return NULL;
+
+    prefix = key ? hashlib_order_prefix(key) : 0;
+
+    while (!n->leaf)
+        n = hashlib_order_inner(n)->child[key ? hashlib_order_search(
+                                                        n, key, prefix, 1)
+                                              : 0];
+
+    *pos = key ? hashlib_order_search(n, key, prefix, 0) : 0;
+
+    return hashlib_order_leaf(n);
+}
+
+/*
+ * calls cb with the keys of hash in [lo, hi) and their values in strcmp
+ * order, lo and hi may be NULL for no bound; stops when cb returns
+ * nonzero.  cb must not change hash.  hash must be ordered, see
+ * hashlib_set_ordered.  Returns the number of calls of cb.
+ */
+extern size_t hashlib_range(struct hashlib_hash *hash, const char *lo,
+                            const char *hi, HASHLIB_FP_RANGE(cb), void *arg)
+{
+    struct hashlib_order_leaf *l;
+    struct hashlib_entry *e;
+    unsigned int i;
+    uint32_t prefix;
+    size_t calls;
+
+    assert(hash);
+    assert(hash->order);
+    assert(cb);
+
+    prefix = hi ? hashlib_order_prefix(hi) : 0;
+    calls  = 0;
+
+    for (l = hashlib_order_seek(hash->order, lo, &i); l; l = l->next, i = 0) {
+        for (; i < l->node.count; i++) {
+            e = l->entry[i];
+
+            if (hi && hashlib_order_cmp(e->key, l->node.prefix[i],
+                                        hi, prefix) >= 0)
+                return calls;
+
+            calls++;
+
+            if (cb(e->key, e->value, arg))
+                return calls;
+        }
+    }
+
+    return calls;
+}
+
+/* hashlib_range over the keys of hash that start with prefix */
+extern size_t hashlib_prefix(struct hashlib_hash *hash, const char *prefix,
+                             HASHLIB_FP_RANGE(cb), void *arg)
+{
+    struct hashlib_order_leaf *l;
+    struct hashlib_entry *e;
+    unsigned int i;
+    size_t calls, len;
+
+    assert(hash);
+    assert(hash->order);
+    assert(prefix);
+    assert(cb);
+
+    len   = strlen(prefix);
+    calls = 0;
+
+    for (l = hashlib_order_seek(hash->order, prefix, &i); l;
+         l = l->next, i = 0) {
+        for (; i < l->node.count; i++) {
+            e = l->entry[i];
+
+            if (strncmp(e->key, prefix, len))
+                return calls;
+
+            calls++;
+
+            if (cb(e->key, e->value, arg))
+                return calls;
+        }
+    }
+
+    return calls;
+}
+
+/*
+ * removes the keys of hash that start with prefix like hashlib_remove,
+ * hash must be ordered.  Returns the number of keys removed.
+ */
+extern size_t hashlib_remove_prefix(struct hashlib_hash *hash,
+                                    const char *prefix)
+{
+    struct hashlib_order_leaf *l;
+    size_t removed, len;
+    unsigned int i;
+
+    assert(hash);
+    assert(hash->order);
+    assert(prefix);
+
+    len = strlen(prefix);
+
+    for (removed = 0;; removed++) {
+        l = hashlib_order_seek(hash->order, prefix, &i);
+
+        if (l && i == l->node.count) {
+            l = l->next;
+            i = 0;
+        }
+
+        if (!l || strncmp(l->entry[i]->key, prefix, len))
+            return removed;
+
+        hashlib_remove(hash, l->entry[i]->key);
+    }
+}
@@ -0,0 +1,244 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Pools of interned keys.  The keys are stored back to back in large
+ * blocks, each behind a header with its hash and length, and indexed by a
+ * table generated by HASHLIB_DECLARE.  The handle of a key is the address
+ * of the stored string, so the tables of a pool get the hash and length
+ * of a key from its handle and compare keys by their address.  Keys are
+ * never removed, handles stay valid until the pool is deleted.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+#include "hashlib_typed.h"
+
+/* keys are stored in blocks of this size, larger keys get their own */
+#define HASHLIB_POOL_CHUNK ((size_t) 64 * 1024)
+
+struct hashlib_pool_chunk {
+    struct hashlib_pool_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+/* maps a key to its handle, the stored keys are their own handles */
+HASHLIB_DECLARE(hashlib_pool_index, const char *, const char *,
+                hashlib_typed_string_hash, hashlib_typed_string_equal)
+
+extern struct hashlib_pool *hashlib_pool_new(size_t size)
+{
+    struct hashlib_pool *pool;
+    int ret;
+
+    ret = hashlib_try_pool_new(&pool, size);
+
+    if (ret == -EINVAL)
+        diefx("pool size too big");
+
+    if (ret) {
+        errno = -ret;
+        dief("hashlib_pool_new");
+    }
+
+    return pool;
+}
+
+/* size is the expected number of keys; returns 0, -EINVAL or -ENOMEM */
+extern int hashlib_try_pool_new(struct hashlib_pool **poolp, size_t size)
+{
+    struct hashlib_pool *pool;
+
+    assert(poolp);
+
+    *poolp = NULL;
+
+    if (size > HASHLIB_MAX_TBLSIZE)
+        return -EINVAL;
+
+    pool = calloc(1, sizeof(*pool));
+
+    if (!pool)
+        return -ENOMEM;
+
+    pool->index = hashlib_pool_index_new(size);
+
+    if (!pool->index) {
+        free(pool);
+        return -ENOMEM;
+    }
+
+    *poolp = pool;
+
+    return 0;
+}
+
+/* the tables of pool must have been deleted before */
+extern void hashlib_pool_delete(struct hashlib_pool *pool)
+{
+    struct hashlib_pool_chunk *c, *next;
+
+    assert(pool);
+    assert(!pool->tables);
+
+    for (c = pool->chunk; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+
+    hashlib_pool_index_delete(pool->index);
+    free(pool);
+}
+
+/* the memory of the keys, which the tables of pool do not count */
+extern size_t hashlib_pool_memory_usage(struct hashlib_pool *pool)
+{
+    struct hashlib_pool_index *index;
+
+    assert(pool);
+
+    index = pool->index;
+
+    return sizeof(*pool) + pool->bytes + sizeof(*index)
+           + index->capacity * (1 + sizeof(*(index->slot)));
+}
+
+/* returns bytes bytes of key storage, or NULL */
+static void *hashlib_pool_alloc(struct hashlib_pool *pool, size_t bytes)
+{
+    struct hashlib_pool_chunk *c, *head;
+    size_t size;
+
+    head = pool->chunk;
+
+    if (head && head->size - head->used >= bytes) {
+        head->used += bytes;
+        return head->data + head->used - bytes;
+    }
+
+    size = bytes > HASHLIB_POOL_CHUNK / 4 ? bytes : HASHLIB_POOL_CHUNK;
+    c    = malloc(sizeof(*c) + size);
+
+    if (!c)
+        return NULL;
+
+    c->used      = bytes;
+    c->size      = size;
+    pool->bytes += sizeof(*c) + size;
+
+    /* a large key leaves the rest of the newest block to smaller ones */
+    if (head && size == bytes) {
+        c->next    = head->next;
+        head->next = c;
+    } else {
+        c->next     = head;
+        pool->chunk = c;
+    }
+
+    return c->data;
+}
+
+extern const char *hashlib_intern(struct hashlib_pool *pool, const char *key)
+{
+    const char *handle;
+    int ret;
+
+    ret = hashlib_try_intern(pool, key, &handle);
+
+    if (ret) {
+        errno = -ret;
+        dief("hashlib_intern");
+    }
+
+    return handle;
+}
+
+/*
+ * stores key in pool unless it is there already and sets *handle to the
+ * stored key; equal keys have the same handle.  Returns 0, -ENOMEM or
+ * -EOVERFLOW.
+ */
+extern int hashlib_try_intern(struct hashlib_pool *pool, const char *key,
+                              const char **handle)
+{
+    struct hashlib_key *k;
+    const char **found;
+    size_t len, bytes;
+
+    assert(pool);
+    assert(key);
+    assert(handle);
+
+    found = hashlib_pool_index_get(pool->index, key);
+
+    if (found) {
+        *handle = *found;
+        return 0;
+    }
+
+    len = strlen(key);
+
+    if (len >= UINT_MAX)
+        return -EOVERFLOW;
+
+    /* the headers stay aligned */
+    bytes = sizeof(*k) + len + 1;
+    bytes = (bytes + sizeof(k->hash) - 1) & ~(sizeof(k->hash) - 1);
+    k     = hashlib_pool_alloc(pool, bytes);
+
+    if (!k)
+        return -ENOMEM;
+
+    k->hash = hashlib_index_len(key, &len);
+    k->len  = len;
+
+    memcpy(k + 1, key, len + 1);
+
+    /* on failure the stored key is merely unused */
+    if (hashlib_pool_index_put(pool->index, (char *) (k + 1),
+                               (char *) (k + 1)) == -1)
+        return -ENOMEM;
+
+    pool->count++;
+    *handle = (char *) (k + 1);
+
+    return 0;
+}
+
+/* returns the handle of key, or NULL if it was never interned */
+extern const char *hashlib_interned(struct hashlib_pool *pool, const char *key)
+{
+    const char **found;
+
+    assert(pool);
+    assert(key);
+
+    found = hashlib_pool_index_get(pool->index, key);
+
+    return found ? *found : NULL;
+}
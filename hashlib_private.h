@@ -0,0 +1,617 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/* internal definitions shared by the translation units of hashlib */
+
+#ifndef HASHLIB_PRIVATE_H
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hashlib.h"
+
+#define HASHLIB_PRIVATE_H
+
+#define HASHLIB_INTERNAL __attribute__((visibility("hidden")))
+
+/* identifier 0x4A5411B0 */
+#define HASHLIB_FILE_HEADER (0xB011544A)
+
+/* identifier 0x4B5411B0 */
+#define HASHLIB_FROZEN_FILE_HEADER (0xB011544B)
+
+/* identifier 0x4E5411B0, a frozen table with a filter */
+#define HASHLIB_FROZEN_FILTER_FILE_HEADER (0xB011544E)
+
+/* identifier 0x4C5411B0 */
+#define HASHLIB_U64_FILE_HEADER (0xB011544C)
+
+/* average number of keys per bucket of a frozen table */
+#define HASHLIB_FROZEN_BUCKET_SIZE 4
+
+#define errf(exit, format, ...)  err((exit), "%s: " format, __func__, ## __VA_ARGS__)
+#define errfx(exit, format, ...) errx((exit), "%s: " format, __func__, ## __VA_ARGS__)
+#define dief(arg, ...)           errf(EXIT_FAILURE, arg, ## __VA_ARGS__)
+#define diefx(arg, ...)          errfx(EXIT_FAILURE, arg, ## __VA_ARGS__)
+
+/* a bucket has a tag byte per entry behind the entry pointers */
+#define hashlib_bucket_bytes(size) \
+        (sizeof(struct hashlib_bucket) \
+         + (size) * (sizeof(struct hashlib_entry *) + 1))
+
+#define hashlib_bucket_tags(b) ((unsigned char *) ((b)->entry + (b)->size))
+
+/* the key is stored right behind the entry; entries and buckets are shared
+ * between clones, refs is the number of buckets or tables using them */
+struct hashlib_entry {
+    char *key;
+    void *value;
+    unsigned int hash;
+    unsigned int keylen;
+    unsigned int refs;
+    HASHLIB_FP_FREE(free_function);
+    HASHLIB_FP_SIZE(size_function);
+    HASHLIB_FP_PACK(pack_function);
+};
+
+/* all entries of one slot */
+struct hashlib_bucket {
+    unsigned int count;
+    unsigned int size;
+    unsigned int refs;
+    struct hashlib_entry *entry[];
+};
+
+static inline void *hashlib_calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    p = calloc(nmemb, size);
+
+    if (!p)
+        dief("calloc");
+
+    return p;
+}
+
+static inline int hashlib_open(const char *filename, int flags, mode_t modes)
+{
+    int fd;
+
+    fd = open(filename, flags, modes);
+
+    if (fd == -1)
+        dief("open");
+
+    return fd;
+}
+
+static inline void hashlib_close(int fd)
+{
+    int ret;
+
+    ret = close(fd);
+
+    if (ret == -1)
+        dief("close");
+}
+
+/* returns 0 or -errno */
+static inline int hashlib_try_write(int fd, const void *data, size_t bytes)
+{
+    ssize_t ret;
+    const char *p;
+
+    p = data;
+
+    /* write(2) may write less than requested for large buffers */
+    while (bytes) {
+        ret = write(fd, p, bytes);
+
+        if (ret == -1 && errno == EINTR)
+            continue;
+
+        if (ret == -1)
+            return -errno;
+
+        p     += ret;
+        bytes -= ret;
+    }
+
+    return 0;
+}
+
+static inline void hashlib_write(int fd, void *data, size_t bytes)
+{
+    int ret;
+
+    ret = hashlib_try_write(fd, data, bytes);
+
+    if (ret) {
+        errno = -ret;
+        dief("write");
+    }
+}
+
+/* returns the bytes read, less than bytes only at the end of the file, or
+ * -errno */
+static inline ssize_t hashlib_try_read(int fd, void *buf, size_t bytes)
+{
+    ssize_t ret;
+    size_t done;
+
+    for (done = 0; done < bytes; done += ret) {
+        ret = read(fd, (char *) buf + done, bytes - done);
+
+        if (ret == -1 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+
+        if (ret == -1)
+            return -errno;
+
+        if (!ret)
+            break;
+    }
+
+    return done;
+}
+
+/* returns less than bytes only at the end of the file */
+static inline size_t hashlib_read(int fd, void *buf, size_t bytes)
+{
+    ssize_t ret;
+
+    ret = hashlib_try_read(fd, buf, bytes);
+
+    if (ret < 0) {
+        errno = -ret;
+        dief("read");
+    }
+
+    return ret;
+}
+
+/* MurmurHash64A by Austin Appleby, the 32 bit hashlib_index is too weak
+ * for structures that need distinct hash values for distinct keys */
+static inline uint64_t hashlib_hash64(const char *key, size_t len,
+                                      uint64_t seed)
+{
+    const uint64_t m = 0xC6A4A7935BD1E995ULL;
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t h;
+    uint64_t k;
+
+    h   = seed ^ (len * m);
+    p   = (const unsigned char *) key;
+    end = p + (len & ~(size_t) 7);
+
+    for (; p != end; p += 8) {
+        memcpy(&k, p, sizeof(k));
+
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+    case 7: h ^= (uint64_t) p[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t) p[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t) p[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t) p[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t) p[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t) p[1] << 8;  /* fall through */
+    case 1: h ^= (uint64_t) p[0];
+            h *= m;
+    }
+
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+
+    return h;
+}
+
+/* finalizer of splitmix64 */
+static inline uint64_t hashlib_mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+/* maps h to [0, n) without a division */
+static inline size_t hashlib_fastrange64(uint64_t h, size_t n)
+{
+    return ((unsigned __int128) h * n) >> 64;
+}
+
+/* grows *buf to hold bytes bytes, returns 0 or -ENOMEM */
+static inline int hashlib_reserve(char **buf, size_t *size, size_t bytes)
+{
+    char *p;
+
+    if (bytes <= *size)
+        return 0;
+
+    p = realloc(*buf, bytes);
+
+    if (!p)
+        return -ENOMEM;
+
+    *buf  = p;
+    *size = bytes;
+
+    return 0;
+}
+
+/* hashlib_index, which also returns the length of key */
+static inline unsigned int hashlib_index_len(const char *key, size_t *len)
+{
+    const char *p;
+    unsigned int index;
+
+    index = 0;
+
+    for (p = key; *p; p++)
+        index = 5 * index + *p;
+
+    *len = p - key;
+
+    return index;
+}
+
+/* slot of a hash in a table of tblsize slots, a power of two */
+static inline size_t hashlib_slot(unsigned int hash, size_t tblsize)
+{
+    /* Fibonacci hashing, the high bits of the product depend on all bits
+     * of hash */
+    return ((uint64_t) (uint32_t) (hash * 0x9E3779B1U) * tblsize) >> 32;
+}
+
+/* 8 bit tag of a hash, stored in the buckets; it is independent of the
+ * high bits that select the slot */
+static inline unsigned char hashlib_tag(unsigned int hash)
+{
+    hash ^= hash >> 16;
+
+    return hash ^ (hash >> 8);
+}
+
+/* dispatched to the best variant of hashlib_simd.c */
+extern HASHLIB_INTERNAL int (*hashlib_memeq)(const void *, const void *,
+                                             size_t);
+extern HASHLIB_INTERNAL uint32_t (*hashlib_match32)(const unsigned char *,
+                                                    unsigned char);
+
+/* nonzero unless the scalar level is set, the tags behind the last 32 are
+ * then matched with SSE2 */
+extern HASHLIB_INTERNAL int hashlib_match_tail;
+
+static inline int hashlib_entry_equal(struct hashlib_entry *e,
+                                      const char *key, size_t len,
+                                      unsigned int hash)
+{
+    return e->hash == hash && e->keylen == len
+           && hashlib_memeq(e->key, key, len);
+}
+
+/* bytes buffered by the readers and writers of hashlib_stream.c */
+#define HASHLIB_STREAM_BUFFER (64 * 1024)
+
+struct hashlib_writer {
+    struct hashlib_stream *stream;
+    size_t len;
+    char buf[HASHLIB_STREAM_BUFFER];
+};
+
+struct hashlib_reader {
+    struct hashlib_stream *stream;
+    size_t pos;
+    size_t len;
+    char buf[HASHLIB_STREAM_BUFFER];
+};
+
+HASHLIB_INTERNAL void hashlib_stream_fd(struct hashlib_stream *stream, int fd);
+HASHLIB_INTERNAL struct hashlib_writer *hashlib_writer_new(
+        struct hashlib_stream *out);
+HASHLIB_INTERNAL int hashlib_writer_flush(struct hashlib_writer *w);
+HASHLIB_INTERNAL int hashlib_writer_put(struct hashlib_writer *w,
+                                        const void *data, size_t bytes);
+HASHLIB_INTERNAL int hashlib_writer_put_fd(struct hashlib_writer *w, int fd,
+                                           size_t bytes);
+HASHLIB_INTERNAL int hashlib_writer_delete(struct hashlib_writer *w,
+                                           int flush);
+HASHLIB_INTERNAL struct hashlib_reader *hashlib_reader_new(
+        struct hashlib_stream *in);
+HASHLIB_INTERNAL void hashlib_reader_delete(struct hashlib_reader *r);
+HASHLIB_INTERNAL ssize_t hashlib_reader_get(struct hashlib_reader *r,
+                                            void *buf, size_t bytes);
+HASHLIB_INTERNAL int hashlib_reader_get_exact(struct hashlib_reader *r,
+                                              void *buf, size_t bytes);
+
+HASHLIB_INTERNAL void *hashlib_mem_alloc(size_t bytes, int flags, int node,
+                                         size_t *mapped);
+HASHLIB_INTERNAL void hashlib_mem_free(void *p, size_t mapped);
+
+/* an interned key in a hashlib_pool, its handle points to the key behind
+ * the header */
+struct hashlib_key {
+    unsigned int hash;
+    unsigned int len;
+};
+
+#define hashlib_handle_key(handle) ((const struct hashlib_key *) (handle) - 1)
+
+/* the key of an interned entry is a handle instead of a copy behind e */
+#define hashlib_entry_interned(e) ((e)->key != (char *) ((e) + 1))
+
+/* bytes of the key that belong to the table of e */
+#define hashlib_entry_key_bytes(e) \
+        (hashlib_entry_interned(e) ? 0 : (size_t) (e)->keylen + 1)
+
+static inline int hashlib_entry_match(struct hashlib_entry *e, const char *key,
+                                      size_t len, unsigned int hash,
+                                      int interned)
+{
+    return interned ? e->key == key : hashlib_entry_equal(e, key, len, hash);
+}
+
+#ifdef __SSE2__
+/* bit i is set if p[i] is tag, for 16 bytes */
+static inline uint32_t hashlib_match16(const unsigned char *p,
+                                       unsigned char tag)
+{
+    __m128i t;
+
+    t = _mm_loadu_si128((const __m128i *) p);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_set1_epi8(tag)));
+}
+#endif
+
+/* the entry among the candidates of match, bit k is tag base + k of b */
+static inline int hashlib_bucket_pick(struct hashlib_bucket *b, uint32_t match,
+                                      unsigned int base, const char *key,
+                                      size_t len, unsigned int hash,
+                                      int interned, unsigned int *j)
+{
+    while (match) {
+        *j = base + __builtin_ctz(match);
+
+        if (hashlib_entry_match(b->entry[*j], key, len, hash, interned))
+            return 1;
+
+        match &= match - 1;
+    }
+
+    return 0;
+}
+
+/*
+ * only entries whose tag matches are looked at, large buckets are searched
+ * 32 tags at a time and the rest 16 at a time.  The last 16 tags end at
+ * the last tag; the entry pointers and the header in front of the tags
+ * belong to the bucket and the bits of their bytes are shifted out, so
+ * buckets of a few entries are matched with one compare.  Interned keys
+ * are compared by their address, all keys of a table with a pool are
+ * interned in it.
+ */
+static inline struct hashlib_entry *hashlib_bucket_search(
+        struct hashlib_bucket *b, const char *key, size_t len,
+        unsigned int hash, unsigned int *pos, int interned)
+{
+    unsigned char *tags;
+    unsigned char tag;
+    unsigned int i, j;
+    uint32_t match;
+
+    if (!b)
+        return NULL;
+
+    tags = hashlib_bucket_tags(b);
+    tag  = hashlib_tag(hash);
+
+    for (i = 0; i + 32 <= b->count; i += 32) {
+        match = hashlib_match32(tags + i, tag);
+
+        if (hashlib_bucket_pick(b, match, i, key, len, hash, interned, &j))
+            goto found;
+    }
+
+#ifdef __SSE2__
+    for (; hashlib_match_tail && i < b->count; i += 16) {
+        if (i + 16 <= b->count)
+            match = hashlib_match16(tags + i, tag);
+        else
+            match = hashlib_match16(tags + b->count - 16, tag)
+                    >> (16 - (b->count - i));
+
+        if (hashlib_bucket_pick(b, match, i, key, len, hash, interned, &j))
+            goto found;
+    }
+#endif
+
+    for (j = i; j < b->count; j++)
+        if (tags[j] == tag
+            && hashlib_entry_match(b->entry[j], key, len, hash, interned))
+            goto found;
+
+    return NULL;
+
+found:
+    if (pos)
+        *pos = j;
+
+    return b->entry[j];
+}
+
+static inline struct hashlib_entry *hashlib_bucket_find(
+        struct hashlib_bucket *b, const char *key, size_t len,
+        unsigned int hash, unsigned int *pos)
+{
+    return hashlib_bucket_search(b, key, len, hash, pos, 0);
+}
+
+static inline struct hashlib_entry *hashlib_bucket_find_interned(
+        struct hashlib_bucket *b, const char *handle, unsigned int *pos)
+{
+    return hashlib_bucket_search(b, handle, 0,
+                                 hashlib_handle_key(handle)->hash, pos, 1);
+}
+
+/* appends e to b, which has room for it */
+static inline void hashlib_bucket_push(struct hashlib_bucket *b,
+                                       struct hashlib_entry *e)
+{
+    hashlib_bucket_tags(b)[b->count] = hashlib_tag(e->hash);
+    b->entry[b->count++]             = e;
+}
+
+HASHLIB_INTERNAL struct hashlib_entry *hashlib_entry_new(
+        const char *key, size_t len, unsigned int hash, void *value,
+        HASHLIB_FP_FREE(free_function), HASHLIB_FP_SIZE(size_function),
+        HASHLIB_FP_PACK(pack_function));
+HASHLIB_INTERNAL struct hashlib_entry *hashlib_entry_new_interned(
+        const char *handle, void *value, HASHLIB_FP_FREE(free_function),
+        HASHLIB_FP_SIZE(size_function), HASHLIB_FP_PACK(pack_function));
+HASHLIB_INTERNAL void hashlib_entry_unref(struct hashlib_entry *e);
+HASHLIB_INTERNAL void hashlib_bucket_unref(struct hashlib_bucket *b);
+HASHLIB_INTERNAL int hashlib_bucket_own(void **slot);
+HASHLIB_INTERNAL int hashlib_bucket_append(void **slot, struct hashlib_entry *e,
+                                           size_t *bucket_bytes);
+HASHLIB_INTERNAL void hashlib_rebuild_indexes(struct hashlib_hash *hash);
+
+/* ordered index of a table, see hashlib_order.c */
+HASHLIB_INTERNAL int hashlib_order_new(struct hashlib_order **order,
+                                       struct hashlib_hash *hash);
+HASHLIB_INTERNAL int hashlib_order_clone(struct hashlib_order **copy,
+                                         struct hashlib_order *order);
+HASHLIB_INTERNAL void hashlib_order_delete(struct hashlib_order *order);
+HASHLIB_INTERNAL int hashlib_order_insert(struct hashlib_order *order,
+                                          struct hashlib_entry *e);
+HASHLIB_INTERNAL void hashlib_order_remove(struct hashlib_order *order,
+                                           struct hashlib_entry *e);
+HASHLIB_INTERNAL void hashlib_order_replace(struct hashlib_order *order,
+                                            struct hashlib_entry *old,
+                                            struct hashlib_entry *e);
+HASHLIB_INTERNAL size_t hashlib_order_bytes(struct hashlib_order *order);
+
+/*
+ * split block Bloom filter, see hashlib_filter.c.  A key sets one bit in
+ * each word of one block, the high half of its 64 bit hash selects the
+ * block and the low half the bits.
+ */
+#define HASHLIB_FILTER_WORDS 8
+
+struct hashlib_filter {
+    uint32_t (*block)[HASHLIB_FILTER_WORDS];
+    size_t blocks;
+    size_t mapped;          /* see hashlib_mem_alloc */
+    size_t capacity;        /* keys the filter is sized for */
+    size_t stale;           /* removed keys, their bits are still set */
+    unsigned int bits_per_key;
+};
+
+/* 64 bit hash of a key of a table, whose hash has only 32 bits */
+#define hashlib_filter_hash(hash) hashlib_mix64((uint64_t) (hash))
+
+static inline uint32_t *hashlib_filter_block(const struct hashlib_filter *f,
+                                             uint64_t h)
+{
+    return f->block[((h >> 32) * f->blocks) >> 32];
+}
+
+static inline uint32_t hashlib_filter_bit(uint32_t h, unsigned int i)
+{
+    static const uint32_t salt[HASHLIB_FILTER_WORDS] = {
+        0x47B6137BU, 0x44974D91U, 0x8824AD5BU, 0xA2B7289DU,
+        0x705495C7U, 0x2DF1424BU, 0x9EFC4947U, 0x5C6BFB31U
+    };
+
+    return (uint32_t) 1 << ((h * salt[i]) >> 27);
+}
+
+static inline void hashlib_filter_add(struct hashlib_filter *f, uint64_t h)
+{
+    uint32_t *block;
+    unsigned int i;
+
+    block = hashlib_filter_block(f, h);
+
+    for (i = 0; i < HASHLIB_FILTER_WORDS; i++)
+        block[i] |= hashlib_filter_bit(h, i);
+}
+
+/* 0 if the key of h is certainly not in the filter */
+static inline int hashlib_filter_test(const struct hashlib_filter *f,
+                                      uint64_t h)
+{
+    const uint32_t *block;
+    uint32_t missing;
+    unsigned int i;
+
+    block   = hashlib_filter_block(f, h);
+    missing = 0;
+
+    for (i = 0; i < HASHLIB_FILTER_WORDS; i++)
+        missing |= hashlib_filter_bit(h, i) & ~block[i];
+
+    return !missing;
+}
+
+/* 0 if the key of the hash h is certainly not in hash */
+static inline int hashlib_maybe_contains(struct hashlib_hash *hash,
+                                         unsigned int h)
+{
+    return !hash->filter
+           || hashlib_filter_test(hash->filter, hashlib_filter_hash(h));
+}
+
+HASHLIB_INTERNAL struct hashlib_filter *hashlib_filter_new(
+        size_t capacity, unsigned int bits_per_key, int flags, int node);
+HASHLIB_INTERNAL struct hashlib_filter *hashlib_filter_copy(
+        struct hashlib_filter *f, int flags, int node);
+HASHLIB_INTERNAL void hashlib_filter_delete(struct hashlib_filter *f);
+HASHLIB_INTERNAL size_t hashlib_filter_bytes(struct hashlib_filter *f);
+HASHLIB_INTERNAL void hashlib_filter_put(struct hashlib_hash *hash,
+                                         struct hashlib_entry *e);
+HASHLIB_INTERNAL void hashlib_filter_remove(struct hashlib_hash *hash);
+
+HASHLIB_INTERNAL HASHLIB_FCT_SIZE(hashlib_default_size_function, e);
+HASHLIB_INTERNAL HASHLIB_FCT_PACK(hashlib_default_pack_function, e, bytes, fd);
+HASHLIB_INTERNAL HASHLIB_FCT_UNPACK(hashlib_default_unpack_function, data,
+                                    bytes);
+
+#endif
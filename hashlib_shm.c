@@ -0,0 +1,581 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Tables in a POSIX shared memory segment.  Slots, entries, keys and
+ * values all live in the segment and refer to each other by offsets, so
+ * every process may map it at a different address.
+ *
+ * One process writes, any number of processes read without locks.  Memory
+ * is allocated append-only and an entry is never changed once it is linked,
+ * so a reader never sees a half written entry; a sequence counter that is
+ * odd while the writer links or unlinks lets readers retry a lookup that
+ * overlapped a change.  A writer that dies within a change leaves the
+ * counter odd; readers then give up after a while instead of spinning
+ * forever, and the next writer to open the segment ends the change.
+ * Removed and replaced entries stay in the segment
+ * until it is rebuilt, hashlib_shm_memory_stats tells how many bytes they
+ * take.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* identifier 0x4D5411B0 */
+#define HASHLIB_SHM_HEADER (0xB011544D)
+
+#define HASHLIB_SHM_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+/* a reader spins this often on a change, then yields the CPU */
+#define HASHLIB_SHM_SPINS (64)
+
+/* a reader gives up after this many attempts, see hashlib_shm_get */
+#define HASHLIB_SHM_ATTEMPTS (1 << 16)
+
+/* tells the CPU that this is a spin loop */
+static inline void hashlib_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* at offset 0 of the segment */
+struct hashlib_shm_header {
+    uint64_t magic;
+    uint64_t bytes;     /* size of the segment */
+    uint64_t tblsize;
+    uint64_t slots;     /* offset of the slot array */
+    uint64_t used;      /* end of the allocated part */
+    uint64_t count;
+    uint64_t garbage;   /* bytes of removed and replaced entries */
+    uint64_t seq;       /* odd while the writer changes a chain */
+};
+
+/* followed by the key with its NUL, padding, and the value */
+struct hashlib_shm_entry {
+    uint64_t next;      /* offset of the next entry of the slot, or 0 */
+    uint32_t hash;
+    uint32_t keylen;
+    uint64_t size;      /* bytes of the value */
+};
+
+#define hashlib_shm_hdr(shm) ((struct hashlib_shm_header *) (shm)->base)
+
+#define hashlib_shm_at(shm, offset) \
+        ((struct hashlib_shm_entry *) ((char *) (shm)->base + (offset)))
+
+#define hashlib_shm_key(e) ((char *) ((e) + 1))
+
+#define hashlib_shm_value(e) \
+        (hashlib_shm_key(e) + HASHLIB_SHM_ALIGN((e)->keylen + 1))
+
+#define hashlib_shm_entry_bytes(keylen, size) \
+        (sizeof(struct hashlib_shm_entry) + HASHLIB_SHM_ALIGN((keylen) + 1) \
+         + HASHLIB_SHM_ALIGN(size))
+
+static inline uint64_t *hashlib_shm_slots(struct hashlib_shm *shm)
+{
+    return (uint64_t *) ((char *) shm->base + hashlib_shm_hdr(shm)->slots);
+}
+
+/* maps the segment of fd, returns 0 or -errno */
+static int hashlib_shm_map(struct hashlib_shm **shmp, int fd, size_t bytes,
+                           int writable)
+{
+    struct hashlib_shm *shm;
+
+    shm = malloc(sizeof(*shm));
+
+    if (!shm)
+        return -ENOMEM;
+
+    shm->bytes    = bytes;
+    shm->writable = writable;
+    shm->base     = mmap(NULL, bytes, writable ? PROT_READ | PROT_WRITE
+                                               : PROT_READ,
+                         MAP_SHARED, fd, 0);
+
+    if (shm->base == MAP_FAILED) {
+        free(shm);
+        return -errno;
+    }
+
+    *shmp = shm;
+
+    return 0;
+}
+
+/*
+ * creates the segment name of bytes bytes with size slots; the segment
+ * must not exist.  Returns 0, -EINVAL if bytes is too small for the
+ * slots, or the error of shm_open, ftruncate or mmap.
+ */
+extern int hashlib_shm_create(struct hashlib_shm **shmp, const char *name,
+                              size_t size, size_t bytes)
+{
+    struct hashlib_shm_header *h;
+    size_t tblsize;
+    int fd;
+    int ret;
+
+    assert(shmp);
+    assert(name);
+
+    *shmp = NULL;
+
+    if (!size || size > HASHLIB_MAX_TBLSIZE)
+        return -EINVAL;
+
+    for (tblsize = 1; tblsize < size; tblsize <<= 1)
+        ;
+
+    if (bytes < sizeof(*h) + tblsize * sizeof(uint64_t))
+        return -EINVAL;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if (fd == -1)
+        return -errno;
+
+    /* the segment is sparse, untouched pages stay zero */
+    ret = ftruncate(fd, bytes) ? -errno : hashlib_shm_map(shmp, fd, bytes, 1);
+
+    close(fd);
+
+    if (ret) {
+        shm_unlink(name);
+        return ret;
+    }
+
+    h          = hashlib_shm_hdr(*shmp);
+    h->bytes   = bytes;
+    h->tblsize = tblsize;
+    h->slots   = sizeof(*h);
+    h->used    = h->slots + tblsize * sizeof(uint64_t);
+
+    /* readers check the magic last */
+    __atomic_store_n(&h->magic, HASHLIB_SHM_HEADER, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * maps the existing segment name, read only unless writable is set.
+ * Returns 0, -EINVAL if it is not a hashlib segment, or the error of
+ * shm_open, fstat or mmap.
+ */
+extern int hashlib_shm_open(struct hashlib_shm **shmp, const char *name,
+                            int writable)
+{
+    struct hashlib_shm_header *h;
+    struct stat st;
+    int fd;
+    int ret;
+
+    assert(shmp);
+    assert(name);
+
+    *shmp = NULL;
+
+    fd = shm_open(name, writable ? O_RDWR : O_RDONLY, 0);
+
+    if (fd == -1)
+        return -errno;
+
+    if (fstat(fd, &st))
+        ret = -errno;
+    else if ((size_t) st.st_size < sizeof(*h))
+        ret = -EINVAL;
+    else
+        ret = hashlib_shm_map(shmp, fd, st.st_size, writable);
+
+    close(fd);
+
+    if (ret)
+        return ret;
+
+    h = hashlib_shm_hdr(*shmp);
+
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != HASHLIB_SHM_HEADER
+        || h->bytes != (size_t) st.st_size
+        || h->slots + h->tblsize * sizeof(uint64_t) > h->bytes) {
+        hashlib_shm_close(*shmp);
+        *shmp = NULL;
+
+        return -EINVAL;
+    }
+
+    /* the previous writer died within a change; its link is either stored
+     * or not, both leave the chains intact */
+    if (writable && (__atomic_load_n(&h->seq, __ATOMIC_ACQUIRE) & 1))
+        __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* unmaps shm, the segment stays until hashlib_shm_unlink */
+extern void hashlib_shm_close(struct hashlib_shm *shm)
+{
+    assert(shm);
+
+    munmap(shm->base, shm->bytes);
+    free(shm);
+}
+
+/* returns 0 or -errno */
+extern int hashlib_shm_unlink(const char *name)
+{
+    assert(name);
+
+    return shm_unlink(name) ? -errno : 0;
+}
+
+/* returns the entry of key, *link is where its offset is stored */
+static struct hashlib_shm_entry *hashlib_shm_find(struct hashlib_shm *shm,
+                                                  const char *key, size_t len,
+                                                  unsigned int hash,
+                                                  uint64_t **link)
+{
+    struct hashlib_shm_header *h;
+    struct hashlib_shm_entry *e;
+    uint64_t *l;
+    uint64_t offset;
+    size_t steps;
+
+    h = hashlib_shm_hdr(shm);
+    l = hashlib_shm_slots(shm) + hashlib_slot(hash, h->tblsize);
+
+    /* the bound stops a reader on a chain that changes under it */
+    for (steps = 0; steps <= h->count + 1; steps++) {
+        offset = __atomic_load_n(l, __ATOMIC_ACQUIRE);
+
+        if (!offset || offset > h->bytes - sizeof(*e))
+            break;
+
+        e = hashlib_shm_at(shm, offset);
+
+        if (e->hash == hash && e->keylen == len
+            && !memcmp(hashlib_shm_key(e), key, len)) {
+            if (link)
+                *link = l;
+
+            return e;
+        }
+
+        l = &e->next;
+    }
+
+    if (link)
+        *link = l;
+
+    return NULL;
+}
+
+/*
+ * returns the value of key and its size in *size, or NULL.  The value is
+ * never changed or reused, a later put of key stores a new one.  Lock free,
+ * safe in any process while another one writes.  A lookup that keeps
+ * overlapping changes, e.g. because the writer died within one, returns
+ * NULL with errno set to EAGAIN after HASHLIB_SHM_ATTEMPTS attempts.
+ */
+extern const void *hashlib_shm_get(struct hashlib_shm *shm, const char *key,
+                                   size_t *size)
+{
+    struct hashlib_shm_header *h;
+    struct hashlib_shm_entry *e;
+    unsigned int hash;
+    unsigned int attempt;
+    uint64_t seq;
+    size_t len;
+
+    assert(shm);
+    assert(key);
+
+    h    = hashlib_shm_hdr(shm);
+    hash = hashlib_index_len((char *) key, &len);
+
+    for (attempt = 0;; attempt++) {
+        if (attempt == HASHLIB_SHM_ATTEMPTS) {
+            errno = EAGAIN;
+            return NULL;
+        }
+
+        if (attempt) {
+            if (attempt < HASHLIB_SHM_SPINS)
+                hashlib_cpu_relax();
+            else
+                sched_yield();
+        }
+
+        seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1)
+            continue;
+
+        e = hashlib_shm_find(shm, key, len, hash, NULL);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+
+    if (!e)
+        return NULL;
+
+    if (size)
+        *size = e->size;
+
+    return hashlib_shm_value(e);
+}
+
+static inline void hashlib_shm_write_begin(struct hashlib_shm_header *h)
+{
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void hashlib_shm_write_end(struct hashlib_shm_header *h)
+{
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * stores a copy of value under key, replacing an older value; only one
+ * process may write at a time.  Returns 1 if key was added, 0 if its value
+ * was replaced, -ENOSPC if the segment is full or -EROFS if shm is read only.
+ */
+extern int hashlib_shm_put(struct hashlib_shm *shm, const char *key,
+                           const void *value, size_t size)
+{
+    struct hashlib_shm_header *h;
+    struct hashlib_shm_entry *e, *old;
+    unsigned int hash;
+    uint64_t *link;
+    uint64_t offset, bytes;
+    size_t len;
+
+    assert(shm);
+    assert(key);
+    assert(value || !size);
+
+    if (!shm->writable)
+        return -EROFS;
+
+    h     = hashlib_shm_hdr(shm);
+    hash  = hashlib_index_len((char *) key, &len);
+    bytes = hashlib_shm_entry_bytes(len, size);
+
+    if (len >= UINT32_MAX || bytes > h->bytes - h->used)
+        return -ENOSPC;
+
+    /* the new entry is written before it becomes reachable */
+    offset  = h->used;
+    e       = hashlib_shm_at(shm, offset);
+    old     = hashlib_shm_find(shm, key, len, hash, &link);
+    e->hash = hash;
+    e->size = size;
+    e->next = old ? old->next : 0;
+
+    e->keylen = len;
+    memcpy(hashlib_shm_key(e), key, len + 1);
+    memcpy(hashlib_shm_value(e), value, size);
+
+    __atomic_store_n(&h->used, h->used + bytes, __ATOMIC_RELAXED);
+
+    hashlib_shm_write_begin(h);
+    __atomic_store_n(link, offset, __ATOMIC_RELEASE);
+
+    if (old)
+        __atomic_store_n(&h->garbage, h->garbage
+                         + hashlib_shm_entry_bytes(old->keylen, old->size),
+                         __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+
+    hashlib_shm_write_end(h);
+
+    return !old;
+}
+
+/* returns 1 if key was removed, 0 if it was not found, or -EROFS */
+extern int hashlib_shm_remove(struct hashlib_shm *shm, const char *key)
+{
+    struct hashlib_shm_header *h;
+    struct hashlib_shm_entry *e;
+    unsigned int hash;
+    uint64_t *link;
+    size_t len;
+
+    assert(shm);
+    assert(key);
+
+    if (!shm->writable)
+        return -EROFS;
+
+    h    = hashlib_shm_hdr(shm);
+    hash = hashlib_index_len((char *) key, &len);
+    e    = hashlib_shm_find(shm, key, len, hash, &link);
+
+    if (!e)
+        return 0;
+
+    hashlib_shm_write_begin(h);
+    __atomic_store_n(link, e->next, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->count, h->count - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->garbage, h->garbage
+                     + hashlib_shm_entry_bytes(e->keylen, e->size),
+                     __ATOMIC_RELAXED);
+    hashlib_shm_write_end(h);
+
+    return 1;
+}
+
+extern size_t hashlib_shm_count(struct hashlib_shm *shm)
+{
+    assert(shm);
+
+    return __atomic_load_n(&hashlib_shm_hdr(shm)->count, __ATOMIC_RELAXED);
+}
+
+/* changes with every put and remove, readers can poll it for updates */
+extern uint64_t hashlib_shm_version(struct hashlib_shm *shm)
+{
+    assert(shm);
+
+    return __atomic_load_n(&hashlib_shm_hdr(shm)->seq, __ATOMIC_ACQUIRE) / 2;
+}
+
+/* garbage is what rebuilding the segment would free, readers may call it */
+extern void hashlib_shm_memory_stats(struct hashlib_shm *shm,
+                                     struct hashlib_shm_memory *m)
+{
+    struct hashlib_shm_header *h;
+
+    assert(shm);
+    assert(m);
+
+    h = hashlib_shm_hdr(shm);
+
+    m->bytes   = h->bytes;
+    m->used    = __atomic_load_n(&h->used, __ATOMIC_RELAXED);
+    m->garbage = __atomic_load_n(&h->garbage, __ATOMIC_RELAXED);
+}
+
+/*
+ * puts the entries of a file of hashlib_store into shm, values are stored
+ * as they were packed.  Returns 0, -EINVAL if filename is not a hashlib
+ * file or truncated, or the error of open, read or hashlib_shm_put.
+ */
+extern int hashlib_shm_load(struct hashlib_shm *shm, const char *filename)
+{
+    struct hashlib_stream in;
+    struct hashlib_reader *r;
+    size_t header[3];
+    size_t data_len, key_len, size;
+    ssize_t got;
+    char *buf;
+    int fd;
+    int ret;
+
+    assert(shm);
+    assert(filename);
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd == -1)
+        return -errno;
+
+    hashlib_stream_fd(&in, fd);
+
+    buf  = NULL;
+    size = 0;
+    r    = hashlib_reader_new(&in);
+    ret  = r ? hashlib_reader_get_exact(r, header, sizeof(header)) : -ENOMEM;
+
+    if (!ret && header[0] != HASHLIB_FILE_HEADER)
+        ret = -EINVAL;
+
+    /* the value, then the key behind it in the same buffer */
+    while (!ret) {
+        got = hashlib_reader_get(r, &data_len, sizeof(data_len));
+
+        if (!got)
+            break;
+
+        if (got < 0) {
+            ret = got;
+            break;
+        }
+
+        if (got != sizeof(data_len) || data_len > SIZE_MAX / 2) {
+            ret = -EINVAL;
+            break;
+        }
+
+        ret = hashlib_reserve(&buf, &size, data_len + 1);
+
+        if (!ret)
+            ret = hashlib_reader_get_exact(r, buf, data_len);
+
+        if (!ret)
+            ret = hashlib_reader_get_exact(r, &key_len, sizeof(key_len));
+
+        if (!ret && key_len > SIZE_MAX / 2)
+            ret = -EINVAL;
+
+        if (!ret)
+            ret = hashlib_reserve(&buf, &size, data_len + key_len + 1);
+
+        if (!ret)
+            ret = hashlib_reader_get_exact(r, buf + data_len, key_len);
+
+        if (ret)
+            break;
+
+        buf[data_len + key_len] = '\0';
+
+        ret = hashlib_shm_put(shm, buf + data_len, buf, data_len);
+        ret = ret < 0 ? ret : 0;
+    }
+
+    free(buf);
+
+    if (r)
+        hashlib_reader_delete(r);
+
+    close(fd);
+
+    return ret;
+}
@@ -0,0 +1,260 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Key compare and tag matching with SSE2 and AVX2.  The best variant
+ * supported by the cpu is selected at load time, so the library runs on
+ * every x86 cpu.  Other architectures use the scalar variants.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASHLIB_X86
+#endif
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* compare of up to 15 bytes with overlapping loads */
+static inline int hashlib_memeq_small(const char *p, const char *q, size_t n)
+{
+    uint64_t x, y;
+    uint32_t u, v;
+    uint16_t s, t;
+
+    if (n >= 8) {
+        memcpy(&x, p, 8);
+        memcpy(&y, q, 8);
+
+        if (x != y)
+            return 0;
+
+        memcpy(&x, p + n - 8, 8);
+        memcpy(&y, q + n - 8, 8);
+
+        return x == y;
+    }
+
+    if (n >= 4) {
+        memcpy(&u, p, 4);
+        memcpy(&v, q, 4);
+
+        if (u != v)
+            return 0;
+
+        memcpy(&u, p + n - 4, 4);
+        memcpy(&v, q + n - 4, 4);
+
+        return u == v;
+    }
+
+    if (n >= 2) {
+        memcpy(&s, p, 2);
+        memcpy(&t, q, 2);
+
+        if (s != t)
+            return 0;
+
+        return p[n - 1] == q[n - 1];
+    }
+
+    return !n || *p == *q;
+}
+
+static int hashlib_memeq_scalar(const void *a, const void *b, size_t n)
+{
+    if (n < 16)
+        return hashlib_memeq_small(a, b, n);
+
+    return !memcmp(a, b, n);
+}
+
+static uint32_t hashlib_match32_scalar(const unsigned char *tags,
+                                       unsigned char tag)
+{
+    uint32_t mask;
+    unsigned int i;
+
+    mask = 0;
+
+    for (i = 0; i < 32; i++)
+        mask |= (uint32_t) (tags[i] == tag) << i;
+
+    return mask;
+}
+
+#ifdef HASHLIB_X86
+__attribute__((target("sse2")))
+static int hashlib_memeq_sse2(const void *a, const void *b, size_t n)
+{
+    const char *p;
+    const char *q;
+    __m128i x, y;
+    size_t i;
+
+    p = a;
+    q = b;
+
+    if (n < 16)
+        return hashlib_memeq_small(p, q, n);
+
+    for (i = 0; i + 16 < n; i += 16) {
+        x = _mm_loadu_si128((const __m128i *) (p + i));
+        y = _mm_loadu_si128((const __m128i *) (q + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            return 0;
+    }
+
+    /* the last 16 bytes, overlapping with the previous block */
+    x = _mm_loadu_si128((const __m128i *) (p + n - 16));
+    y = _mm_loadu_si128((const __m128i *) (q + n - 16));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static uint32_t hashlib_match32_sse2(const unsigned char *tags,
+                                     unsigned char tag)
+{
+    __m128i t, lo, hi;
+
+    t  = _mm_set1_epi8(tag);
+    lo = _mm_loadu_si128((const __m128i *) tags);
+    hi = _mm_loadu_si128((const __m128i *) (tags + 16));
+
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(lo, t))
+           | (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(hi, t)) << 16;
+}
+
+__attribute__((target("avx2")))
+static int hashlib_memeq_avx2(const void *a, const void *b, size_t n)
+{
+    const char *p;
+    const char *q;
+    __m256i x, y;
+    size_t i;
+
+    p = a;
+    q = b;
+
+    if (n < 32)
+        return hashlib_memeq_sse2(p, q, n);
+
+    for (i = 0; i + 32 < n; i += 32) {
+        x = _mm256_loadu_si256((const __m256i *) (p + i));
+        y = _mm256_loadu_si256((const __m256i *) (q + i));
+
+        if ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y))
+            != 0xFFFFFFFF)
+            return 0;
+    }
+
+    x = _mm256_loadu_si256((const __m256i *) (p + n - 32));
+    y = _mm256_loadu_si256((const __m256i *) (q + n - 32));
+
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y))
+           == 0xFFFFFFFF;
+}
+
+__attribute__((target("avx2")))
+static uint32_t hashlib_match32_avx2(const unsigned char *tags,
+                                     unsigned char tag)
+{
+    __m256i t;
+
+    t = _mm256_loadu_si256((const __m256i *) tags);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(t, _mm256_set1_epi8(tag)));
+}
+#endif
+
+HASHLIB_INTERNAL int (*hashlib_memeq)(const void *, const void *, size_t) =
+    hashlib_memeq_scalar;
+
+HASHLIB_INTERNAL uint32_t (*hashlib_match32)(const unsigned char *,
+                                             unsigned char) =
+    hashlib_match32_scalar;
+
+HASHLIB_INTERNAL int hashlib_match_tail = 0;
+
+static int hashlib_simd_current = HASHLIB_SIMD_SCALAR;
+
+static int hashlib_simd_supported(void)
+{
+#ifdef HASHLIB_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return HASHLIB_SIMD_AVX2;
+
+    if (__builtin_cpu_supports("sse2"))
+        return HASHLIB_SIMD_SSE2;
+#endif
+
+    return HASHLIB_SIMD_SCALAR;
+}
+
+extern int hashlib_simd_level(void)
+{
+    return hashlib_simd_current;
+}
+
+extern int hashlib_set_simd_level(int level)
+{
+    int supported;
+
+    supported = hashlib_simd_supported();
+
+    if (level > supported)
+        level = supported;
+
+    switch (level) {
+#ifdef HASHLIB_X86
+    case HASHLIB_SIMD_AVX2:
+        hashlib_memeq   = hashlib_memeq_avx2;
+        hashlib_match32 = hashlib_match32_avx2;
+        break;
+    case HASHLIB_SIMD_SSE2:
+        hashlib_memeq   = hashlib_memeq_sse2;
+        hashlib_match32 = hashlib_match32_sse2;
+        break;
+#endif
+    default:
+        level           = HASHLIB_SIMD_SCALAR;
+        hashlib_memeq   = hashlib_memeq_scalar;
+        hashlib_match32 = hashlib_match32_scalar;
+    }
+
+    hashlib_simd_current = level;
+    hashlib_match_tail   = level != HASHLIB_SIMD_SCALAR;
+
+    return level;
+}
+
+__attribute__((constructor))
+static void hashlib_simd_init(void)
+{
+    hashlib_set_simd_level(HASHLIB_SIMD_AVX2);
+}
@@ -0,0 +1,355 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Buffered writing and reading of hashlib_stream sinks and sources, and the
+ * streams over file descriptors and memory buffers.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* memory of hashlib_store_buffer and source of hashlib_retrieve_buffer */
+struct hashlib_membuf {
+    char *data;
+    size_t len;
+    size_t size;
+    size_t pos;
+};
+
+extern struct hashlib_writer *hashlib_writer_new(struct hashlib_stream *out)
+{
+    struct hashlib_writer *w;
+
+    assert(out && out->write);
+
+    w = malloc(sizeof(*w));
+
+    if (!w)
+        return NULL;
+
+    w->stream = out;
+    w->len    = 0;
+
+    return w;
+}
+
+extern int hashlib_writer_flush(struct hashlib_writer *w)
+{
+    int ret;
+
+    if (!w->len)
+        return 0;
+
+    ret    = w->stream->write(w->stream->ctx, w->buf, w->len);
+    w->len = 0;
+
+    return ret;
+}
+
+/* returns 0 or -errno */
+extern int hashlib_writer_put(struct hashlib_writer *w, const void *data,
+                              size_t bytes)
+{
+    int ret;
+
+    if (w->len + bytes > sizeof(w->buf)) {
+        ret = hashlib_writer_flush(w);
+
+        if (ret)
+            return ret;
+
+        /* large records bypass the buffer */
+        if (bytes >= sizeof(w->buf))
+            return w->stream->write(w->stream->ctx, data, bytes);
+    }
+
+    memcpy(w->buf + w->len, data, bytes);
+    w->len += bytes;
+
+    return 0;
+}
+
+/* appends bytes bytes read from fd, returns -EIO if fd ends early */
+extern int hashlib_writer_put_fd(struct hashlib_writer *w, int fd, size_t bytes)
+{
+    ssize_t ret;
+    size_t n;
+
+    while (bytes) {
+        if (w->len == sizeof(w->buf) && (ret = hashlib_writer_flush(w)))
+            return ret;
+
+        n   = sizeof(w->buf) - w->len;
+        n   = n < bytes ? n : bytes;
+        ret = hashlib_try_read(fd, w->buf + w->len, n);
+
+        if (ret < 0)
+            return ret;
+
+        if ((size_t) ret != n)
+            return -EIO;
+
+        w->len += n;
+        bytes  -= n;
+    }
+
+    return 0;
+}
+
+/* frees w, flushing it first if flush is set; returns 0 or -errno */
+extern int hashlib_writer_delete(struct hashlib_writer *w, int flush)
+{
+    int ret;
+
+    ret = flush ? hashlib_writer_flush(w) : 0;
+
+    free(w);
+
+    return ret;
+}
+
+extern struct hashlib_reader *hashlib_reader_new(struct hashlib_stream *in)
+{
+    struct hashlib_reader *r;
+
+    assert(in && in->read);
+
+    r = malloc(sizeof(*r));
+
+    if (!r)
+        return NULL;
+
+    r->stream = in;
+    r->pos    = r->len = 0;
+
+    return r;
+}
+
+extern void hashlib_reader_delete(struct hashlib_reader *r)
+{
+    free(r);
+}
+
+/* returns the bytes read, less than bytes only at the end, or -errno */
+extern ssize_t hashlib_reader_get(struct hashlib_reader *r, void *buf,
+                                  size_t bytes)
+{
+    ssize_t ret;
+    size_t done, n;
+
+    for (done = 0; done < bytes; done += n) {
+        if (r->pos == r->len) {
+            /* large records bypass the buffer */
+            if (bytes - done >= sizeof(r->buf))
+                ret = r->stream->read(r->stream->ctx, (char *) buf + done,
+                                      bytes - done);
+            else
+                ret = r->stream->read(r->stream->ctx, r->buf,
+                                      sizeof(r->buf));
+
+            if (ret < 0)
+                return ret;
+
+            if (!ret)
+                break;
+
+            if (bytes - done >= sizeof(r->buf)) {
+                n = ret;
+                continue;
+            }
+
+            r->pos = 0;
+            r->len = ret;
+        }
+
+        n = r->len - r->pos;
+        n = n < bytes - done ? n : bytes - done;
+
+        memcpy((char *) buf + done, r->buf + r->pos, n);
+        r->pos += n;
+    }
+
+    return done;
+}
+
+/* reads exactly bytes bytes, returns -EINVAL at the end of the stream */
+extern int hashlib_reader_get_exact(struct hashlib_reader *r, void *buf,
+                                    size_t bytes)
+{
+    ssize_t ret;
+
+    ret = hashlib_reader_get(r, buf, bytes);
+
+    if (ret < 0)
+        return ret;
+
+    return (size_t) ret == bytes ? 0 : -EINVAL;
+}
+
+static HASHLIB_FCT_WRITE(hashlib_fd_write, ctx, data, bytes)
+{
+    return hashlib_try_write((int) (intptr_t) ctx, data, bytes);
+}
+
+static HASHLIB_FCT_READ(hashlib_fd_read, ctx, buf, bytes)
+{
+    ssize_t ret;
+
+    do {
+        ret = read((int) (intptr_t) ctx, buf, bytes);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == -1 ? -errno : ret;
+}
+
+static HASHLIB_FCT_WRITE(hashlib_membuf_write, ctx, data, bytes)
+{
+    struct hashlib_membuf *m;
+    size_t size;
+    char *p;
+
+    m = ctx;
+
+    if (m->len + bytes > m->size) {
+        for (size = m->size ? m->size : 4096; size < m->len + bytes; )
+            size *= 2;
+
+        p = realloc(m->data, size);
+
+        if (!p)
+            return -ENOMEM;
+
+        m->data = p;
+        m->size = size;
+    }
+
+    memcpy(m->data + m->len, data, bytes);
+    m->len += bytes;
+
+    return 0;
+}
+
+static HASHLIB_FCT_READ(hashlib_membuf_read, ctx, buf, bytes)
+{
+    struct hashlib_membuf *m;
+    size_t n;
+
+    m = ctx;
+    n = m->len - m->pos;
+    n = n < bytes ? n : bytes;
+
+    memcpy(buf, m->data + m->pos, n);
+    m->pos += n;
+
+    return n;
+}
+
+/* makes stream read from and write to fd */
+extern void hashlib_stream_fd(struct hashlib_stream *stream, int fd)
+{
+    assert(stream);
+    assert(fd >= 0);
+
+    stream->ctx   = (void *) (intptr_t) fd;
+    stream->write = hashlib_fd_write;
+    stream->read  = hashlib_fd_read;
+}
+
+/* fd is not closed, it may be a pipe or socket */
+extern int hashlib_store_fd(struct hashlib_hash *hash, int fd)
+{
+    struct hashlib_stream out;
+
+    hashlib_stream_fd(&out, fd);
+
+    return hashlib_store_to(hash, &out);
+}
+
+/* *data is allocated with malloc and must be freed by the caller */
+extern int hashlib_store_buffer(struct hashlib_hash *hash, void **data,
+                                size_t *len)
+{
+    struct hashlib_stream out;
+    struct hashlib_membuf m;
+    int ret;
+
+    assert(data);
+    assert(len);
+
+    memset(&m, 0, sizeof(m));
+
+    out.ctx   = &m;
+    out.write = hashlib_membuf_write;
+    out.read  = NULL;
+
+    ret = hashlib_store_to(hash, &out);
+
+    if (ret) {
+        free(m.data);
+        return ret;
+    }
+
+    *data = m.data;
+    *len  = m.len;
+
+    return 0;
+}
+
+extern int hashlib_retrieve_fd(struct hashlib_hash **hash, int fd,
+                               HASHLIB_FP_UNPACK(unpack),
+                               HASHLIB_FP_FREE(ff))
+{
+    struct hashlib_stream in;
+
+    hashlib_stream_fd(&in, fd);
+
+    return hashlib_retrieve_from(hash, &in, unpack, ff);
+}
+
+extern int hashlib_retrieve_buffer(struct hashlib_hash **hash,
+                                   const void *data, size_t len,
+                                   HASHLIB_FP_UNPACK(unpack),
+                                   HASHLIB_FP_FREE(ff))
+{
+    struct hashlib_stream in;
+    struct hashlib_membuf m;
+
+    assert(data || !len);
+
+    memset(&m, 0, sizeof(m));
+
+    m.data = (char *) data;
+    m.len  = len;
+
+    in.ctx   = &m;
+    in.write = NULL;
+    in.read  = hashlib_membuf_read;
+
+    return hashlib_retrieve_from(hash, &in, unpack, ff);
+}
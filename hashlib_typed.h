@@ -0,0 +1,416 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Type specialized tables generated by macros.
+ *
+ *     HASHLIB_DECLARE(name, key_t, val_t, hash_fn, eq_fn)
+ *
+ * declares struct name and the static inline functions name_new,
+ * name_delete, name_put, name_get, name_remove, name_next and name_count.
+ * Keys and values are stored inline in the slot array and hash_fn and
+ * eq_fn are called directly, so the compiler can inline them.  hash_fn
+ * returns an unsigned integer, it is mixed before use, so a weak hash
+ * like the identity function is fine.  eq_fn returns non-zero if both
+ * keys are equal.
+ *
+ *     HASHLIB_DECLARE_FREE(name, key_t, val_t, hash_fn, eq_fn,
+ *                          key_free, val_free)
+ *
+ * additionally calls key_free and val_free for every entry on name_delete.
+ *
+ * The tables use open addressing with groups of HASHLIB_GROUP_SIZE
+ * control bytes: every slot has a control byte which is either empty,
+ * deleted or the low seven bits of the hash of its key.  A lookup
+ * compares the control bytes of a whole group at once and only compares
+ * keys of slots with a matching tag.  hashlib_u64 and the key index of
+ * hashlib_pool are tables of this kind; struct hashlib_hash is not, it
+ * chains its entries in buckets.
+ *
+ * Functions returning int return -1 if memory could not be allocated;
+ * the table is unchanged in that case.
+ */
+
+#ifndef HASHLIB_TYPED_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hashlib.h"
+
+#define HASHLIB_TYPED_H
+
+#define HASHLIB_GROUP_SIZE 16
+
+#define HASHLIB_CTRL_EMPTY   ((unsigned char) 0x80)
+#define HASHLIB_CTRL_DELETED ((unsigned char) 0xFE)
+
+/* use as key_free or val_free if nothing needs to be freed */
+#define hashlib_typed_nofree(x) ((void) (x))
+
+/* returns a bit mask with bit i set if ctrl[i] equals c */
+static inline unsigned int hashlib_group_match(const unsigned char *ctrl,
+                                               unsigned char c)
+{
+#ifdef __SSE2__
+    __m128i group;
+
+    group = _mm_loadu_si128((const __m128i *) ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    unsigned int mask;
+    unsigned int i;
+
+    mask = 0;
+
+    for (i = 0; i < HASHLIB_GROUP_SIZE; i++)
+        mask |= (unsigned int) (ctrl[i] == c) << i;
+
+    return mask;
+#endif
+}
+
+/* returns a bit mask of the empty and deleted slots of a group */
+static inline unsigned int hashlib_group_match_free(const unsigned char *ctrl)
+{
+#ifdef __SSE2__
+    /* the high bit is only set in empty and deleted control bytes */
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+    unsigned int mask;
+    unsigned int i;
+
+    mask = 0;
+
+    for (i = 0; i < HASHLIB_GROUP_SIZE; i++)
+        mask |= (unsigned int) (ctrl[i] >> 7) << i;
+
+    return mask;
+#endif
+}
+
+/* finalizer of MurmurHash3 */
+static inline uint64_t hashlib_typed_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* the string hash of hashlib_index, for tables with string keys */
+static inline uint64_t hashlib_typed_string_hash(const char *key)
+{
+    unsigned int index;
+
+    index = 0;
+
+    while (*key) {
+        index = 5 * index + *key;
+        key++;
+    }
+
+    return index;
+}
+
+static inline int hashlib_typed_string_equal(const char *a, const char *b)
+{
+    return !strcmp(a, b);
+}
+
+/* number of slots needed for size entries, a power of two */
+static inline size_t hashlib_typed_capacity(size_t size)
+{
+    size_t capacity;
+
+    capacity = HASHLIB_GROUP_SIZE;
+
+    /* the maximum load factor is 7/8 */
+    while (capacity - capacity / 8 < size)
+        capacity *= 2;
+
+    return capacity;
+}
+
+#define HASHLIB_DECLARE(name, key_t, val_t, hash_fn, eq_fn) \
+        HASHLIB_DECLARE_FREE(name, key_t, val_t, hash_fn, eq_fn, \
+                             hashlib_typed_nofree, hashlib_typed_nofree)
+
+#define HASHLIB_DECLARE_FREE(name, key_t, val_t, hash_fn, eq_fn,             \
+                             key_free, val_free)                             \
+                                                                             \
+struct name##_slot {                                                         \
+    key_t key;                                                               \
+    val_t value;                                                             \
+};                                                                           \
+                                                                             \
+struct name {                                                                \
+    unsigned char *ctrl;                                                     \
+    struct name##_slot *slot;                                                \
+    size_t capacity;                                                         \
+    size_t count;                                                            \
+    size_t growth_left;                                                      \
+};                                                                           \
+                                                                             \
+static inline size_t name##_count(struct name *t)                            \
+{                                                                            \
+    return t->count;                                                         \
+}                                                                            \
+                                                                             \
+static inline int name##_init(struct name *t, size_t capacity)               \
+{                                                                            \
+    t->ctrl = malloc(capacity);                                              \
+    t->slot = malloc(capacity * sizeof(*(t->slot)));                         \
+                                                                             \
+    if (!t->ctrl || !t->slot) {                                              \
+        free(t->ctrl);                                                       \
+        free(t->slot);                                                       \
+        return -1;                                                           \
+    }                                                                        \
+                                                                             \
+    memset(t->ctrl, HASHLIB_CTRL_EMPTY, capacity);                           \
+                                                                             \
+    t->capacity    = capacity;                                               \
+    t->count       = 0;                                                      \
+    t->growth_left = capacity - capacity / 8;                                \
+                                                                             \
+    return 0;                                                                \
+}                                                                            \
+                                                                             \
+static inline struct name *name##_new(size_t size)                           \
+{                                                                            \
+    struct name *t;                                                          \
+                                                                             \
+    if (size > HASHLIB_MAX_TBLSIZE)                                          \
+        return NULL;                                                         \
+                                                                             \
+    t = malloc(sizeof(*t));                                                  \
+                                                                             \
+    if (!t)                                                                  \
+        return NULL;                                                         \
+                                                                             \
+    if (name##_init(t, hashlib_typed_capacity(size)) == -1) {                \
+        free(t);                                                             \
+        return NULL;                                                         \
+    }                                                                        \
+                                                                             \
+    return t;                                                                \
+}                                                                            \
+                                                                             \
+/* returns the next used slot at or after *pos, NULL at the end */           \
+static inline struct name##_slot *name##_next(struct name *t, size_t *pos)   \
+{                                                                            \
+    for (; *pos < t->capacity; (*pos)++)                                     \
+        if (!(t->ctrl[*pos] & 0x80))                                         \
+            return &(t->slot[(*pos)++]);                                     \
+                                                                             \
+    return NULL;                                                             \
+}                                                                            \
+                                                                             \
+static inline void name##_delete(struct name *t)                             \
+{                                                                            \
+    struct name##_slot *s;                                                   \
+    size_t pos;                                                              \
+                                                                             \
+    pos = 0;                                                                 \
+                                                                             \
+    while ((s = name##_next(t, &pos))) {                                     \
+        key_free(s->key);                                                    \
+        val_free(s->value);                                                  \
+    }                                                                        \
+                                                                             \
+    free(t->ctrl);                                                           \
+    free(t->slot);                                                           \
+    free(t);                                                                 \
+}                                                                            \
+                                                                             \
+/* returns the slot of key or (size_t) -1 */                                 \
+static inline size_t name##_find(struct name *t, key_t key, uint64_t h)      \
+{                                                                            \
+    const unsigned char *ctrl;                                               \
+    size_t group, groups, i;                                                 \
+    unsigned int match;                                                      \
+    unsigned int j;                                                          \
+                                                                             \
+    groups = t->capacity / HASHLIB_GROUP_SIZE;                               \
+    group  = (h >> 7) & (groups - 1);                                        \
+                                                                             \
+    for (i = 1; ; i++) {                                                     \
+        ctrl  = t->ctrl + group * HASHLIB_GROUP_SIZE;                        \
+        match = hashlib_group_match(ctrl, h & 0x7F);                         \
+                                                                             \
+        while (match) {                                                      \
+            j = __builtin_ctz(match);                                        \
+                                                                             \
+            if (eq_fn(t->slot[group * HASHLIB_GROUP_SIZE + j].key, key))     \
+                return group * HASHLIB_GROUP_SIZE + j;                       \
+                                                                             \
+            match &= match - 1;                                              \
+        }                                                                    \
+                                                                             \
+        if (hashlib_group_match(ctrl, HASHLIB_CTRL_EMPTY) || i > groups)     \
+            return (size_t) -1;                                              \
+                                                                             \
+        /* triangular probing visits every group */                          \
+        group = (group + i) & (groups - 1);                                  \
+    }                                                                        \
+}                                                                            \
+                                                                             \
+/* returns the first empty or deleted slot in the probe sequence of h */     \
+static inline size_t name##_find_free(struct name *t, uint64_t h)            \
+{                                                                            \
+    size_t group, groups, i;                                                 \
+    unsigned int match;                                                      \
+                                                                             \
+    groups = t->capacity / HASHLIB_GROUP_SIZE;                               \
+    group  = (h >> 7) & (groups - 1);                                        \
+                                                                             \
+    for (i = 1; ; i++) {                                                     \
+        match = hashlib_group_match_free(t->ctrl                             \
+                                         + group * HASHLIB_GROUP_SIZE);      \
+                                                                             \
+        if (match)                                                           \
+            return group * HASHLIB_GROUP_SIZE + __builtin_ctz(match);        \
+                                                                             \
+        group = (group + i) & (groups - 1);                                  \
+    }                                                                        \
+}                                                                            \
+                                                                             \
+/* moves all entries into a table of the given capacity */                   \
+static inline int name##_rehash(struct name *t, size_t capacity)             \
+{                                                                            \
+    struct name##_slot *s;                                                   \
+    struct name n;                                                           \
+    size_t pos, i;                                                           \
+    uint64_t h;                                                              \
+                                                                             \
+    if (name##_init(&n, capacity) == -1)                                     \
+        return -1;                                                           \
+                                                                             \
+    pos = 0;                                                                 \
+                                                                             \
+    while ((s = name##_next(t, &pos))) {                                     \
+        h = hashlib_typed_mix(hash_fn(s->key));                              \
+        i = name##_find_free(&n, h);                                         \
+                                                                             \
+        n.ctrl[i] = h & 0x7F;                                                \
+        n.slot[i] = *s;                                                      \
+    }                                                                        \
+                                                                             \
+    n.count       = t->count;                                                \
+    n.growth_left = n.growth_left - t->count;                                \
+                                                                             \
+    free(t->ctrl);                                                           \
+    free(t->slot);                                                           \
+                                                                             \
+    *t = n;                                                                  \
+                                                                             \
+    return 0;                                                                \
+}                                                                            \
+                                                                             \
+static inline val_t *name##_get(struct name *t, key_t key)                   \
+{                                                                            \
+    size_t i;                                                                \
+                                                                             \
+    i = name##_find(t, key, hashlib_typed_mix(hash_fn(key)));                \
+                                                                             \
+    if (i == (size_t) -1)                                                    \
+        return NULL;                                                         \
+                                                                             \
+    return &(t->slot[i].value);                                              \
+}                                                                            \
+                                                                             \
+/* returns 1 if key was inserted and 0 if it is already in the table */      \
+static inline int name##_put(struct name *t, key_t key, val_t value)         \
+{                                                                            \
+    uint64_t h;                                                              \
+    size_t i, capacity;                                                      \
+                                                                             \
+    h = hashlib_typed_mix(hash_fn(key));                                     \
+                                                                             \
+    if (name##_find(t, key, h) != (size_t) -1)                               \
+        return 0;                                                            \
+                                                                             \
+    if (!t->growth_left) {                                                   \
+        /* grow unless most of the used slots are deleted entries */         \
+        capacity = t->capacity;                                              \
+                                                                             \
+        if (t->count >= capacity / 2 - capacity / 16)                        \
+            capacity *= 2;                                                   \
+                                                                             \
+        if (name##_rehash(t, capacity) == -1)                                \
+            return -1;                                                       \
+    }                                                                        \
+                                                                             \
+    i = name##_find_free(t, h);                                              \
+                                                                             \
+    if (t->ctrl[i] == HASHLIB_CTRL_EMPTY)                                    \
+        t->growth_left--;                                                    \
+                                                                             \
+    t->ctrl[i]       = h & 0x7F;                                             \
+    t->slot[i].key   = key;                                                  \
+    t->slot[i].value = value;                                                \
+    t->count++;                                                              \
+                                                                             \
+    return 1;                                                                \
+}                                                                            \
+                                                                             \
+/* returns 1 and stores key and value of the removed entry if key was in     \
+ * the table, the caller is responsible for freeing them */                  \
+static inline int name##_remove(struct name *t, key_t key, key_t *old_key,   \
+                                val_t *old_value)                            \
+{                                                                            \
+    size_t i, group;                                                         \
+                                                                             \
+    i = name##_find(t, key, hashlib_typed_mix(hash_fn(key)));                \
+                                                                             \
+    if (i == (size_t) -1)                                                    \
+        return 0;                                                            \
+                                                                             \
+    if (old_key)                                                             \
+        *old_key = t->slot[i].key;                                           \
+                                                                             \
+    if (old_value)                                                           \
+        *old_value = t->slot[i].value;                                       \
+                                                                             \
+    group = i - i % HASHLIB_GROUP_SIZE;                                      \
+                                                                             \
+    /* no probe sequence continues behind a group with an empty slot */      \
+    if (hashlib_group_match(t->ctrl + group, HASHLIB_CTRL_EMPTY)) {          \
+        t->ctrl[i] = HASHLIB_CTRL_EMPTY;                                     \
+        t->growth_left++;                                                    \
+    } else {                                                                 \
+        t->ctrl[i] = HASHLIB_CTRL_DELETED;                                   \
+    }                                                                        \
+                                                                             \
+    t->count--;                                                              \
+                                                                             \
+    return 1;                                                                \
+}
+
+#endif
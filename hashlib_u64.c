@@ -0,0 +1,278 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * Tables with 64 bit integer keys.  The keys are stored inline in a table
+ * generated by HASHLIB_DECLARE, so there is no key allocation and a key
+ * compare is a single integer compare.  free, size and pack functions are
+ * kept per table and not per entry.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+#include "hashlib_typed.h"
+
+/* the generated table mixes the key */
+#define hashlib_u64_hash(key)      (key)
+#define hashlib_u64_equal(a, b)    ((a) == (b))
+
+HASHLIB_DECLARE(hashlib_u64_tbl, uint64_t, void *, hashlib_u64_hash,
+                hashlib_u64_equal)
+
+extern struct hashlib_u64 *hashlib_u64_new(size_t size)
+{
+    struct hashlib_u64 *hash;
+
+    if (size > HASHLIB_MAX_TBLSIZE)
+        diefx("table size too big");
+
+    if (size <= 0)
+        diefx("table size must be greater than zero");
+
+    hash      = hashlib_calloc(1, sizeof(*hash));
+    hash->tbl = hashlib_u64_tbl_new(size);
+
+    if (!hash->tbl)
+        dief("hashlib_u64_tbl_new");
+
+    hash->size_function = hashlib_default_size_function;
+    hash->pack_function = hashlib_default_pack_function;
+
+    return hash;
+}
+
+extern void hashlib_u64_set_free_function(struct hashlib_u64 *hash,
+                                          HASHLIB_FP_FREE(free_function))
+{
+    assert(hash);
+    hash->free_function = free_function;
+}
+
+extern void hashlib_u64_set_size_function(struct hashlib_u64 *hash,
+                                          HASHLIB_FP_SIZE(size_function))
+{
+    assert(hash);
+    hash->size_function = size_function;
+}
+
+extern void hashlib_u64_set_pack_function(struct hashlib_u64 *hash,
+                                          HASHLIB_FP_PACK(pack_function))
+{
+    assert(hash);
+    hash->pack_function = pack_function;
+}
+
+extern int hashlib_u64_put(struct hashlib_u64 *hash, uint64_t key,
+                           void *value)
+{
+    int ret;
+
+    assert(hash);
+    assert(value);
+
+    ret = hashlib_u64_tbl_put(hash->tbl, key, value);
+
+    if (ret == -1)
+        dief("hashlib_u64_tbl_put");
+
+    if (!ret) {
+        /* already in hash, the new value is discarded */
+        if (hash->free_function)
+            hash->free_function(value);
+
+        return 0;
+    }
+
+    hash->count++;
+
+    return 1;
+}
+
+extern void *hashlib_u64_get(struct hashlib_u64 *hash, uint64_t key)
+{
+    void **value;
+
+    assert(hash);
+
+    value = hashlib_u64_tbl_get(hash->tbl, key);
+
+    if (!value)
+        return NULL;
+
+    return *value;
+}
+
+extern void *hashlib_u64_remove(struct hashlib_u64 *hash, uint64_t key)
+{
+    void *value;
+
+    assert(hash);
+
+    if (!hashlib_u64_tbl_remove(hash->tbl, key, NULL, &value))
+        return NULL;
+
+    if (hash->free_function)
+        hash->free_function(value);
+
+    hash->count--;
+
+    return value;
+}
+
+extern void hashlib_u64_delete(struct hashlib_u64 *hash)
+{
+    struct hashlib_u64_tbl_slot *s;
+    size_t pos;
+
+    assert(hash);
+
+    pos = 0;
+
+    if (hash->free_function)
+        while ((s = hashlib_u64_tbl_next(hash->tbl, &pos)))
+            hash->free_function(s->value);
+
+    hashlib_u64_tbl_delete(hash->tbl);
+    free(hash);
+}
+
+/*
+ * file format, like the one of hashlib_store with the key stored as
+ * uint64_t instead of length and string:
+ * header, number of slots, count, then size, data and key of every entry
+ */
+extern void hashlib_u64_store(struct hashlib_u64 *hash, const char *filename)
+{
+    struct hashlib_u64_tbl *tbl;
+    struct hashlib_u64_tbl_slot *s;
+    size_t h;
+    size_t pos;
+    size_t bytes;
+    int fd;
+
+    assert(hash);
+    assert(filename);
+
+    tbl = hash->tbl;
+    fd  = hashlib_open(filename, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+    h   = HASHLIB_U64_FILE_HEADER;
+
+    hashlib_write(fd, &h, sizeof(h));
+    hashlib_write(fd, &(tbl->capacity), sizeof(tbl->capacity));
+    hashlib_write(fd, &(hash->count), sizeof(hash->count));
+
+    pos = 0;
+
+    while ((s = hashlib_u64_tbl_next(tbl, &pos))) {
+        bytes = hash->size_function(s->value);
+
+        hashlib_write(fd, &bytes, sizeof(bytes));
+        hash->pack_function(s->value, bytes, fd);
+        hashlib_write(fd, &(s->key), sizeof(s->key));
+    }
+
+    hashlib_close(fd);
+}
+
+extern struct hashlib_u64 *hashlib_u64_retrieve(const char *filename,
+                                                HASHLIB_FP_UNPACK(unpack),
+                                                HASHLIB_FP_FREE(ff))
+{
+    struct hashlib_u64 *hash;
+    size_t tblsize;
+    size_t count;
+    size_t h;
+    size_t size;
+    size_t data_len;
+    size_t ret;
+    uint64_t key;
+    int fd;
+    void *data;
+    void *value;
+
+    size = sizeof(size_t);
+
+    if (!unpack)
+        unpack = hashlib_default_unpack_function;
+
+    fd = hashlib_open(filename, O_RDONLY, 0);
+
+    ret = hashlib_read(fd, &h, size);
+
+    if (ret != size)
+        diefx("%s: unable to read filetype", filename);
+
+    if (h != HASHLIB_U64_FILE_HEADER)
+        diefx("%s: not a hashlib_u64 file", filename);
+
+    ret = hashlib_read(fd, &tblsize, size);
+
+    if (ret != size)
+        diefx("%s: unable to read table size", filename);
+
+    ret = hashlib_read(fd, &count, size);
+
+    if (ret != size)
+        diefx("%s: unable to read entry count", filename);
+
+    /* the stored table size is a capacity, size for count entries */
+    hash = hashlib_u64_new(count ? count : 1);
+
+    hashlib_u64_set_free_function(hash, ff);
+
+    while ((ret = hashlib_read(fd, &data_len, size))) {
+        if (ret != size)
+            diefx("%s: unable to read size of data", filename);
+
+        data = hashlib_calloc(1, data_len);
+
+        ret = hashlib_read(fd, data, data_len);
+
+        if (ret != data_len)
+            diefx("%s: unable to read data", filename);
+
+        ret = hashlib_read(fd, &key, sizeof(key));
+
+        if (ret != sizeof(key))
+            diefx("%s: unable to read key", filename);
+
+        value = unpack(data, data_len);
+
+        if (!value)
+            diefx("%s: unable to unpack data", filename);
+
+        hashlib_u64_put(hash, key, value);
+
+        free(data);
+    }
+
+    hashlib_close(fd);
+
+    return hash;
+}
@@ -0,0 +1,100 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "proc_status.h"
+
+static unsigned long read_value(char *line)
+{
+    size_t len;
+
+    while (*line && !isdigit(*line))
+        line++;
+
+    len = strlen(line);
+
+    /* cut off ' kB' */
+    if (len >= 3)
+        line[len - 3] = '\0';
+
+    return strtoul(line, NULL, 10);
+}
+
+/* returns the value of field (e.g. "VmRSS:") of /proc/self/status in bytes */
+unsigned long read_status(const char *field)
+{
+    FILE* file;
+    unsigned long result;
+    size_t len;
+    char line[BUFSIZ];
+
+    result = 0;
+    len    = strlen(field);
+    file   = fopen("/proc/self/status", "r");
+
+    if (!file)
+        err(EXIT_FAILURE, "fopen");
+
+    while (fgets(line, BUFSIZ, file)) {
+        if (!strncmp(line, field, len)) {
+            result = read_value(line + len);
+            break;
+        }
+    }
+
+    if (fclose(file) == EOF)
+        err(EXIT_FAILURE, "fclose");
+
+    return result * 1024L;
+}
+
+unsigned long read_VmRSS(void)
+{
+    return read_status("VmRSS:");
+}
+
+/* peak resident set size */
+unsigned long read_VmHWM(void)
+{
+    return read_status("VmHWM:");
+}
+
+/* resets the peak resident set size, returns -1 if not supported */
+int reset_VmHWM(void)
+{
+    FILE *file;
+    int ret;
+
+    file = fopen("/proc/self/clear_refs", "w");
+
+    if (!file)
+        return -1;
+
+    ret = fputs("5", file) == EOF ? -1 : 0;
+
+    if (fclose(file) == EOF)
+        ret = -1;
+
+    return ret;
+}
@@ -0,0 +1,29 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+#ifndef HASHLIB_PROC_STATUS_H
+
+#define HASHLIB_PROC_STATUS_H
+
+unsigned long read_status(const char *field);
+unsigned long read_VmRSS(void);
+unsigned long read_VmHWM(void);
+int reset_VmHWM(void);
+
+#endif
@@ -17,17 +17,21 @@
     with hashlib; if not, see <http://www.gnu.org/licenses>.
 ***/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <err.h>
-#include <ctype.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <sys/wait.h>
 
 #include "hashlib.h"
+#include "hashlib_typed.h"
+#include "proc_status.h"
 
 #define put(str) fputs((str), stdout)
 
@@ -45,46 +49,6 @@ struct xy {
     int y;
 };
 
-int read_value(char *line)
-{
-    size_t len;
-
-    while (!isdigit(*line))
-        line++;
-
-    len = strlen(line);
-
-    /* cut off ' kb' */
-    line[len - 3] = '\0';
-
-    return atoi(line);
-}
-
-unsigned long read_VmRSS(void)
-{
-    FILE* file;
-    unsigned long result;
-    char line[BUFSIZ];
-
-    result = 0;
-    file   = fopen("/proc/self/status", "r");
-
-    if (!file)
-        err(EXIT_FAILURE, "fopen");
-
-    while (fgets(line, BUFSIZ, file)) {
-        if (!strncmp(line, "VmRSS:", 6)) {
-            result = read_value(line);
-            break;
-        }
-    }
-
-    if (fclose(file) == EOF)
-        err(EXIT_FAILURE, "fclose");
-
-    return result * 1024L;
-}
-
 unsigned long get_VmRSS(void)
 {
     unsigned long old, value;
@@ -290,73 +254,114 @@ void test_hashlib_hash_delete(void)
         success();
 }
 
-void random_string(char *str, size_t len)
+size_t xy_size(void *a)
 {
-    size_t i, alnumlen;
-    static char alnum[] =
-        "1234567890"
-        "abcdefghijklmnopqrstuvwxyz"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    (void) a;
 
-    alnumlen = strlen(alnum);
-
-    for (i = 0; i < len - 1; i++)
-        str[i] = alnum[rand() % alnumlen];
-
-    str[len - 1] = '\0';
+    return sizeof(struct xy);
 }
 
-void test_1mio_entries(void)
+void test_hashlib_memory_usage(void)
 {
-    unsigned int count, i;
-    struct translation **arr;
     struct hashlib_hash *hash;
-    char str[32];
-    struct timeval start, end;
-    long sec, usec;
+    struct hashlib_memory m;
+    struct xy a, b;
+    size_t empty;
 
-    count = 1000000;
+    TEST("hashlib_memory_usage");
 
-    hash = hashlib_hash_new(3000000);
-    hashlib_set_free_function(hash, translation_delete);
+    hash = hashlib_hash_new(1000);
 
-    arr = calloc(count, sizeof(*arr));
+    hashlib_set_size_function(hash, xy_size);
+    hashlib_set_value_accounting(hash, 1);
 
-    if (!arr)
-        err(EXIT_FAILURE, "calloc");
+    empty = hashlib_memory_usage(hash);
 
-    TEST("duration for 1 mio. entries");
+    hashlib_put(hash, "one", &a);
+    hashlib_put(hash, "three", &b);
 
-    for (i = 0; i < count; i++) {
-        random_string(str, 32);
+    hashlib_memory_stats(hash, &m);
 
-        arr[i]          = translation_new();
-        arr[i]->english = strdup(str);
-    }
+    if (m.keys != 4 + 6 || m.values != 2 * sizeof(struct xy))
+        goto fail;
 
-    gettimeofday(&start, NULL);
+    if (m.entries == 0 || m.buckets == 0 || m.slots < 1000 * sizeof(void *))
+        goto fail;
 
-    for (i = 0; i < count; i++)
-        hashlib_put(hash, arr[i]->english, arr[i]);
+    if (hashlib_memory_usage(hash) <= empty)
+        goto fail;
 
-    for (i = 0; i < count; i++)
-        hashlib_get(hash, arr[i]->english);
+    hashlib_remove(hash, "one");
+    hashlib_remove(hash, "three");
+
+    if (hashlib_memory_usage(hash) != empty)
+        goto fail;
+
+    hashlib_hash_delete(hash);
+    success();
+    return;
+
+fail:
+    hashlib_hash_delete(hash);
+    failed();
+}
+
+void test_hashlib_build(void)
+{
+    const size_t count = 10000;
+    struct hashlib_hash *hash, *unique;
+    char **keys;
+    void **values;
+    size_t i, inserted;
+    int ok;
+
+    TEST("hashlib_build");
+
+    keys   = calloc(count, sizeof(*keys));
+    values = calloc(count, sizeof(*values));
 
-    gettimeofday(&end, NULL);
+    if (!keys || !values)
+        err(EXIT_FAILURE, "calloc");
 
-    sec  = end.tv_sec  - start.tv_sec;
-    usec = end.tv_usec - start.tv_usec;
+    /* every key is given twice */
+    for (i = 0; i < count; i++) {
+        if (asprintf(&keys[i], "key%zu", i % (count / 2)) == -1)
+            err(EXIT_FAILURE, "asprintf");
 
-    if (usec < 0) {
-        usec += 1000000;
-        sec--;
+        values[i] = &keys[i];
     }
 
-    printf("%ld.%ld sec.\n", sec, usec);
+    hash   = hashlib_hash_new(10);
+    unique = hashlib_hash_new(count);
+
+    inserted = hashlib_build(hash, keys, values, count, 4, 0);
+    hashlib_build(unique, keys, values, count / 2, 1, HASHLIB_BUILD_UNIQUE);
+
+    ok = inserted == count / 2 && hashlib_count(hash) == count / 2
+         && hashlib_count(unique) == count / 2 && hash->tblsize >= count;
+
+    for (i = 0; ok && i < count / 2; i++)
+        ok = hashlib_get(hash, keys[i]) == values[i]
+             && hashlib_get(unique, keys[i]) == values[i];
+
+    if (ok)
+        ok = hashlib_put(hash, "key1", values[0]) == 0
+             && hashlib_remove(hash, "key1") == values[1]
+             && hashlib_count(hash) == count / 2 - 1;
 
     hashlib_hash_delete(hash);
+    hashlib_hash_delete(unique);
+
+    for (i = 0; i < count; i++)
+        free(keys[i]);
 
-    free(arr);
+    free(keys);
+    free(values);
+
+    if (ok)
+        success();
+    else
+        failed();
 }
 
 void test_hashlib_store(void)
@@ -371,24 +376,24 @@ void test_hashlib_store(void)
     const char *fname = "store.hashlib";
     size_t compare[19] = {
             0xB011544A,
-            0x3F1,
+            0x400,
             0x5,
             0x8,
-            0x100000000,
+            0x700000006,
             0x1,
-            0x831,
-            0x30000000200,
+            0x834,
+            0x10000000000,
             0x100,
-            0x83200,
+            0x83100,
             0x5000000040000,
             0x10000,
             0x8330000,
-            0x700000006000000,
+            0x900000008000000,
             0x1000000,
-            0x834000000,
-            0x800000000,
-            0x100000009,
-            0x3500000000,
+            0x835000000,
+            0x200000000,
+            0x100000003,
+            0x3200000000,
         };
 
     TEST("hashlib_store");
@@ -507,6 +512,1859 @@ fail:
     failed();
 }
 
+/* files of older versions store the table size they were created with */
+void test_hashlib_retrieve_legacy(void)
+{
+    struct hashlib_hash *hash;
+    const char *fname = "legacy.hashlib";
+    size_t header[3] = { 0xB011544A, 1009, 100 };
+    char key[16];
+    size_t len;
+    int i, fd, ok;
+
+    TEST("hashlib_retrieve, legacy table size");
+
+    fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd != -1 && write(fd, header, sizeof(header)) == sizeof(header);
+
+    for (i = 0; ok && i < 100; i++) {
+        len = sizeof(i);
+        ok  = write(fd, &len, sizeof(len)) == sizeof(len)
+              && write(fd, &i, len) == (ssize_t) len;
+
+        len = sprintf(key, "key%d", i);
+        ok  = ok && write(fd, &len, sizeof(len)) == sizeof(len)
+              && write(fd, key, len) == (ssize_t) len;
+    }
+
+    if (fd != -1)
+        close(fd);
+
+    if (!ok) {
+        unlink(fname);
+        failed();
+        return;
+    }
+
+    hash = hashlib_retrieve(fname, NULL, free);
+
+    ok = hashlib_count(hash) == 100 && hash->tblsize == 1024;
+
+    for (i = 0; ok && i < 100; i++) {
+        sprintf(key, "key%d", i);
+        ok = *(int *) hashlib_get(hash, key) == i;
+    }
+
+    hashlib_hash_delete(hash);
+    unlink(fname);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_freeze(void)
+{
+    struct translation example;
+    struct hashlib_hash *hash, *clone;
+    struct hashlib_frozen *frozen;
+    char key[32];
+    int i, j, ok;
+
+    TEST("hashlib_freeze");
+
+    example.english = "horse";
+    example.german  = "Pferd";
+    example.latin   = "equus";
+    example.french  = "cheval";
+
+    hash = hashlib_hash_new(100);
+
+    hashlib_put(hash, "horse",  &example);
+    hashlib_put(hash, "Pferd",  &example);
+    hashlib_put(hash, "equus",  &example);
+    hashlib_put(hash, "cheval", &example);
+
+    for (i = 0; i < 10000; i++) {
+        sprintf(key, "key%d", i);
+        hashlib_put(hash, key, &example.english);
+    }
+
+    frozen = hashlib_freeze(hash);
+
+    ok = hashlib_frozen_count(frozen) == 10004
+         && hashlib_frozen_get(frozen, "horse") == &example
+         && hashlib_frozen_get(frozen, "Pferd") == &example
+         && hashlib_frozen_get(frozen, "equus") == &example
+         && hashlib_frozen_get(frozen, "cheval") == &example
+         && !hashlib_frozen_get(frozen, "cavallo");
+
+    for (i = 0; ok && i < 10000; i++) {
+        sprintf(key, "key%d", i);
+        ok = hashlib_frozen_get(frozen, key) == &example.english;
+    }
+
+    hashlib_frozen_delete(frozen);
+
+    /* a mapped slot array, with buckets and entries shared by a clone that
+     * keeps their values; the clone is deleted first, then the frozen table
+     * and the other way round */
+    for (j = 0; j < 2; j++) {
+        hash = hashlib_hash_new(1 << 20);
+        hashlib_set_free_function(hash, free);
+
+        for (i = 0; i < 1000; i++) {
+            sprintf(key, "key%d", i);
+            hashlib_put(hash, key, strdup(key));
+        }
+
+        clone = hashlib_clone(hash);
+
+        /* an entry and a key of hash only */
+        hashlib_replace(hash, "key3", strdup("three"));
+        hashlib_put(hash, "key1000", strdup("key1000"));
+
+        frozen = hashlib_freeze(hash);
+
+        ok = ok && hashlib_frozen_count(frozen) == 1001
+             && !strcmp(hashlib_frozen_get(frozen, "key7"), "key7")
+             && !strcmp(hashlib_frozen_get(frozen, "key3"), "three")
+             && !strcmp(hashlib_frozen_get(frozen, "key1000"), "key1000")
+             && hashlib_get(clone, "key7")
+                == hashlib_frozen_get(frozen, "key7");
+
+        if (!j) {
+            hashlib_hash_delete(clone);
+            ok = ok && !strcmp(hashlib_frozen_get(frozen, "key7"), "key7");
+            hashlib_frozen_delete(frozen);
+            continue;
+        }
+
+        hashlib_frozen_delete(frozen);
+
+        ok = ok && hashlib_count(clone) == 1000
+             && !strcmp(hashlib_get(clone, "key3"), "key3")
+             && !hashlib_get(clone, "key1000");
+
+        for (i = 0; ok && i < 1000; i++) {
+            sprintf(key, "key%d", i);
+            ok = !strcmp(hashlib_get(clone, key), key);
+        }
+
+        hashlib_hash_delete(clone);
+    }
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_frozen_retrieve(void)
+{
+    const int count = 5;
+    struct hashlib_hash *hash;
+    struct hashlib_frozen *frozen;
+    struct xy values[count];
+    struct xy *p;
+    const char *fname = "frozen.hashlib";
+    char key[2];
+    int i, ok;
+
+    TEST("hashlib_frozen_retrieve");
+
+    hash = hashlib_hash_new(10);
+
+    for (i = 0; i < count; i++) {
+        values[i].x = i * 2;
+        values[i].y = i * 2 + 1;
+
+        sprintf(key, "%d", i + 1);
+        hashlib_put(hash, key, &values[i]);
+    }
+
+    frozen = hashlib_freeze(hash);
+    hashlib_frozen_store(frozen, fname);
+    hashlib_frozen_delete(frozen);
+
+    frozen = hashlib_frozen_retrieve(fname, NULL, free);
+
+    ok = hashlib_frozen_count(frozen) == (size_t) count
+         && !hashlib_frozen_get(frozen, "0");
+
+    for (i = 0; ok && i < count; i++) {
+        sprintf(key, "%d", i + 1);
+        p  = hashlib_frozen_get(frozen, key);
+        ok = p && p->x == i * 2 && p->y == i * 2 + 1;
+    }
+
+    hashlib_frozen_delete(frozen);
+    unlink(fname);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+static inline uint64_t int_hash(int key)
+{
+    return key;
+}
+
+static inline int int_equal(int a, int b)
+{
+    return a == b;
+}
+
+HASHLIB_DECLARE(xy_table, int, struct xy, int_hash, int_equal)
+
+HASHLIB_DECLARE_FREE(string_table, char *, int, hashlib_typed_string_hash,
+                     hashlib_typed_string_equal, free, hashlib_typed_nofree)
+
+void test_hashlib_typed(void)
+{
+    const int count = 100000;
+    struct xy_table *t;
+    struct string_table *s;
+    struct xy v, *p;
+    char *key;
+    int i, ok;
+
+    TEST("HASHLIB_DECLARE");
+
+    t = xy_table_new(10);
+    s = string_table_new(10);
+
+    if (!t || !s)
+        err(EXIT_FAILURE, "xy_table_new");
+
+    ok = 1;
+
+    for (i = 0; ok && i < count; i++) {
+        v.x = i;
+        v.y = -i;
+        ok  = xy_table_put(t, i, v) == 1;
+    }
+
+    ok = ok && xy_table_put(t, 0, v) == 0 && xy_table_count(t) == (size_t) count;
+
+    /* remove every second key, with deleted slots left behind */
+    for (i = 0; ok && i < count; i += 2)
+        ok = xy_table_remove(t, i, NULL, &v) == 1 && v.x == i;
+
+    for (i = 0; ok && i < count; i++) {
+        p  = xy_table_get(t, i);
+        ok = i % 2 ? p && p->x == i && p->y == -i : !p;
+    }
+
+    /* reuse the deleted slots */
+    for (i = 0; ok && i < count; i += 2)
+        ok = xy_table_put(t, i, v) == 1;
+
+    ok = ok && xy_table_count(t) == (size_t) count && !xy_table_get(t, count);
+
+    for (i = 0; ok && i < 1000; i++) {
+        if (asprintf(&key, "key%d", i) == -1)
+            err(EXIT_FAILURE, "asprintf");
+
+        ok = string_table_put(s, key, i) == 1;
+    }
+
+    ok = ok && *string_table_get(s, "key42") == 42
+         && !string_table_get(s, "key1000");
+
+    xy_table_delete(t);
+    string_table_delete(s);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_u64(void)
+{
+    const uint64_t count = 100000;
+    struct hashlib_u64 *hash;
+    struct xy *p;
+    const char *fname = "u64.hashlib";
+    uint64_t i;
+    int ok;
+
+    TEST("hashlib_u64");
+
+    hash = hashlib_u64_new(10);
+    hashlib_u64_set_free_function(hash, free);
+
+    ok = 1;
+
+    for (i = 0; ok && i < count; i++) {
+        p = calloc(1, sizeof(*p));
+
+        if (!p)
+            err(EXIT_FAILURE, "calloc");
+
+        p->x = i;
+        p->y = i + 1;
+        ok   = hashlib_u64_put(hash, i * 0x100000001ULL, p) == 1;
+    }
+
+    hashlib_u64_remove(hash, 0);
+
+    ok = ok && hashlib_u64_count(hash) == count - 1 && !hashlib_u64_get(hash, 0)
+         && !hashlib_u64_get(hash, 1);
+
+    hashlib_u64_store(hash, fname);
+    hashlib_u64_delete(hash);
+
+    hash = hashlib_u64_retrieve(fname, NULL, free);
+
+    ok = ok && hashlib_u64_count(hash) == count - 1;
+
+    for (i = 1; ok && i < count; i++) {
+        p  = hashlib_u64_get(hash, i * 0x100000001ULL);
+        ok = p && p->x == (int) i && p->y == (int) i + 1;
+    }
+
+    hashlib_u64_delete(hash);
+    unlink(fname);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_simd(void)
+{
+    struct hashlib_hash *hash;
+    char keys[200][128];
+    char miss[128];
+    int level, ok;
+    unsigned int i, j;
+    size_t len;
+
+    TEST("hashlib_simd");
+
+    /* a single slot puts every key in one bucket */
+    hash = hashlib_hash_new(1);
+    ok   = 1;
+
+    for (i = 0; i < 200; i++) {
+        len = i % 100 + 5;
+        memset(keys[i], 'a' + i % 26, len);
+        sprintf(keys[i], "%04u", i);
+        keys[i][4]   = 'a';
+        keys[i][len] = '\0';
+        hashlib_put(hash, keys[i], keys[i]);
+
+        /* every number of tags behind the last full 32 */
+        for (level = HASHLIB_SIMD_SCALAR; i < 70 && level <= HASHLIB_SIMD_AVX2;
+             level++) {
+            hashlib_set_simd_level(level);
+
+            for (j = 0; ok && j <= i; j++)
+                ok = hashlib_get(hash, keys[j]) == keys[j];
+
+            ok = ok && !hashlib_get(hash, "0000");
+        }
+    }
+
+    for (level = HASHLIB_SIMD_SCALAR; level <= HASHLIB_SIMD_AVX2; level++) {
+        ok = ok && hashlib_set_simd_level(level) <= level;
+
+        for (i = 0; ok && i < 200; i++) {
+            ok = hashlib_get(hash, keys[i]) == keys[i];
+
+            /* same length, last byte differs */
+            len = strlen(keys[i]);
+            memcpy(miss, keys[i], len + 1);
+            miss[len - 1] ^= 1;
+            ok = ok && !hashlib_get(hash, miss);
+        }
+    }
+
+    hashlib_set_simd_level(HASHLIB_SIMD_AVX2);
+    hashlib_hash_delete(hash);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_alloc(void)
+{
+    static int flags[] = {
+        HASHLIB_ALLOC_THP,
+        HASHLIB_ALLOC_HUGETLB,
+        HASHLIB_ALLOC_INTERLEAVE,
+        HASHLIB_ALLOC_THP | HASHLIB_ALLOC_BIND
+    };
+    struct hashlib_hash *hash;
+    struct hashlib_memory memory;
+    char key[32];
+    unsigned int i, j;
+    int ok;
+
+    TEST("hashlib_hash_new_alloc");
+
+    ok = 1;
+
+    for (i = 0; ok && i < sizeof(flags) / sizeof(*flags); i++) {
+        hash = hashlib_hash_new_alloc(100000, flags[i], 0);
+
+        for (j = 0; j < 1000; j++) {
+            sprintf(key, "key%u", j);
+            hashlib_put(hash, key, &flags[i]);
+        }
+
+        for (j = 0; ok && j < 1000; j++) {
+            sprintf(key, "key%u", j);
+            ok = hashlib_get(hash, key) == &flags[i];
+        }
+
+        hashlib_memory_stats(hash, &memory);
+
+        ok = ok && memory.slots >= hash->tblsize * sizeof(void *)
+             && memory.slots % sysconf(_SC_PAGESIZE) == 0;
+
+        hashlib_hash_delete(hash);
+    }
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_hash_new_lazy(void)
+{
+    struct hashlib_hash *hash;
+    unsigned long before, after;
+    char key[32];
+    unsigned int i;
+    int ok;
+
+    TEST("hashlib_hash_new lazy slot array");
+
+    before = get_VmRSS();
+
+    /* 2 GB of slots, only the pages of used slots are committed */
+    hash = hashlib_hash_new((size_t) 1 << 28);
+
+    for (i = 0; i < 1000; i++) {
+        sprintf(key, "key%u", i);
+        hashlib_put(hash, key, hash);
+    }
+
+    after = get_VmRSS();
+
+    ok = hash->tblsize == (size_t) 1 << 28 && after - before < 64UL << 20;
+
+    for (i = 0; ok && i < 1000; i++) {
+        sprintf(key, "key%u", i);
+        ok = hashlib_get(hash, key) == hash;
+    }
+
+    hashlib_hash_delete(hash);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_try(void)
+{
+    struct hashlib_hash *hash, *copy;
+    struct xy values[3];
+    const char *fname = "try.hashlib";
+    size_t h;
+    int fd;
+    int ok;
+
+    TEST("hashlib_try_*");
+
+    ok = hashlib_try_hash_new(&hash, 0) == -EINVAL && !hash
+         && hashlib_try_hash_new(&hash, HASHLIB_MAX_TBLSIZE + 1UL) == -EINVAL
+         && hashlib_try_hash_new_alloc(&hash, 10, HASHLIB_ALLOC_BIND, -1)
+            == -EINVAL
+         && !hashlib_try_hash_new(&hash, 10);
+
+    values[0].x = 1;
+    values[1].x = 2;
+    values[2].x = 3;
+
+    ok = ok && hashlib_try_put(hash, "a", &values[0]) == 1
+         && hashlib_try_put(hash, "b", &values[1]) == 1
+         && hashlib_try_put(hash, "a", &values[2]) == 0
+         && hashlib_get(hash, "a") == &values[0];
+
+    ok = ok && hashlib_try_store(hash, "/nonexistent/try.hashlib") == -ENOENT
+         && !hashlib_try_store(hash, fname)
+         && !hashlib_try_retrieve(&copy, fname, NULL, free)
+         && hashlib_count(copy) == 2
+         && ((struct xy *) hashlib_get(copy, "b"))->x == 2;
+
+    hashlib_hash_delete(copy);
+    hashlib_hash_delete(hash);
+
+    /* cut the file in the middle of the last entry */
+    ok = ok && !truncate(fname, 3 * sizeof(size_t) + 20)
+         && hashlib_try_retrieve(&copy, fname, NULL, free) == -EINVAL
+         && !copy;
+
+    fd = open(fname, O_WRONLY | O_TRUNC);
+    h  = 0x12345678;
+
+    ok = ok && fd != -1 && write(fd, &h, sizeof(h)) == sizeof(h)
+         && !close(fd)
+         && hashlib_try_retrieve(&copy, fname, NULL, free) == -EINVAL
+         && hashlib_try_retrieve(&copy, "/nonexistent/try.hashlib", NULL,
+                                 free) == -ENOENT;
+
+    unlink(fname);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+/* allocations fail once alloc_budget more have succeeded, never if it is
+ * negative; the library calls these instead of the ones of the C library */
+static int alloc_budget = -1;
+
+static int alloc_fails(void)
+{
+    if (alloc_budget < 0)
+        return 0;
+
+    if (!alloc_budget) {
+        errno = ENOMEM;
+        return 1;
+    }
+
+    alloc_budget--;
+
+    return 0;
+}
+
+void *malloc(size_t size)
+{
+    return alloc_fails() ? NULL : __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    return alloc_fails() ? NULL : __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    return alloc_fails() ? NULL : __libc_realloc(p, size);
+}
+
+#define HAVE_ALLOC_BUDGET 1
+#else
+/* the sanitizers bring their own allocator */
+static int alloc_budget = -1;
+
+#define HAVE_ALLOC_BUDGET 0
+#endif
+
+static int nomem_freed;
+
+void nomem_free(void *p)
+{
+    (void) p;
+
+    nomem_freed++;
+}
+
+int nomem_range(const char *key, void *value, void *arg)
+{
+    (void) key;
+    (void) value;
+    (void) arg;
+
+    return 0;
+}
+
+/*
+ * calls call with 0, 1, ... allocations allowed until it stops failing with
+ * -ENOMEM, check must hold after each failure; k counts the calls
+ */
+#define NOMEM_LOOP(ret, call, check) \
+        for (k = 0, (ret) = -ENOMEM; ok && (ret) == -ENOMEM; k++) { \
+            alloc_budget = k; \
+            (ret)        = (call); \
+            alloc_budget = -1; \
+            \
+            if ((ret) == -ENOMEM) \
+                ok = (check); \
+        }
+
+/*
+ * a try function failing with -ENOMEM leaves the table as it was and the
+ * value with the caller; every allocation of the call fails in turn
+ */
+void test_hashlib_try_nomem(void)
+{
+    struct hashlib_hash *hash, *clone, *copy;
+    struct hashlib_ingest *ingest;
+    struct hashlib_pool *pool;
+    static int v[102];
+    const char *fname = "nomem.hashlib";
+    const char *handle;
+    size_t bytes;
+    char key[16];
+    int i, k, ret, ordered, ok;
+
+    TEST("hashlib_try_* out of memory");
+
+    if (!HAVE_ALLOC_BUDGET) {
+        puts("skipped");
+        return;
+    }
+
+    ok          = 1;
+    nomem_freed = 0;
+
+    NOMEM_LOOP(ret, hashlib_try_hash_new(&hash, 1000), !hash);
+
+    ok = ok && !ret;
+
+    if (!ret)
+        hashlib_hash_delete(hash);
+
+    NOMEM_LOOP(ret, hashlib_try_hash_new_alloc(&hash, 1000, 0, -1), !hash);
+
+    ok = ok && !ret;
+
+    if (!ret)
+        hashlib_hash_delete(hash);
+
+    /* a clone makes the bucket of the new key shared, so it is copied */
+    for (ordered = 0; ok && ordered < 2; ordered++) {
+        hash = hashlib_hash_new(16);
+        hashlib_set_free_function(hash, nomem_free);
+        hashlib_set_ordered(hash, ordered);
+
+        for (i = 0; i < 100; i++) {
+            sprintf(key, "key%d", i);
+            hashlib_put(hash, key, &v[i]);
+        }
+
+        clone = hashlib_clone(hash);
+        bytes = hashlib_memory_usage(hash);
+
+        NOMEM_LOOP(ret, hashlib_try_put(hash, "new", &v[100]),
+                   hashlib_count(hash) == 100 && !hashlib_get(hash, "new")
+                   && hashlib_memory_usage(hash) == bytes && !nomem_freed);
+
+        ok = ok && k > 1 && ret == 1 && hashlib_get(hash, "new") == &v[100]
+             && hashlib_count(hash) == 101 && !hashlib_get(clone, "new")
+             && (!ordered || hashlib_range(hash, NULL, NULL, nomem_range, NULL)
+                             == 101);
+
+        /* the entry of key7 is shared with the clone and copied */
+        bytes = hashlib_memory_usage(hash);
+
+        NOMEM_LOOP(ret, hashlib_try_replace(hash, "key7", &v[101]),
+                   hashlib_get(hash, "key7") == &v[7]
+                   && hashlib_memory_usage(hash) == bytes && !nomem_freed);
+
+        ok = ok && k > 1 && !ret && hashlib_get(hash, "key7") == &v[101]
+             && hashlib_get(clone, "key7") == &v[7];
+
+        hashlib_hash_delete(clone);
+
+        NOMEM_LOOP(ret, hashlib_try_clone(&clone, hash), !clone);
+
+        ok = ok && k > 1 && !ret && hashlib_count(clone) == 101;
+
+        hashlib_hash_delete(clone);
+
+        /* disabling allocates nothing */
+        NOMEM_LOOP(ret, hashlib_try_set_ordered(hash, !ordered),
+                   (hash->order != NULL) == ordered);
+
+        ok = ok && k > 1 - ordered && !ret
+             && (hash->order != NULL) == !ordered;
+
+        NOMEM_LOOP(ret, hashlib_try_set_filter(hash, 10), !hash->filter);
+
+        ok = ok && k > 1 && !ret && hash->filter
+             && hashlib_get(hash, "key7") == &v[101];
+
+        NOMEM_LOOP(ret, hashlib_try_ingest_new(&ingest, hash, 2), !ingest);
+
+        ok = ok && k > 1 && !ret;
+
+        if (!ret)
+            hashlib_ingest_delete(ingest);
+
+        NOMEM_LOOP(ret, hashlib_try_store(hash, fname),
+                   access(fname, F_OK) == -1);
+
+        ok = ok && !ret;
+
+        hashlib_hash_delete(hash);
+
+        /* the values of hash and the one key7 had in the clone */
+        ok = ok && nomem_freed == 102;
+        nomem_freed = 0;
+
+        NOMEM_LOOP(ret, hashlib_try_retrieve(&copy, fname, NULL, free), !copy);
+
+        ok = ok && k > 1 && !ret && hashlib_count(copy) == 101;
+
+        if (!ret)
+            hashlib_hash_delete(copy);
+
+        unlink(fname);
+    }
+
+    /* interned keys */
+    NOMEM_LOOP(ret, hashlib_try_pool_new(&pool, 10), !pool);
+
+    ok = ok && k > 1 && !ret;
+
+    if (ret) {
+        failed();
+        return;
+    }
+
+    NOMEM_LOOP(ret, hashlib_try_intern(pool, "new", &handle),
+               !hashlib_pool_count(pool)
+               && !hashlib_interned(pool, "new"));
+
+    ok = ok && k > 1 && !ret && hashlib_pool_count(pool) == 1;
+
+    hash = hashlib_hash_new(16);
+    hashlib_set_pool(hash, pool);
+    hashlib_set_free_function(hash, nomem_free);
+
+    NOMEM_LOOP(ret, hashlib_try_put_interned(hash, handle, &v[100]),
+               !hashlib_count(hash) && !hashlib_get(hash, "new")
+               && !nomem_freed);
+
+    ok = ok && k > 1 && ret == 1 && hashlib_get(hash, "new") == &v[100];
+
+    hashlib_hash_delete(hash);
+    hashlib_pool_delete(pool);
+
+    ok = ok && nomem_freed == 1;
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+/* writes the fields one by one, to go through the custom pack path */
+void xy_pack(void *a, size_t bytes, int fd)
+{
+    struct xy *p = a;
+
+    (void) bytes;
+
+    if (write(fd, &p->x, sizeof(p->x)) != sizeof(p->x)
+        || write(fd, &p->y, sizeof(p->y)) != sizeof(p->y))
+        err(EXIT_FAILURE, "write");
+}
+
+void test_hashlib_stream(void)
+{
+    struct hashlib_hash *hash, *copy;
+    struct xy values[10000];
+    const char *fname = "stream.hashlib";
+    char key[32];
+    void *data, *file;
+    size_t len;
+    int fds[2];
+    int fd;
+    int i, ok;
+
+    TEST("hashlib_store_to, hashlib_retrieve_from");
+
+    hash = hashlib_hash_new(100);
+    hashlib_set_size_function(hash, xy_size);
+
+    for (i = 0; i < 10000; i++) {
+        values[i].x = i;
+        values[i].y = -i;
+        sprintf(key, "%d", i);
+        hashlib_put(hash, key, &values[i]);
+    }
+
+    /* a buffer holds the same bytes as the file */
+    hashlib_store(hash, fname);
+    file = malloc(len = 10000 * 64);
+    fd   = open(fname, O_RDONLY);
+    ok   = fd != -1 && read(fd, file, len) > 0;
+
+    ok = ok && !hashlib_store_buffer(hash, &data, &len)
+         && !memcmp(data, file, len) && read(fd, file, 1) == 0;
+
+    ok = ok && !hashlib_retrieve_buffer(&copy, data, len, NULL, free)
+         && hashlib_count(copy) == 10000;
+
+    for (i = 0; ok && i < 10000; i++) {
+        sprintf(key, "%d", i);
+        ok = ((struct xy *) hashlib_get(copy, key))->y == -i;
+    }
+
+    hashlib_hash_delete(copy);
+
+    ok = ok && hashlib_retrieve_buffer(&copy, data, len - 1, NULL, free)
+               == -EINVAL;
+
+    free(data);
+    free(file);
+    close(fd);
+    unlink(fname);
+    hashlib_hash_delete(hash);
+
+    /* a few entries fit into the pipe buffer */
+    hash = hashlib_hash_new(10);
+    hashlib_set_size_function(hash, xy_size);
+    hashlib_set_pack_function(hash, xy_pack);
+
+    for (i = 0; i < 100; i++) {
+        sprintf(key, "key%d", i);
+        hashlib_put(hash, key, &values[i]);
+    }
+
+    ok = ok && !pipe(fds) && !hashlib_store_fd(hash, fds[1]) && !close(fds[1])
+         && !hashlib_retrieve_fd(&copy, fds[0], NULL, free)
+         && hashlib_count(copy) == 100;
+
+    for (i = 0; ok && i < 100; i++) {
+        sprintf(key, "key%d", i);
+        ok = ((struct xy *) hashlib_get(copy, key))->x == i;
+    }
+
+    close(fds[0]);
+    hashlib_hash_delete(copy);
+    hashlib_hash_delete(hash);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+static int clone_freed;
+
+void clone_free(void *p)
+{
+    (void) p;
+
+    clone_freed++;
+}
+
+void test_hashlib_clone(void)
+{
+    struct hashlib_hash *hash, *clone;
+    static int values[1000];
+    char key[32];
+    int i, ok;
+
+    TEST("hashlib_clone");
+
+    clone_freed = 0;
+
+    hash = hashlib_hash_new(64);
+    hashlib_set_free_function(hash, clone_free);
+
+    for (i = 0; i < 1000; i++) {
+        sprintf(key, "%d", i);
+        hashlib_put(hash, key, &values[i]);
+    }
+
+    clone = hashlib_clone(hash);
+
+    /* every bucket of hash is changed, the clone keeps its view */
+    for (i = 0; i < 500; i++) {
+        sprintf(key, "%d", i);
+        hashlib_remove(hash, key);
+    }
+
+    hashlib_put(hash, "new", &values[0]);
+    hashlib_remove(clone, "999");
+
+    ok = clone_freed == 0 && hashlib_count(hash) == 501
+         && hashlib_count(clone) == 999 && !hashlib_get(clone, "new")
+         && !hashlib_get(hash, "0") && hashlib_get(clone, "0") == &values[0]
+         && hashlib_get(hash, "999") == &values[999];
+
+    for (i = 0; ok && i < 999; i++) {
+        sprintf(key, "%d", i);
+        ok = hashlib_get(clone, key) == &values[i];
+    }
+
+    /* shared values are freed once, by the last table */
+    hashlib_hash_delete(hash);
+
+    ok = ok && clone_freed == 2;
+
+    hashlib_hash_delete(clone);
+
+    ok = ok && clone_freed == 1001;
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+int merge_take_src(const char *key, void *dst_value, void *src_value)
+{
+    (void) dst_value;
+    (void) src_value;
+
+    return key[strlen(key) - 1] % 2 == 0;
+}
+
+void merge_count_diff(const char *key, void *a_value, void *b_value,
+                      void *arg)
+{
+    (void) key;
+
+    __atomic_add_fetch((int *) arg + !a_value + 2 * !b_value, 1,
+                       __ATOMIC_RELAXED);
+}
+
+void test_hashlib_merge(void)
+{
+    struct hashlib_hash *dst, *src, *clone;
+    struct hashlib_memory m, expect;
+    static int a[20000], b[20000];
+    int diffs[4];
+    char key[32];
+    size_t added;
+    int i, ok, round;
+
+    TEST("hashlib_merge, hashlib_diff");
+
+    ok = 1;
+
+    /* equal sizes with one thread, different sizes with four */
+    for (round = 0; ok && round < 2; round++) {
+        clone_freed = 0;
+
+        dst = hashlib_hash_new(1 << 14);
+        src = hashlib_hash_new(round ? 1 << 10 : 1 << 14);
+        hashlib_set_free_function(dst, clone_free);
+        hashlib_set_free_function(src, clone_free);
+
+        for (i = 0; i < 20000; i++) {
+            sprintf(key, "%d", i);
+
+            if (i < 15000)
+                hashlib_put(dst, key, &a[i]);
+
+            if (i >= 10000)
+                hashlib_put(src, key, &b[i]);
+        }
+
+        clone = hashlib_clone(src);
+
+        added = hashlib_merge(dst, src, merge_take_src, round ? 4 : 1);
+
+        /* the 2500 values of dst replaced by the conflict function */
+        ok = added == 5000 && hashlib_count(dst) == 20000
+             && hashlib_count(src) == 0 && clone_freed == 2500;
+
+        for (i = 0; ok && i < 20000; i++) {
+            sprintf(key, "%d", i);
+
+            if (i < 10000 || (i < 15000 && i % 2))
+                ok = hashlib_get(dst, key) == &a[i];
+            else
+                ok = hashlib_get(dst, key) == &b[i];
+        }
+
+        /* the clone of src differs from dst in the first 10000 keys and
+         * in the values of dst that were kept */
+        memset(diffs, 0, sizeof(diffs));
+
+        ok = ok && hashlib_diff(dst, clone, NULL, merge_count_diff, diffs,
+                                round ? 4 : 1) == 12500
+             && diffs[2] == 10000 && diffs[0] == 2500 && !diffs[1];
+
+        ok = ok && hashlib_diff(clone, clone, NULL, merge_count_diff, diffs,
+                                1) == 0;
+
+        hashlib_memory_stats(dst, &m);
+
+        hashlib_hash_delete(src);
+        hashlib_hash_delete(clone);
+
+        /* the 2500 entries of src that lost against dst */
+        ok = ok && clone_freed == 5000;
+
+        src = hashlib_hash_new(1 << 14);
+
+        for (i = 0; i < 20000; i++) {
+            sprintf(key, "%d", i);
+            hashlib_put(src, key, &a[i]);
+        }
+
+        hashlib_memory_stats(src, &expect);
+
+        ok = ok && m.keys == expect.keys && m.entries == expect.entries;
+
+        hashlib_hash_delete(src);
+        hashlib_hash_delete(dst);
+
+        ok = ok && clone_freed == 25000;
+    }
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+/* checks the values of a read only mapping of name, as the writer left them */
+int shm_check(const char *name, int round)
+{
+    struct hashlib_shm *shm;
+    const int *v;
+    char key[32];
+    size_t size;
+    int i, ok;
+
+    if (hashlib_shm_open(&shm, name, 0))
+        return 0;
+
+    ok = hashlib_shm_put(shm, "x", "", 0) == -EROFS
+         && hashlib_shm_count(shm) == (size_t) (round ? 999 : 1000);
+
+    for (i = 0; ok && i < 1000; i++) {
+        sprintf(key, "%d", i);
+        v = hashlib_shm_get(shm, key, &size);
+
+        if (round && !i)
+            ok = !v;
+        else
+            ok = v && size == sizeof(int) && *v == (round ? 2 * i : i);
+    }
+
+    hashlib_shm_close(shm);
+
+    return ok;
+}
+
+void test_hashlib_shm(void)
+{
+    struct hashlib_shm_memory m[2];
+    struct hashlib_shm *shm, *other;
+    struct hashlib_hash *hash;
+    struct xy xy[100];
+    const struct xy *p;
+    const int *old;
+    char name[64], key[32];
+    int fds[2][2];
+    uint64_t version;
+    size_t size;
+    pid_t pid;
+    int i, ok, status, value;
+    char c;
+    const char *fname = "store.hashlib";
+
+    TEST("hashlib_shm");
+
+    sprintf(name, "/hashlib-test-%d", (int) getpid());
+
+    hashlib_shm_unlink(name);
+
+    ok = hashlib_shm_create(&shm, name, 1000, 1 << 20) == 0;
+
+    for (i = 0; ok && i < 1000; i++) {
+        sprintf(key, "%d", i);
+        ok = hashlib_shm_put(shm, key, &i, sizeof(i)) == 1;
+    }
+
+    ok = ok && hashlib_shm_create(&other, name, 1000, 1 << 20) == -EEXIST
+         && !pipe(fds[0]) && !pipe(fds[1]);
+
+    if (!ok) {
+        failed();
+        return;
+    }
+
+    /* the child reads while the parent replaces and removes */
+    pid = fork();
+
+    if (!pid) {
+        close(fds[0][0]);
+        close(fds[1][1]);
+
+        ok = shm_check(name, 0);
+
+        ok = write(fds[0][1], "", 1) == 1 && read(fds[1][0], &c, 1) == 1
+             && ok && shm_check(name, 1);
+
+        _exit(!ok);
+    }
+
+    close(fds[0][1]);
+    close(fds[1][0]);
+
+    hashlib_shm_memory_stats(shm, &m[0]);
+
+    old     = hashlib_shm_get(shm, "7", NULL);
+    version = hashlib_shm_version(shm);
+    ok      = pid > 0 && read(fds[0][0], &c, 1) == 1;
+
+    for (i = 0; ok && i < 1000; i++) {
+        sprintf(key, "%d", i);
+        value = 2 * i;
+        ok    = hashlib_shm_put(shm, key, &value, sizeof(value)) == 0;
+    }
+
+    ok = ok && hashlib_shm_remove(shm, "0") == 1
+         && hashlib_shm_remove(shm, "0") == 0
+         && hashlib_shm_count(shm) == 999
+         && hashlib_shm_version(shm) == version + 1001
+         && *old == 7 && *(int *) hashlib_shm_get(shm, "7", NULL) == 14;
+
+    /* the replaced entries are as large as the new ones, "0" is one more */
+    hashlib_shm_memory_stats(shm, &m[1]);
+
+    ok = ok && m[0].bytes == 1 << 20 && !m[0].garbage
+         && m[1].garbage == (m[1].used - m[0].used) / 1000 * 1001;
+
+    ok = write(fds[1][1], "", 1) == 1 && ok;
+
+    ok = pid > 0 && waitpid(pid, &status, 0) == pid && ok
+         && WIFEXITED(status) && !WEXITSTATUS(status);
+
+    close(fds[0][0]);
+    close(fds[1][1]);
+
+    /* the replaced values fill the segment */
+    for (i = 0; ok && i < 1 << 20; i++) {
+        if ((status = hashlib_shm_put(shm, "7", &i, sizeof(i))) < 0)
+            break;
+    }
+
+    ok = ok && status == -ENOSPC && hashlib_shm_count(shm) == 999;
+
+    hashlib_shm_close(shm);
+    ok = ok && hashlib_shm_unlink(name) == 0
+         && hashlib_shm_open(&shm, name, 0) == -ENOENT;
+
+    /* a stored table */
+    hash = hashlib_hash_new(100);
+    hashlib_set_size_function(hash, xy_size);
+
+    for (i = 0; i < 100; i++) {
+        sprintf(key, "%d", i);
+        xy[i].x = i;
+        xy[i].y = -i;
+        hashlib_put(hash, key, &xy[i]);
+    }
+
+    hashlib_store(hash, fname);
+    hashlib_hash_delete(hash);
+
+    ok = ok && hashlib_shm_create(&shm, name, 100, 1 << 16) == 0
+         && hashlib_shm_load(shm, fname) == 0 && hashlib_shm_count(shm) == 100;
+
+    for (i = 0; ok && i < 100; i++) {
+        sprintf(key, "%d", i);
+        p  = hashlib_shm_get(shm, key, &size);
+        ok = p && size == sizeof(*p) && p->x == i && p->y == -i;
+    }
+
+    ok = ok && hashlib_shm_load(shm, "test.c") == -EINVAL;
+
+    if (shm) {
+        hashlib_shm_close(shm);
+        hashlib_shm_unlink(name);
+    }
+
+    unlink(fname);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_async(void)
+{
+    struct hashlib_hash *hash, *copy;
+    static struct xy values[200000];
+    static const int flags[] = {
+        0,
+        HASHLIB_AIO_THREAD,
+        HASHLIB_AIO_DIRECT,
+        HASHLIB_AIO_DIRECT | HASHLIB_AIO_THREAD
+    };
+    const char *fname = "async.hashlib";
+    char key[32];
+    void *data, *file;
+    size_t len;
+    ssize_t got;
+    int fd;
+    int i, j, ok;
+
+    TEST("hashlib_store_async, hashlib_retrieve_async");
+
+    hash = hashlib_hash_new(1 << 16);
+    hashlib_set_size_function(hash, xy_size);
+
+    /* a few megabytes, more than both buffers */
+    for (i = 0; i < 200000; i++) {
+        values[i].x = i;
+        values[i].y = -i;
+        sprintf(key, "%d", i);
+        hashlib_put(hash, key, &values[i]);
+    }
+
+    ok   = !hashlib_store_buffer(hash, &data, &len);
+    file = malloc(len + 1);
+
+    for (j = 0; ok && j < 4; j++) {
+        copy = NULL;
+        ok   = !hashlib_store_async(hash, fname, flags[j]);
+
+        /* the file holds the same bytes as a buffer */
+        fd  = open(fname, O_RDONLY);
+        got = fd == -1 ? -1 : read(fd, file, len + 1);
+        ok  = ok && got == (ssize_t) len && !memcmp(data, file, len);
+
+        if (fd != -1)
+            close(fd);
+
+        ok = ok && !hashlib_retrieve_async(&copy, fname, NULL, free, flags[j])
+             && hashlib_count(copy) == 200000;
+
+        for (i = 0; ok && i < 200000; i += 7) {
+            sprintf(key, "%d", i);
+            ok = ((struct xy *) hashlib_get(copy, key))->y == -i;
+        }
+
+        if (copy)
+            hashlib_hash_delete(copy);
+    }
+
+    /* truncated in the second buffer */
+    ok = ok && truncate(fname, len - 1) == 0
+         && hashlib_retrieve_async(&copy, fname, NULL, free, 0) == -EINVAL
+         && !copy;
+
+    unlink(fname);
+
+    ok = ok && hashlib_retrieve_async(&copy, fname, NULL, free, 0) == -ENOENT
+         && hashlib_store_async(hash, "/nonexistent/async.hashlib", 0)
+            == -ENOENT;
+
+    free(data);
+    free(file);
+    hashlib_hash_delete(hash);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_pool(void)
+{
+    struct hashlib_pool *pool;
+    struct hashlib_hash *english, *german, *clone;
+    struct hashlib_frozen *frozen;
+    struct hashlib_memory m;
+    static int a[1000], b[1000];
+    char *keys[1000];
+    void *values[1000];
+    const char *handle;
+    char key[32];
+    int i, ok;
+
+    TEST("hashlib_pool");
+
+    pool    = hashlib_pool_new(1000);
+    english = hashlib_hash_new(1000);
+    german  = hashlib_hash_new(1000);
+
+    hashlib_set_pool(english, pool);
+    hashlib_set_pool(german, pool);
+
+    for (i = 0; i < 1000; i++) {
+        sprintf(key, "key%d", i);
+        hashlib_put(english, key, &a[i]);
+        hashlib_put_interned(german, hashlib_intern(pool, key), &b[i]);
+    }
+
+    /* every key is stored once, in the pool */
+    hashlib_memory_stats(german, &m);
+
+    ok = hashlib_pool_count(pool) == 1000 && pool->tables == 2 && !m.keys
+         && hashlib_pool_memory_usage(pool) > 1000 * 5
+         && !hashlib_interned(pool, "cavallo")
+         && hashlib_interned(pool, "key7") == hashlib_intern(pool, "key7")
+         && hashlib_put(german, "key7", &b[7]) == 0;
+
+    for (i = 0; ok && i < 1000; i++) {
+        sprintf(key, "key%d", i);
+        handle = hashlib_interned(pool, key);
+
+        ok = handle && !strcmp(handle, key)
+             && hashlib_get_interned(english, handle) == &a[i]
+             && hashlib_get_interned(german, handle) == &b[i]
+             && hashlib_get(german, key) == &b[i];
+    }
+
+    ok = ok && hashlib_remove(english, "key7") == &a[7]
+         && !hashlib_get_interned(english, hashlib_intern(pool, "key7"))
+         && hashlib_get(german, "key7") == &b[7];
+
+    /* clones and merges keep the pool, a frozen table copies the keys */
+    clone = hashlib_clone(german);
+
+    ok = ok && pool->tables == 3
+         && hashlib_merge(english, clone, NULL, 2) == 1
+         && hashlib_get(english, "key7") == &b[7]
+         && hashlib_count(english) == 1000;
+
+    hashlib_hash_delete(clone);
+
+    frozen = hashlib_freeze(english);
+
+    ok = ok && hashlib_frozen_get(frozen, "key7") == &b[7]
+         && hashlib_frozen_get(frozen, "key999") == &a[999]
+         && pool->tables == 1;
+
+    hashlib_frozen_delete(frozen);
+    hashlib_hash_delete(german);
+
+    /* a build interns its keys, duplicates are discarded */
+    english = hashlib_hash_new(10);
+    hashlib_set_pool(english, pool);
+
+    for (i = 0; i < 1000; i++) {
+        keys[i]   = malloc(16);
+        values[i] = &a[i];
+        sprintf(keys[i], "key%d", i % 500 + 800);
+    }
+
+    ok = ok && hashlib_build(english, keys, values, 1000, 4, 0) == 500
+         && hashlib_pool_count(pool) == 1300
+         && hashlib_get_interned(english, hashlib_intern(pool, "key1299"))
+            == &a[499];
+
+    hashlib_memory_stats(english, &m);
+    ok = ok && !m.keys;
+
+    for (i = 0; i < 1000; i++)
+        free(keys[i]);
+
+    hashlib_hash_delete(english);
+    hashlib_pool_delete(pool);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+/* checks that the keys come in ascending order, stops after limit keys */
+struct ordered_walk {
+    char last[32];
+    size_t count;
+    size_t limit;
+    int ok;
+};
+
+int ordered_check(const char *key, void *value, void *arg)
+{
+    struct ordered_walk *w;
+
+    w = arg;
+
+    if ((w->count && strcmp(w->last, key) >= 0)
+        || strcmp((char *) value, key))
+        w->ok = 0;
+
+    snprintf(w->last, sizeof(w->last), "%s", key);
+
+    return ++w->count == w->limit;
+}
+
+/* number of keys in [lo, hi) if they are in order, else -1 */
+long ordered_walk(struct hashlib_hash *hash, const char *lo, const char *hi)
+{
+    struct ordered_walk w;
+    size_t calls;
+
+    memset(&w, 0, sizeof(w));
+    w.ok = 1;
+
+    calls = hashlib_range(hash, lo, hi, ordered_check, &w);
+
+    return w.ok && calls == w.count ? (long) calls : -1;
+}
+
+void test_hashlib_ordered(void)
+{
+    struct hashlib_hash *hash, *clone, *src;
+    struct hashlib_memory m;
+    struct ordered_walk w;
+    static char keys[20000][8];
+    char *build_keys[1000];
+    void *build_values[1000];
+    int i, k, ok;
+
+    TEST("hashlib_range, hashlib_prefix");
+
+    for (i = 0; i < 20000; i++)
+        sprintf(keys[i], "k%05d", i);
+
+    hash = hashlib_hash_new(1000);
+
+    /* half of the keys are bulk loaded, the others inserted */
+    for (i = 0; i < 20000; i++) {
+        if (i == 10000)
+            hashlib_set_ordered(hash, 1);
+
+        k = (int) ((i * 7919L) % 20000);
+        hashlib_put(hash, keys[k], keys[k]);
+    }
+
+    hashlib_memory_stats(hash, &m);
+
+    ok = m.order > 0 && ordered_walk(hash, NULL, NULL) == 20000
+         && ordered_walk(hash, "k01000", "k02000") == 1000
+         && ordered_walk(hash, "k019995", NULL) == 18000
+         && ordered_walk(hash, "a", "k") == 0
+         && ordered_walk(hash, "k2", NULL) == 0;
+
+    memset(&w, 0, sizeof(w));
+    w.ok    = 1;
+    w.limit = 5;
+
+    ok = ok && hashlib_prefix(hash, "k019", ordered_check, &w) == 5
+         && w.ok && !strcmp(w.last, "k01904");
+
+    w.count = w.limit = 0;
+
+    ok = ok && hashlib_prefix(hash, "k019", ordered_check, &w) == 100 && w.ok
+         && !strcmp(w.last, "k01999");
+
+    /* removals merge and free nodes */
+    for (i = 0; i < 20000; i++)
+        if (i % 3)
+            hashlib_remove(hash, keys[i]);
+
+    ok = ok && ordered_walk(hash, NULL, NULL) == 6667
+         && ordered_walk(hash, "k00003", "k00010") == 3;
+
+    /* a clone has its own index */
+    clone = hashlib_clone(hash);
+
+    ok = ok && hashlib_remove_prefix(clone, "k1") == 3333
+         && ordered_walk(clone, NULL, NULL) == 3334
+         && ordered_walk(hash, NULL, NULL) == 6667
+         && hashlib_count(clone) == 3334 && !hashlib_get(clone, "k10002");
+
+    ok = ok && hashlib_remove_prefix(clone, "") == 3334
+         && ordered_walk(clone, NULL, NULL) == 0
+         && hashlib_put(clone, keys[7], keys[7]) == 1
+         && ordered_walk(clone, NULL, NULL) == 1;
+
+    hashlib_hash_delete(clone);
+
+    /* merges and builds index the keys they add */
+    src = hashlib_hash_new(1000);
+
+    for (i = 0; i < 20000; i += 2)
+        hashlib_put(src, keys[i], keys[i]);
+
+    ok = ok && hashlib_merge(hash, src, NULL, 2) == 6666
+         && ordered_walk(hash, NULL, NULL) == 13333;
+
+    hashlib_hash_delete(src);
+
+    for (i = 0; i < 1000; i++) {
+        build_keys[i]   = keys[i + 1];
+        build_values[i] = keys[i + 1];
+    }
+
+    ok = ok && hashlib_build(hash, build_keys, build_values, 1000, 4, 0)
+               == 333
+         && ordered_walk(hash, NULL, NULL) == 13666
+         && ordered_walk(hash, "k00000", "k01002") == 1001;
+
+    hashlib_set_ordered(hash, 0);
+    hashlib_memory_stats(hash, &m);
+
+    ok = ok && !m.order && !hash->order;
+
+    hashlib_hash_delete(hash);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_filter(void)
+{
+    struct hashlib_hash *hash, *clone, *src;
+    struct hashlib_frozen *frozen;
+    struct hashlib_memory m;
+    const char *fname = "filter.hashlib";
+    static char keys[20000][8];
+    static int v[20000];
+    char *build_keys[1000];
+    void *build_values[1000];
+    char key[16];
+    int i, ok;
+
+    TEST("hashlib_set_filter");
+
+    hash = hashlib_hash_new(100);
+    hashlib_set_filter(hash, 10);
+
+    /* the filter grows with the table */
+    for (i = 0; i < 20000; i++) {
+        sprintf(keys[i], "f%d", i);
+
+        if (i < 10000)
+            hashlib_put(hash, keys[i], &v[i]);
+    }
+
+    hashlib_memory_stats(hash, &m);
+    ok = m.filter >= 10000 * 10 / 8 && hashlib_put(hash, keys[7], &v[0]) == 0;
+
+    for (i = 0; ok && i < 20000; i++)
+        ok = hashlib_get(hash, keys[i]) == (i < 10000 ? &v[i] : NULL);
+
+    /* removed keys stay in the filter until it is built again */
+    for (i = 0; i < 10000; i += 2)
+        hashlib_remove(hash, keys[i]);
+
+    for (i = 0; ok && i < 10000; i++)
+        ok = hashlib_get(hash, keys[i]) == (i % 2 ? &v[i] : NULL);
+
+    /* a clone has its own filter */
+    clone = hashlib_clone(hash);
+
+    ok = ok && hashlib_put(clone, keys[10000], &v[10000]) == 1
+         && hashlib_get(clone, keys[10000]) == &v[10000]
+         && !hashlib_get(hash, keys[10000]);
+
+    hashlib_hash_delete(clone);
+
+    /* merges and builds fill the filter again */
+    src = hashlib_hash_new(100);
+    hashlib_set_filter(src, 4);
+
+    for (i = 10000; i < 15000; i++)
+        hashlib_put(src, keys[i], &v[i]);
+
+    ok = ok && hashlib_merge(hash, src, NULL, 2) == 5000;
+
+    hashlib_hash_delete(src);
+
+    for (i = 0; i < 1000; i++) {
+        build_keys[i]   = keys[15000 + i];
+        build_values[i] = &v[15000 + i];
+    }
+
+    ok = ok && hashlib_build(hash, build_keys, build_values, 1000, 4, 0)
+               == 1000;
+
+    for (i = 1; ok && i < 20000; i++)
+        ok = hashlib_get(hash, keys[i])
+             == ((i < 10000 && i % 2) || (i >= 10000 && i < 16000)
+                 ? &v[i] : NULL);
+
+    /* a frozen table keeps the filter, also in its file */
+    clone  = hashlib_clone(hash);
+    frozen = hashlib_freeze(clone);
+
+    hashlib_frozen_store(frozen, fname);
+    hashlib_frozen_delete(frozen);
+
+    frozen = hashlib_frozen_retrieve(fname, NULL, free);
+
+    ok = ok && frozen->filter && hashlib_frozen_count(frozen) == 11000;
+
+    for (i = 1; ok && i < 20000; i++) {
+        sprintf(key, "%d", i);
+        ok = !hashlib_frozen_get(frozen, key)
+             && !hashlib_frozen_get(frozen, keys[i])
+                == !hashlib_get(hash, keys[i]);
+    }
+
+    hashlib_frozen_set_filter(frozen, 0);
+
+    ok = ok && !frozen->filter && hashlib_frozen_get(frozen, keys[1])
+         && !hashlib_frozen_get(frozen, keys[2]);
+
+    hashlib_frozen_delete(frozen);
+    unlink(fname);
+
+    hashlib_set_filter(hash, 0);
+    hashlib_memory_stats(hash, &m);
+
+    ok = ok && !m.filter && hashlib_get(hash, keys[1]) == &v[1];
+
+    hashlib_hash_delete(hash);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+size_t replace_size(void *value)
+{
+    return strlen(value) + 1;
+}
+
+/* stops unless value is one of the 1000 ints at arg */
+int replace_check(const char *key, void *value, void *arg)
+{
+    (void) key;
+
+    return (int *) value < (int *) arg || (int *) value >= (int *) arg + 1000;
+}
+
+void *replace_copy(void *value)
+{
+    return strdup(value);
+}
+
+void test_hashlib_replace(void)
+{
+    struct hashlib_hash *hash, *clone;
+    struct hashlib_pool *pool;
+    struct hashlib_memory m;
+    static int a[1000], b[1000];
+    void **ref;
+    char key[16];
+    int i, ok;
+
+    TEST("hashlib_replace, hashlib_get_ref");
+
+    clone_freed = 0;
+
+    hash = hashlib_hash_new(1000);
+    hashlib_set_free_function(hash, clone_free);
+    hashlib_set_ordered(hash, 1);
+
+    for (i = 0; i < 1000; i++) {
+        sprintf(key, "key%d", i);
+        hashlib_put(hash, key, &a[i]);
+    }
+
+    /* the old value is freed, a missing key is put */
+    ok = hashlib_replace(hash, "key1", &b[1]) == 0 && clone_freed == 1
+         && hashlib_get(hash, "key1") == &b[1]
+         && hashlib_replace(hash, "other", &b[2]) == 1
+         && hashlib_get(hash, "other") == &b[2]
+         && hashlib_count(hash) == 1001;
+
+    /* a clone keeps the values it shares with hash */
+    clone = hashlib_clone(hash);
+
+    for (i = 0; i < 1000; i++) {
+        sprintf(key, "key%d", i);
+        hashlib_replace(hash, key, &b[i]);
+    }
+
+    ok = ok && clone_freed == 1 && hashlib_get(clone, "key7") == &a[7]
+         && hashlib_get(hash, "key7") == &b[7]
+         && hashlib_get(clone, "key1") == &b[1]
+         && hashlib_range(hash, "key7", "key8", replace_check, b) == 111
+         && hashlib_range(clone, "key7", "key8", replace_check, a) == 111;
+
+    /* the old values of key0 to key999, "other" is still shared */
+    hashlib_hash_delete(clone);
+
+    ok = ok && clone_freed == 1001;
+
+    /* references update values in place */
+    ref = hashlib_get_ref(hash, "key3");
+
+    ok = ok && ref && *ref == &b[3] && !hashlib_get_ref(hash, "missing");
+
+    *ref = &a[3];
+
+    for (i = 0; ok && i < 100; i++) {
+        sprintf(key, "new%d", i);
+        hashlib_put(hash, key, &a[i]);
+    }
+
+    ok = ok && hashlib_get(hash, "key3") == &a[3]
+         && hashlib_get_ref(hash, "key3") == ref;
+
+    hashlib_hash_delete(hash);
+
+    /* a reference into an entry shared with a clone belongs to a copy of
+     * the entry and its value */
+    hash = hashlib_hash_new(10);
+    hashlib_set_free_function(hash, free);
+    hashlib_set_copy_function(hash, replace_copy);
+
+    hashlib_put(hash, "x", strdup("one"));
+    hashlib_put(hash, "y", strdup("two"));
+
+    clone = hashlib_clone(hash);
+    ref   = hashlib_get_ref(hash, "x");
+
+    ok = ok && ref && *ref != hashlib_get(clone, "x") && !strcmp(*ref, "one");
+
+    free(*ref);
+    *ref = strdup("three");
+
+    ok = ok && !strcmp(hashlib_get(clone, "x"), "one")
+         && !strcmp(hashlib_get(hash, "x"), "three")
+         && hashlib_get(hash, "y") == hashlib_get(clone, "y")
+         && hashlib_get_ref(hash, "x") == ref;
+
+    hashlib_hash_delete(clone);
+    hashlib_hash_delete(hash);
+
+    /* value accounting follows replaced values, keys may be interned */
+    pool = hashlib_pool_new(10);
+    hash = hashlib_hash_new(10);
+    hashlib_set_pool(hash, pool);
+    hashlib_set_value_accounting(hash, 1);
+    hashlib_set_size_function(hash, replace_size);
+
+    hashlib_put(hash, "x", "four");
+    hashlib_replace(hash, "x", "sixsix");
+    hashlib_memory_stats(hash, &m);
+
+    ok = ok && m.values == 7 && !m.keys && hashlib_pool_count(pool) == 1
+         && !strcmp(hashlib_get(hash, "x"), "sixsix");
+
+    hashlib_hash_delete(hash);
+    hashlib_pool_delete(pool);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
+void test_hashlib_ingest(void)
+{
+    const size_t count = 20000, batch = 777;
+    struct hashlib_hash *hash, *ref;
+    struct hashlib_ingest *ingest;
+    struct hashlib_memory m, mref;
+    struct hashlib_pool *pool;
+    char **keys;
+    void **values;
+    size_t i;
+    int ok;
+
+    TEST("hashlib_ingest");
+
+    keys   = calloc(count, sizeof(*keys));
+    values = calloc(count, sizeof(*values));
+
+    if (!keys || !values)
+        err(EXIT_FAILURE, "calloc");
+
+    /* every key is given twice */
+    for (i = 0; i < count; i++) {
+        if (asprintf(&keys[i], "key%05zu", i % (count / 2)) == -1)
+            err(EXIT_FAILURE, "asprintf");
+
+        values[i] = keys[i];
+    }
+
+    hash = hashlib_hash_new(count);
+    ref  = hashlib_hash_new(count);
+
+    hashlib_set_ordered(hash, 1);
+    hashlib_set_filter(hash, 10);
+
+    ingest = hashlib_ingest_new(hash, 4);
+
+    for (i = 0; i < count / 2; i += batch)
+        hashlib_ingest_submit(ingest, keys + i, values + i,
+                              count / 2 - i < batch ? count / 2 - i : batch);
+
+    ok = hashlib_ingest_flush(ingest) == count / 2
+         && hashlib_count(hash) == count / 2;
+
+    for (i = 0; i < count / 2; i++) {
+        hashlib_put(ref, keys[i], values[i]);
+        ok = ok && hashlib_get(hash, keys[i]) == values[i];
+    }
+
+    /* the same memory as with hashlib_put, the index and filter are up to
+     * date */
+    hashlib_memory_stats(hash, &m);
+    hashlib_memory_stats(ref, &mref);
+
+    ok = ok && m.keys == mref.keys && m.buckets == mref.buckets
+         && m.entries == mref.entries && m.filter
+         && ordered_walk(hash, "key01000", "key02000") == 1000
+         && !hashlib_get(hash, "key");
+
+    /* the duplicates are discarded */
+    hashlib_ingest_submit(ingest, keys + count / 2, values + count / 2,
+                          count / 2);
+
+    ok = ok && hashlib_ingest_flush(ingest) == 0
+         && hashlib_count(hash) == count / 2
+         && hashlib_get(hash, keys[count / 2]) == values[0];
+
+    hashlib_ingest_delete(ingest);
+    hashlib_hash_delete(hash);
+    hashlib_hash_delete(ref);
+
+    /* interned keys, delete flushes */
+    pool = hashlib_pool_new(count);
+    hash = hashlib_hash_new(count);
+    hashlib_set_pool(hash, pool);
+
+    ingest = hashlib_ingest_new(hash, 3);
+    hashlib_ingest_submit(ingest, keys, values, count);
+    hashlib_ingest_delete(ingest);
+
+    ok = ok && hashlib_count(hash) == count / 2
+         && hashlib_pool_count(pool) == count / 2
+         && hashlib_get(hash, keys[count - 1]) == values[count / 2 - 1];
+
+    hashlib_hash_delete(hash);
+    hashlib_pool_delete(pool);
+
+    for (i = 0; i < count; i++)
+        free(keys[i]);
+
+    free(keys);
+    free(values);
+
+    if (ok)
+        success();
+    else
+        failed();
+}
+
 int main(void)
 {
     int i;
@@ -517,9 +2375,30 @@ int main(void)
         test_hashlib_remove,
         test_free_function,
         test_hashlib_hash_delete,
-        test_1mio_entries,
+        test_hashlib_memory_usage,
+        test_hashlib_build,
         test_hashlib_store,
-        test_hashlib_retrieve
+        test_hashlib_retrieve,
+        test_hashlib_retrieve_legacy,
+        test_hashlib_freeze,
+        test_hashlib_frozen_retrieve,
+        test_hashlib_typed,
+        test_hashlib_u64,
+        test_hashlib_simd,
+        test_hashlib_alloc,
+        test_hashlib_hash_new_lazy,
+        test_hashlib_try,
+        test_hashlib_try_nomem,
+        test_hashlib_stream,
+        test_hashlib_clone,
+        test_hashlib_merge,
+        test_hashlib_shm,
+        test_hashlib_async,
+        test_hashlib_pool,
+        test_hashlib_ordered,
+        test_hashlib_filter,
+        test_hashlib_replace,
+        test_hashlib_ingest
     };
 
     srand(time(NULL) + getpid());
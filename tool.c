@@ -0,0 +1,963 @@
+/***
+    This file is part of hashlib.
+
+    Copyright 2012 Matthias Ruester
+
+    hashlib is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    hashlib is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with hashlib; if not, see <http://www.gnu.org/licenses>.
+***/
+
+/*
+ * hashlib-tool inspects, verifies, dumps and converts the files written by
+ * hashlib_store, hashlib_frozen_store and hashlib_u64_store.
+ *
+ * stat, verify and dump stream through the file; besides an occupancy
+ * counter per slot of a table file, the memory used is bounded by the
+ * largest key and value.  A defect is reported with its offset and the
+ * number of entries before it.  convert turns a table file into a frozen file,
+ * building the table from the mapped file with several threads, and a
+ * frozen file back into a table file.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <err.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashlib.h"
+#include "hashlib_private.h"
+
+/* stdio buffer of every file */
+#define TOOL_BUFFER (1 << 20)
+
+/* classes of a distribution: 0 and [2^(k-1), 2^k) for k = 1..64 */
+#define TOOL_CLASSES 65
+
+/* bucket lengths counted separately, longer ones are counted together */
+#define TOOL_OCCUPANCY 8
+
+/* a file read front to back */
+struct input {
+    const char *name;
+    FILE *f;
+    off_t offset;
+    off_t size;
+};
+
+/* distribution of key lengths or value sizes */
+struct dist {
+    size_t n;
+    size_t min;
+    size_t max;
+    double sum;
+    size_t class[TOOL_CLASSES];
+};
+
+struct scan;
+
+typedef void (*record_fn)(struct scan *, const char *, size_t, const char *,
+                          size_t);
+
+struct scan {
+    struct input in;
+    struct input values;    /* the values of a frozen file */
+    size_t magic;
+    size_t tblsize;         /* size of a table, capacity of a u64 table */
+    size_t slots;           /* of the table hashlib_retrieve builds */
+    size_t count;           /* entries according to the header */
+    size_t entries;         /* records read */
+    size_t buckets;         /* of a frozen table */
+    size_t keys_size;
+    size_t filter_bits;
+    size_t filter_blocks;
+    struct dist keys;
+    struct dist data;
+    unsigned char *occupancy;   /* entries per slot up to UCHAR_MAX */
+    char *key;
+    size_t key_size;
+    char *value;
+    size_t value_size;
+    off_t error_offset;
+    char error[256];        /* empty if the file is fine */
+    record_fn record;       /* called for every record, or NULL */
+    void *arg;
+};
+
+static void input_open(struct input *in, const char *name, off_t offset)
+{
+    struct stat st;
+
+    in->name = name;
+    in->f    = fopen(name, "r");
+
+    if (!in->f)
+        err(EXIT_FAILURE, "%s", name);
+
+    if (fstat(fileno(in->f), &st) == -1)
+        err(EXIT_FAILURE, "%s", name);
+
+    if (!S_ISREG(st.st_mode))
+        errx(EXIT_FAILURE, "%s: not a regular file", name);
+
+    setvbuf(in->f, NULL, _IOFBF, TOOL_BUFFER);
+
+    if (offset && fseeko(in->f, offset, SEEK_SET) == -1)
+        err(EXIT_FAILURE, "%s", name);
+
+    in->size   = st.st_size;
+    in->offset = offset;
+}
+
+static void input_close(struct input *in)
+{
+    if (in->f)
+        fclose(in->f);
+
+    in->f = NULL;
+}
+
+/* bytes left behind the current offset */
+static inline size_t input_left(struct input *in)
+{
+    return in->offset < in->size ? in->size - in->offset : 0;
+}
+
+/* returns the number of bytes read, less than bytes at the end of file */
+static size_t input_read(struct input *in, void *buf, size_t bytes)
+{
+    size_t got;
+
+    got = fread(buf, 1, bytes, in->f);
+
+    if (got < bytes && ferror(in->f))
+        err(EXIT_FAILURE, "%s", in->name);
+
+    in->offset += got;
+
+    return got;
+}
+
+static void input_skip(struct input *in, size_t bytes)
+{
+    if (fseeko(in->f, bytes, SEEK_CUR) == -1)
+        err(EXIT_FAILURE, "%s", in->name);
+
+    in->offset += bytes;
+}
+
+static void dist_add(struct dist *d, size_t v)
+{
+    if (!d->n || v < d->min)
+        d->min = v;
+
+    if (v > d->max)
+        d->max = v;
+
+    d->n++;
+    d->sum += v;
+    d->class[v ? 64 - __builtin_clzll(v) : 0]++;
+}
+
+/* records the first defect of the file, always returns -1 */
+static int scan_fail(struct scan *s, off_t offset, const char *format, ...)
+{
+    va_list ap;
+
+    s->error_offset = offset;
+
+    va_start(ap, format);
+    vsnprintf(s->error, sizeof(s->error), format, ap);
+    va_end(ap);
+
+    return -1;
+}
+
+static int scan_size(struct scan *s, struct input *in, size_t *v,
+                     const char *what)
+{
+    off_t at;
+
+    at = in->offset;
+
+    if (input_read(in, v, sizeof(*v)) != sizeof(*v))
+        return scan_fail(s, at, "unable to read %s", what);
+
+    return 0;
+}
+
+/* reads bytes bytes into *buf if keep is set, else skips them */
+static int scan_bytes(struct scan *s, struct input *in, char **buf,
+                      size_t *size, size_t bytes, int keep, const char *what)
+{
+    off_t at;
+
+    at = in->offset;
+
+    if (bytes > input_left(in))
+        return scan_fail(s, at, "%s of %zu bytes runs past the end of file",
+                         what, bytes);
+
+    if (!keep) {
+        input_skip(in, bytes);
+        return 0;
+    }
+
+    if (hashlib_reserve(buf, size, bytes + 1))
+        err(EXIT_FAILURE, "realloc");
+
+    if (input_read(in, *buf, bytes) != bytes)
+        return scan_fail(s, at, "unable to read %s", what);
+
+    (*buf)[bytes] = '\0';
+
+    return 0;
+}
+
+/* reads a null terminated key that ends before end */
+static int scan_string(struct scan *s, struct input *in, off_t end,
+                       size_t *len)
+{
+    off_t at;
+    int c;
+
+    at   = in->offset;
+    *len = 0;
+
+    for (;;) {
+        if (in->offset >= end)
+            return scan_fail(s, at, "key %zu runs past the keys", s->entries);
+
+        c = getc_unlocked(in->f);
+
+        if (c == EOF)
+            return scan_fail(s, at, "unable to read keys");
+
+        in->offset++;
+
+        if (hashlib_reserve(&s->key, &s->key_size, *len + 1))
+            err(EXIT_FAILURE, "realloc");
+
+        s->key[*len] = c;
+
+        if (!c)
+            return 0;
+
+        (*len)++;
+    }
+}
+
+/* header, number of slots, count, then size, data, size and key of every
+ * entry */
+static int scan_table(struct scan *s)
+{
+    struct input *in;
+    size_t data_len, key_len, len;
+    unsigned int h;
+    unsigned char *n;
+    off_t at;
+
+    in = &s->in;
+
+    if (scan_size(s, in, &s->tblsize, "table size")
+        || scan_size(s, in, &s->count, "entry count"))
+        return -1;
+
+    if (!s->tblsize || s->tblsize > HASHLIB_MAX_TBLSIZE)
+        return scan_fail(s, sizeof(size_t), "invalid table size %zu",
+                         s->tblsize);
+
+    /* older files store any size, tables round it up to a power of two */
+    for (s->slots = 1; s->slots < s->tblsize; s->slots <<= 1)
+        ;
+
+    /* pages of slots that stay empty are never touched */
+    s->occupancy = calloc(s->slots, sizeof(*(s->occupancy)));
+
+    if (!s->occupancy)
+        err(EXIT_FAILURE, "calloc");
+
+    while (input_left(in)) {
+        at = in->offset;
+
+        if (scan_size(s, in, &data_len, "size of data")
+            || scan_bytes(s, in, &s->value, &s->value_size, data_len,
+                          s->record != NULL, "data")
+            || scan_size(s, in, &key_len, "size of key")
+            || scan_bytes(s, in, &s->key, &s->key_size, key_len, 1, "key"))
+            return -1;
+
+        /* hashlib_retrieve would cut the key at the null byte */
+        h = hashlib_index_len(s->key, &len);
+
+        if (len != key_len)
+            return scan_fail(s, at, "key contains a null byte");
+
+        n = &s->occupancy[hashlib_slot(h, s->slots)];
+
+        if (*n < UCHAR_MAX)
+            (*n)++;
+
+        dist_add(&s->keys, key_len);
+        dist_add(&s->data, data_len);
+
+        if (s->record)
+            s->record(s, s->key, key_len, s->value, data_len);
+
+        s->entries++;
+    }
+
+    if (s->entries != s->count)
+        return scan_fail(s, in->offset, "%zu entries, the header counts %zu",
+                         s->entries, s->count);
+
+    return 0;
+}
+
+/* see hashlib_frozen_store; the keys and the values are read at once
+ * through two streams */
+static int scan_frozen(struct scan *s)
+{
+    struct input *in;
+    size_t seed, data_len, len;
+    off_t end;
+
+    in = &s->in;
+
+    if (scan_size(s, in, &s->count, "entry count")
+        || scan_size(s, in, &s->buckets, "number of buckets")
+        || scan_size(s, in, &seed, "seed")
+        || scan_size(s, in, &s->keys_size, "size of keys"))
+        return -1;
+
+    if (s->buckets != s->count / HASHLIB_FROZEN_BUCKET_SIZE + 1)
+        return scan_fail(s, 2 * sizeof(size_t), "invalid number of buckets");
+
+    if (s->buckets > input_left(in) / sizeof(unsigned int))
+        return scan_fail(s, in->offset, "unable to read pilots");
+
+    input_skip(in, s->buckets * sizeof(unsigned int));
+
+    if (s->magic == HASHLIB_FROZEN_FILTER_FILE_HEADER) {
+        if (scan_size(s, in, &s->filter_bits, "bits per key of filter")
+            || scan_size(s, in, &s->filter_blocks, "filter blocks"))
+            return -1;
+
+        if (!s->filter_bits || s->filter_bits > 64)
+            return scan_fail(s, in->offset - 2 * sizeof(size_t),
+                             "invalid filter");
+
+        if (s->filter_blocks > input_left(in) / sizeof(uint32_t)
+                               / HASHLIB_FILTER_WORDS)
+            return scan_fail(s, in->offset, "unable to read filter");
+
+        input_skip(in, s->filter_blocks * HASHLIB_FILTER_WORDS
+                       * sizeof(uint32_t));
+    }
+
+    if (s->keys_size > input_left(in))
+        return scan_fail(s, in->offset, "unable to read keys");
+
+    end = in->offset + s->keys_size;
+
+    input_open(&s->values, in->name, end);
+
+    while (s->entries < s->count) {
+        if (scan_string(s, in, end, &len)
+            || scan_size(s, &s->values, &data_len, "size of data")
+            || scan_bytes(s, &s->values, &s->value, &s->value_size, data_len,
+                          s->record != NULL, "data"))
+            return -1;
+
+        dist_add(&s->keys, len);
+        dist_add(&s->data, data_len);
+
+        if (s->record)
+            s->record(s, s->key, len, s->value, data_len);
+
+        s->entries++;
+    }
+
+    if (in->offset != end)
+        return scan_fail(s, in->offset, "%jd bytes of keys after key %zu",
+                         (intmax_t) (end - in->offset), s->count);
+
+    if (input_left(&s->values))
+        return scan_fail(s, s->values.offset, "%zu bytes after the last value",
+                         input_left(&s->values));
+
+    return 0;
+}
+
+/* header, capacity, count, then size, data and key of every entry */
+static int scan_u64(struct scan *s)
+{
+    struct input *in;
+    size_t data_len;
+    uint64_t key;
+    off_t at;
+
+    in = &s->in;
+
+    if (scan_size(s, in, &s->tblsize, "table size")
+        || scan_size(s, in, &s->count, "entry count"))
+        return -1;
+
+    while (input_left(in)) {
+        if (scan_size(s, in, &data_len, "size of data")
+            || scan_bytes(s, in, &s->value, &s->value_size, data_len,
+                          s->record != NULL, "data"))
+            return -1;
+
+        at = in->offset;
+
+        if (input_read(in, &key, sizeof(key)) != sizeof(key))
+            return scan_fail(s, at, "unable to read key");
+
+        dist_add(&s->keys, sizeof(key));
+        dist_add(&s->data, data_len);
+
+        if (s->record)
+            s->record(s, (char *) &key, sizeof(key), s->value, data_len);
+
+        s->entries++;
+    }
+
+    if (s->entries != s->count)
+        return scan_fail(s, in->offset, "%zu entries, the header counts %zu",
+                         s->entries, s->count);
+
+    return 0;
+}
+
+/* reads filename, returns 0 or -1 with s->error set */
+static int scan(struct scan *s, const char *filename)
+{
+    input_open(&s->in, filename, 0);
+
+    if (scan_size(s, &s->in, &s->magic, "filetype"))
+        return -1;
+
+    switch (s->magic) {
+    case HASHLIB_FILE_HEADER:
+        return scan_table(s);
+    case HASHLIB_FROZEN_FILE_HEADER:
+    case HASHLIB_FROZEN_FILTER_FILE_HEADER:
+        return scan_frozen(s);
+    case HASHLIB_U64_FILE_HEADER:
+        return scan_u64(s);
+    }
+
+    return scan_fail(s, 0, "not a hashlib file, filetype 0x%zX", s->magic);
+}
+
+static void scan_free(struct scan *s)
+{
+    input_close(&s->in);
+    input_close(&s->values);
+
+    free(s->occupancy);
+    free(s->key);
+    free(s->value);
+}
+
+static const char *format_name(size_t magic)
+{
+    switch (magic) {
+    case HASHLIB_FILE_HEADER:
+        return "table";
+    case HASHLIB_FROZEN_FILE_HEADER:
+        return "frozen";
+    case HASHLIB_FROZEN_FILTER_FILE_HEADER:
+        return "frozen with filter";
+    case HASHLIB_U64_FILE_HEADER:
+        return "u64";
+    }
+
+    return "unknown";
+}
+
+static void dist_print(const char *name, struct dist *d)
+{
+    char range[48];
+    size_t lo, hi;
+    unsigned int k;
+
+    if (!d->n)
+        return;
+
+    printf("%s: min %zu, max %zu, mean %.1f\n", name, d->min, d->max,
+           d->sum / d->n);
+
+    for (k = 0; k < TOOL_CLASSES; k++) {
+        if (!d->class[k])
+            continue;
+
+        lo = k ? (size_t) 1 << (k - 1) : 0;
+        hi = k ? lo + (lo - 1) : 0;
+
+        snprintf(range, sizeof(range), "%zu-%zu", lo, hi);
+        printf("  %-12s %zu\n", range, d->class[k]);
+    }
+}
+
+/* the buckets a table retrieved from the file would have */
+static void occupancy_print(struct scan *s)
+{
+    size_t count[TOOL_OCCUPANCY + 1];
+    size_t i, used;
+    unsigned int n, longest;
+
+    memset(count, 0, sizeof(count));
+    longest = 0;
+
+    for (i = 0; i < s->slots; i++) {
+        n = s->occupancy[i];
+        count[n < TOOL_OCCUPANCY ? n : TOOL_OCCUPANCY]++;
+
+        if (n > longest)
+            longest = n;
+    }
+
+    used = s->slots - count[0];
+
+    printf("buckets: %zu slots, %zu used (%.1f%%), load %.2f, longest %u%s\n",
+           s->slots, used, 100.0 * used / s->slots,
+           (double) s->entries / s->slots, longest,
+           longest == UCHAR_MAX ? "+" : "");
+
+    for (n = 0; n <= TOOL_OCCUPANCY; n++)
+        printf("  %u%-11s %zu\n", n, n == TOOL_OCCUPANCY ? "+" : "", count[n]);
+}
+
+static void print_error(struct scan *s)
+{
+    fprintf(stderr, "%s: offset %jd, after %zu entries: %s\n", s->in.name,
+            (intmax_t) s->error_offset, s->entries, s->error);
+}
+
+static int cmd_stat(const char *filename)
+{
+    struct scan s;
+    int ret;
+
+    memset(&s, 0, sizeof(s));
+
+    ret = scan(&s, filename);
+
+    printf("file: %s, %jd bytes\n", filename, (intmax_t) s.in.size);
+    printf("format: %s, filetype 0x%zX\n", format_name(s.magic), s.magic);
+    printf("entries: %zu, header count %zu\n", s.entries, s.count);
+
+    if (s.magic == HASHLIB_U64_FILE_HEADER)
+        printf("capacity: %zu\n", s.tblsize);
+
+    if (s.slots)
+        printf("table size: %zu\n", s.tblsize);
+
+    if (s.buckets)
+        printf("frozen buckets: %zu, keys %zu bytes\n", s.buckets,
+               s.keys_size);
+
+    if (s.filter_bits)
+        printf("filter: %zu bits per key, %zu blocks\n", s.filter_bits,
+               s.filter_blocks);
+
+    dist_print("key length", &s.keys);
+    dist_print("value size", &s.data);
+
+    if (s.occupancy)
+        occupancy_print(&s);
+
+    if (ret)
+        print_error(&s);
+
+    scan_free(&s);
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int cmd_verify(const char *filename)
+{
+    struct scan s;
+    int ret;
+
+    memset(&s, 0, sizeof(s));
+
+    ret = scan(&s, filename);
+
+    if (ret)
+        print_error(&s);
+    else
+        printf("%s: ok, %s, %zu entries\n", filename, format_name(s.magic),
+               s.entries);
+
+    scan_free(&s);
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* non printable bytes, backslashes and tabs of keys are escaped */
+static void dump_key(const char *key, size_t len)
+{
+    unsigned char c;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        c = key[i];
+
+        if (c == '\\' || c == '\t' || c < 0x20 || c >= 0x7F)
+            printf("\\x%02X", c);
+        else
+            putchar_unlocked(c);
+    }
+}
+
+/* key, size and value in hex, separated by tabs */
+static void dump_record(struct scan *s, const char *key, size_t key_len,
+                        const char *data, size_t data_len)
+{
+    uint64_t k;
+    size_t i;
+
+    if (s->magic == HASHLIB_U64_FILE_HEADER) {
+        memcpy(&k, key, sizeof(k));
+        printf("%" PRIu64, k);
+    } else {
+        dump_key(key, key_len);
+    }
+
+    printf("\t%zu\t", data_len);
+
+    for (i = 0; i < data_len; i++)
+        printf("%02X", (unsigned char) data[i]);
+
+    putchar_unlocked('\n');
+}
+
+static int cmd_dump(const char *filename)
+{
+    struct scan s;
+    int ret;
+
+    memset(&s, 0, sizeof(s));
+
+    s.record = dump_record;
+
+    setvbuf(stdout, NULL, _IOFBF, TOOL_BUFFER);
+
+    ret = scan(&s, filename);
+
+    fflush(stdout);
+
+    if (ret)
+        print_error(&s);
+
+    scan_free(&s);
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* values of a mapped table file point to their size, followed by the data */
+static HASHLIB_FCT_SIZE(value_size, value)
+{
+    size_t bytes;
+
+    memcpy(&bytes, value, sizeof(bytes));
+
+    return bytes;
+}
+
+static HASHLIB_FCT_PACK(value_pack, value, bytes, fd)
+{
+    hashlib_write(fd, (char *) value + sizeof(size_t), bytes);
+}
+
+/* the record at *pos of a mapped table file; returns the offset of its key
+ * and moves *pos behind it */
+static size_t map_record(const char *name, const char *map, size_t size,
+                         size_t *pos, size_t *key_len)
+{
+    size_t at, data_len;
+
+    at = *pos;
+
+    if (size - *pos < sizeof(data_len))
+        errx(EXIT_FAILURE, "%s: offset %zu: unable to read size of data",
+             name, at);
+
+    memcpy(&data_len, map + *pos, sizeof(data_len));
+    *pos += sizeof(data_len);
+
+    if (data_len > size - *pos || size - *pos - data_len < sizeof(*key_len))
+        errx(EXIT_FAILURE, "%s: offset %zu: unable to read data", name, at);
+
+    *pos += data_len;
+    memcpy(key_len, map + *pos, sizeof(*key_len));
+    *pos += sizeof(*key_len);
+
+    if (*key_len > size - *pos)
+        errx(EXIT_FAILURE, "%s: offset %zu: unable to read key", name, at);
+
+    *pos += *key_len;
+
+    return *pos - *key_len;
+}
+
+/* the table is built from the mapped file by threads and frozen */
+static void convert_table(const char *input, const char *output,
+                          unsigned int threads, unsigned int bits)
+{
+    struct hashlib_frozen *frozen;
+    struct hashlib_hash *hash;
+    struct stat st;
+    size_t header[3];
+    size_t size, pos, key, key_len, n, i, arena_bytes;
+    char *map, *arena;
+    char **keys;
+    void **values;
+    int fd;
+
+    fd = open(input, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+        err(EXIT_FAILURE, "%s", input);
+
+    size = st.st_size;
+
+    if (size < sizeof(header))
+        errx(EXIT_FAILURE, "%s: unable to read header", input);
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map == MAP_FAILED)
+        err(EXIT_FAILURE, "%s", input);
+
+    madvise(map, size, MADV_SEQUENTIAL);
+    memcpy(header, map, sizeof(header));
+
+    /* the first pass sizes the key arena */
+    n           = 0;
+    arena_bytes = 0;
+
+    for (pos = sizeof(header); pos < size; n++) {
+        map_record(input, map, size, &pos, &key_len);
+        arena_bytes += key_len + 1;
+    }
+
+    if (n != header[2])
+        errx(EXIT_FAILURE, "%s: %zu entries, the header counts %zu", input, n,
+             header[2]);
+
+    keys   = hashlib_calloc(n + 1, sizeof(*keys));
+    values = hashlib_calloc(n + 1, sizeof(*values));
+    arena  = hashlib_calloc(arena_bytes + 1, 1);
+
+    for (pos = sizeof(header), i = 0, arena_bytes = 0; i < n; i++) {
+        values[i] = map + pos;
+        key       = map_record(input, map, size, &pos, &key_len);
+        keys[i]   = arena + arena_bytes;
+
+        memcpy(keys[i], map + key, key_len);
+        arena_bytes += key_len + 1;
+    }
+
+    hash = hashlib_hash_new(n ? n : 1);
+
+    hashlib_set_size_function(hash, value_size);
+    hashlib_set_pack_function(hash, value_pack);
+    hashlib_build(hash, keys, values, n, threads, 0);
+
+    /* hash is consumed */
+    frozen = hashlib_freeze(hash);
+
+    if (bits)
+        hashlib_frozen_set_filter(frozen, bits);
+
+    hashlib_frozen_store(frozen, output);
+
+    printf("%s: %zu entries, %zu duplicates dropped\n", output,
+           hashlib_frozen_count(frozen), n - hashlib_frozen_count(frozen));
+
+    hashlib_frozen_delete(frozen);
+
+    free(keys);
+    free(values);
+    free(arena);
+
+    munmap(map, size);
+    close(fd);
+}
+
+/* writes the records of a frozen file in the format of hashlib_store */
+static void convert_record(struct scan *s, const char *key, size_t key_len,
+                           const char *data, size_t data_len)
+{
+    FILE *out;
+
+    out = s->arg;
+
+    fwrite(&data_len, sizeof(data_len), 1, out);
+    fwrite(data, 1, data_len, out);
+    fwrite(&key_len, sizeof(key_len), 1, out);
+    fwrite(key, 1, key_len, out);
+}
+
+/* streams the frozen file into a table file, the header is written last */
+static void convert_frozen(const char *input, const char *output)
+{
+    struct scan s;
+    size_t header[3];
+    FILE *out;
+    int ret;
+
+    out = fopen(output, "w");
+
+    if (!out)
+        err(EXIT_FAILURE, "%s", output);
+
+    setvbuf(out, NULL, _IOFBF, TOOL_BUFFER);
+
+    memset(&s, 0, sizeof(s));
+    memset(header, 0, sizeof(header));
+
+    fwrite(header, sizeof(header), 1, out);
+
+    s.record = convert_record;
+    s.arg    = out;
+
+    if (scan(&s, input)) {
+        print_error(&s);
+        fclose(out);
+        unlink(output);
+        exit(EXIT_FAILURE);
+    }
+
+    /* the table size of hashlib_hash_new for the entries */
+    header[0] = HASHLIB_FILE_HEADER;
+    header[1] = 1;
+    header[2] = s.entries;
+
+    while (header[1] < s.entries && header[1] < HASHLIB_MAX_TBLSIZE)
+        header[1] <<= 1;
+
+    ret = fseeko(out, 0, SEEK_SET) == -1
+          || fwrite(header, sizeof(header), 1, out) != 1;
+
+    if (fclose(out) == EOF || ret) {
+        unlink(output);
+        err(EXIT_FAILURE, "%s", output);
+    }
+
+    printf("%s: %zu entries\n", output, s.entries);
+
+    scan_free(&s);
+}
+
+static int cmd_convert(int argc, char *argv[])
+{
+    struct input in;
+    size_t magic;
+    unsigned int threads, bits;
+    long cpus;
+    int opt;
+
+    cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+    bits    = 0;
+
+    while ((opt = getopt(argc, argv, "j:b:")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            bits = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (argc - optind != 2 || bits > 64)
+        return -1;
+
+    memset(&in, 0, sizeof(in));
+    input_open(&in, argv[optind], 0);
+
+    if (input_read(&in, &magic, sizeof(magic)) != sizeof(magic))
+        errx(EXIT_FAILURE, "%s: unable to read filetype", argv[optind]);
+
+    input_close(&in);
+
+    if (magic == HASHLIB_FILE_HEADER)
+        convert_table(argv[optind], argv[optind + 1], threads, bits);
+    else if (magic == HASHLIB_FROZEN_FILE_HEADER
+             || magic == HASHLIB_FROZEN_FILTER_FILE_HEADER)
+        convert_frozen(argv[optind], argv[optind + 1]);
+    else
+        errx(EXIT_FAILURE, "%s: unable to convert a %s file", argv[optind],
+             format_name(magic));
+
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s stat|verify|dump file\n"
+            "       %s convert [-j threads] [-b bits] input output\n"
+            "  stat     entries, key lengths, value sizes and buckets\n"
+            "  verify   checks the structure, reports the first defect\n"
+            "  dump     key, size and hex value of every entry\n"
+            "  convert  a table file to a frozen file and back\n"
+            "  -j  threads building the table (default all cpus)\n"
+            "  -b  bits per key of a filter of the frozen file\n",
+            name, name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    if (argc < 2)
+        usage(argv[0]);
+
+    ret = -1;
+
+    if (!strcmp(argv[1], "convert"))
+        ret = cmd_convert(argc - 1, argv + 1);
+    else if (argc != 3)
+        usage(argv[0]);
+    else if (!strcmp(argv[1], "stat"))
+        ret = cmd_stat(argv[2]);
+    else if (!strcmp(argv[1], "verify"))
+        ret = cmd_verify(argv[2]);
+    else if (!strcmp(argv[1], "dump"))
+        ret = cmd_dump(argv[2]);
+
+    if (ret == -1)
+        usage(argv[0]);
+
+    return ret;
+}